@@ -0,0 +1,304 @@
+#include "cache.h"
+#include "fs.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#define SECTORS (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE)
+
+// the cache of one disk
+struct cache {
+    // the tree walk reads through the cache from several threads
+    pthread_mutex_t lock;
+    struct {
+        int block;        // only valid while slot_of points back to the slot
+        int referenced;   // second chance of the clock
+        unsigned int dirty;   // bit i set when sector i is newer than the disk
+    } slots[CACHE_SLOTS];
+    // apart from the slots, so that every block is aligned for direct I/O
+    _Alignas(DISK_DIRECT_ALIGN) char data[CACHE_SLOTS][FS_BLOCK_SIZE];
+    short slot_of[FS_BLOCK_COUNT];   // slot + 1 of a cached block, 0 when not cached
+    unsigned int gens[FS_BLOCK_COUNT];
+    int hand;
+    int written;    // blocks written to the disk since the last cache_flush
+    struct cache_stat stat;
+};
+
+static struct cache caches[DISK_MAX] = {
+    [0 ... DISK_MAX - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+static int (*write_hook)(int phase, unsigned int index, const char* data);
+
+void cache_set_hook(int (*hook)(int phase, unsigned int index, const char* data))
+{
+    write_hook = hook;
+}
+
+int cache_lookup(unsigned int index, char* buf, unsigned int* gen)
+{
+    struct cache* c = &caches[disk_selected()];
+    int s;
+    pthread_mutex_lock(&c->lock);
+    if ((s = c->slot_of[index] - 1) >= 0 && buf != NULL)
+    {
+        memcpy(buf, c->data[s], FS_BLOCK_SIZE);
+        c->slots[s].referenced = 1;
+        c->stat.hits++;
+    }
+    else if (s < 0)
+    {
+        *gen = c->gens[index];
+        if (buf != NULL)
+            c->stat.misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return s >= 0 ? 0 : -1;
+}
+
+// the dirty sectors of a slot, whole blocks in direct mode, which cannot write
+// less than an aligned block without reading it back first
+static unsigned int dirty_mask(struct cache* c, int s)
+{
+    return c->slots[s].dirty && disk_get_direct() ? (1u << SECTORS) - 1 : c->slots[s].dirty;
+}
+
+// the slots order[from..to) have all their sectors on the disk now
+static void mark_clean(struct cache* c, const int* order, int from, int to)
+{
+    for (int k=from; k<to; ++k)
+    {
+        c->slots[order[k]].dirty = 0;
+        c->stat.dirty--;
+        c->stat.writebacks++;
+        c->written++;
+    }
+}
+
+// report the slots order[0..n) to the hook before any of them goes to the disk
+static int hook_before(struct cache* c, const int* order, int n)
+{
+    if (write_hook == NULL)
+        return 0;
+    for (int k=0; k<n; ++k)
+        if (write_hook(CACHE_HOOK_BLOCK, c->slots[order[k]].block, c->data[order[k]]) < 0)
+            return -1;
+    return write_hook(CACHE_HOOK_BEFORE, 0, NULL);
+}
+
+// write the dirty sectors of a slot to the disk, called with the lock held
+static int write_slot(struct cache* c, int s)
+{
+    unsigned int dirty = dirty_mask(c, s);
+    int i, j;
+    if (!dirty)
+        return 0;
+    if (hook_before(c, &s, 1) < 0)
+        return -1;
+    // one write per run of adjacent dirty sectors
+    for (i=0; i<SECTORS; i=j)
+    {
+        if (!(dirty >> i & 1))
+        {
+            j = i + 1;
+            continue;
+        }
+        for (j=i; j<SECTORS && dirty >> j & 1; ++j)
+            ;
+        if (disk_write_blocks(c->slots[s].block * SECTORS + i, j - i, c->data[s] + i * DEVICE_BLOCK_SIZE) == -1)
+        {
+            // what is written already is clean
+            c->slots[s].dirty &= ~0u << i;
+            return -1;
+        }
+        c->stat.writes++;
+        c->stat.sectors += j - i;
+    }
+    mark_clean(c, &s, 0, 1);
+    return 0;
+}
+
+// the slot for a block, evicting with the clock algorithm if it is not cached, called with the lock held
+static int get_slot(struct cache* c, unsigned int index)
+{
+    int s;
+    if ((s = c->slot_of[index] - 1) >= 0)
+        return s;
+    for (;;)
+    {
+        s = c->hand;
+        c->hand = (c->hand + 1) % CACHE_SLOTS;
+        if (c->slots[s].referenced && c->slot_of[c->slots[s].block] == s + 1)
+        {
+            c->slots[s].referenced = 0;
+            continue;
+        }
+        break;
+    }
+    if (c->slot_of[c->slots[s].block] == s + 1)
+    {
+        // a dirty victim goes to the disk before its slot is reused
+        if (write_slot(c, s) < 0)
+            return -1;
+        c->slot_of[c->slots[s].block] = 0;
+    }
+    c->slots[s].block = index;
+    c->slot_of[index] = s + 1;
+    return s;
+}
+
+void cache_insert(unsigned int index, const char* buf, unsigned int gen)
+{
+    struct cache* c = &caches[disk_selected()];
+    int s;
+    pthread_mutex_lock(&c->lock);
+    if (c->gens[index] == gen && c->slot_of[index] == 0 && (s = get_slot(c, index)) >= 0)
+    {
+        memcpy(c->data[s], buf, FS_BLOCK_SIZE);
+        c->slots[s].referenced = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_write(unsigned int index, const char* buf)
+{
+    struct cache* c = &caches[disk_selected()];
+    unsigned int dirty = 0;
+    int s;
+    pthread_mutex_lock(&c->lock);
+    c->gens[index]++;
+    if ((s = c->slot_of[index] - 1) >= 0)
+    {
+        // the clean sectors of a cached block match the disk, only the changed ones become dirty
+        for (int i=0; i<SECTORS; ++i)
+            if (memcmp(c->data[s] + i * DEVICE_BLOCK_SIZE, buf + i * DEVICE_BLOCK_SIZE, DEVICE_BLOCK_SIZE) != 0)
+                dirty |= 1u << i;
+    }
+    else if ((s = get_slot(c, index)) >= 0)
+        dirty = (1u << SECTORS) - 1;
+    if (s >= 0)
+    {
+        memcpy(c->data[s], buf, FS_BLOCK_SIZE);
+        c->slots[s].referenced = 1;
+        if (!c->slots[s].dirty && dirty)
+            c->stat.dirty++;
+        else if (dirty)
+            c->stat.absorbed++;
+        c->slots[s].dirty |= dirty;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return s >= 0 ? 0 : -1;
+}
+
+void cache_invalidate(unsigned int index, unsigned int count)
+{
+    struct cache* c = &caches[disk_selected()];
+    int s;
+    pthread_mutex_lock(&c->lock);
+    for (unsigned int i=index; i<index+count && i<FS_BLOCK_COUNT; ++i)
+    {
+        c->gens[i]++;
+        if ((s = c->slot_of[i] - 1) >= 0 && c->slots[s].dirty)
+        {
+            c->slots[s].dirty = 0;
+            c->stat.dirty--;
+        }
+        c->slot_of[i] = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_writeback(unsigned int index, unsigned int count)
+{
+    struct cache* c = &caches[disk_selected()];
+    int s, r = 0;
+    pthread_mutex_lock(&c->lock);
+    for (unsigned int i=index; i<index+count && i<FS_BLOCK_COUNT; ++i)
+        if ((s = c->slot_of[i] - 1) >= 0 && write_slot(c, s) < 0)
+            r = -1;
+    pthread_mutex_unlock(&c->lock);
+    return r;
+}
+
+static int cmp_int(const void* a, const void* b)
+{
+    return *(const int*) a - *(const int*) b;
+}
+
+int cache_flush()
+{
+    struct cache* c = &caches[disk_selected()];
+    // a run of adjacent blocks has at most one piece per block
+    struct iovec iov[CACHE_SLOTS];
+    int order[CACHE_SLOTS];
+    unsigned int dirty, first = 0, next = 0;
+    int n = 0, cnt = 0, clean = 0, r = 0;
+    int i, j;
+    // the lock is held throughout, a block must not be evicted and read back
+    // from the disk before its write back is done
+    pthread_mutex_lock(&c->lock);
+    for (int s=0; s<CACHE_SLOTS; ++s)
+        if (c->slot_of[c->slots[s].block] == s + 1 && c->slots[s].dirty)
+            order[n++] = c->slots[s].block * CACHE_SLOTS + s;
+    // elevator order, the dirty sectors become a few sequential runs
+    qsort(order, n, sizeof (int), cmp_int);
+    for (int k=0; k<n; ++k)
+        order[k] %= CACHE_SLOTS;
+    if (n > 0)
+        r = hook_before(c, order, n);
+    for (int k=0; k<n && r == 0; ++k)
+    {
+        dirty = dirty_mask(c, order[k]);
+        for (i=0; i<SECTORS && r == 0; i=j)
+        {
+            if (!(dirty >> i & 1))
+            {
+                j = i + 1;
+                continue;
+            }
+            for (j=i; j<SECTORS && dirty >> j & 1; ++j)
+                ;
+            // a gap ends the run, which goes out as one vectored write
+            if (cnt > 0 && c->slots[order[k]].block * SECTORS + i != next)
+            {
+                if ((r = disk_write_vec(first, iov, cnt)) == 0)
+                {
+                    c->stat.writes++;
+                    c->stat.sectors += next - first;
+                    mark_clean(c, order, clean, k);
+                    clean = k;
+                }
+                cnt = 0;
+            }
+            if (cnt == 0)
+                first = c->slots[order[k]].block * SECTORS + i;
+            iov[cnt].iov_base = c->data[order[k]] + i * DEVICE_BLOCK_SIZE;
+            iov[cnt++].iov_len = (j - i) * DEVICE_BLOCK_SIZE;
+            next = c->slots[order[k]].block * SECTORS + j;
+        }
+    }
+    if (r == 0 && cnt > 0 && (r = disk_write_vec(first, iov, cnt)) == 0)
+    {
+        c->stat.writes++;
+        c->stat.sectors += next - first;
+    }
+    if (r == 0)
+        mark_clean(c, order, clean, n);
+    // the hook also settles what evictions since the last flush left behind
+    if (r == 0 && write_hook != NULL)
+        r = write_hook(CACHE_HOOK_AFTER, 0, NULL);
+    if (r == 0)
+    {
+        r = c->written;
+        c->written = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return r;
+}
+
+void cache_get_stat(struct cache_stat* s)
+{
+    struct cache* c = &caches[disk_selected()];
+    pthread_mutex_lock(&c->lock);
+    *s = c->stat;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,45 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_SLOTS (256) // 每个磁盘缓存的FS块数，1 MiB，函数作用于调用线程选择的磁盘
+
+// 缓存的命中统计
+struct cache_stat {
+    long hits;
+    long misses;
+    long dirty;      // 当前尚未写回磁盘的块数
+    long writebacks; // 写回磁盘的块数，包括淘汰时写回的
+    long sectors;    // 写回时实际写入的扇区数，块中只有被修改的扇区才写入
+    long writes;     // 写盘次数，相邻的脏扇区合并为一次写入
+    long absorbed;   // 写回之前又被修改的脏块次数，每次省去一次写回
+};
+
+// 查找块，命中时复制到buf并返回0，否则返回-1，gen给出该块当前的版本号；buf为NULL时只检查是否缓存，不计入统计
+int cache_lookup(unsigned int index, char* buf, unsigned int* gen);
+
+// 把从磁盘读到的块放入缓存，读盘期间该块被写过（版本号变了）则放弃，以免缓存旧数据
+void cache_insert(unsigned int index, const char* buf, unsigned int gen);
+
+// 写入块，块留在缓存中，与缓存内容不同的扇区标记为脏，稍后写回；需要淘汰的脏块写回失败时返回-1
+int cache_write(unsigned int index, const char* buf);
+
+// 块被释放给宿主机后从缓存中去掉，其中的脏块直接丢弃
+void cache_invalidate(unsigned int index, unsigned int count);
+
+// 写回index开始的count个块中的脏块，失败返回-1
+int cache_writeback(unsigned int index, unsigned int count);
+
+// 按块号顺序写回所有脏块，相邻的脏扇区合并为一次向量写入，返回自上次调用以来写入磁盘的块数，失败返回-1
+int cache_flush();
+
+#define CACHE_HOOK_BLOCK  (0) // 块即将写回磁盘，data是要写入的内容
+#define CACHE_HOOK_BEFORE (1) // 本次写回的块都报告过了，开始写盘之前
+#define CACHE_HOOK_AFTER  (2) // cache_flush写完了所有脏块
+
+// 设置写回磁盘时的回调，由写回的线程在持有缓存锁时调用，返回-1时放弃写回；文件系统用它维护校验和块
+void cache_set_hook(int (*hook)(int phase, unsigned int index, const char* data));
+
+// 取得命中统计
+void cache_get_stat(struct cache_stat* stat);
+
+#endif
@@ -0,0 +1,281 @@
+#include "capture.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int capturing = 0;
+
+static FILE* capture_fp;
+static uint64_t capture_base;   // clock at capture_start
+static uint64_t capture_prev;   // start of the last record written
+static int depth;
+// the input read by the running command
+static char* input;
+static int input_len, input_cap;
+
+static int put_varint(FILE* fp, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        if (putc((v & 0x7f) | 0x80, fp) == EOF)
+            return -1;
+        v >>= 7;
+    }
+    return putc(v, fp) == EOF ? -1 : 0;
+}
+
+static int get_varint(FILE* fp, uint64_t* v)
+{
+    int c, shift = 0;
+    *v = 0;
+    do
+    {
+        if ((c = getc(fp)) == EOF || shift > 63)
+            return -1;
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+// signed values are zigzag encoded so that small negative numbers stay short
+static int put_signed(FILE* fp, int64_t v)
+{
+    return put_varint(fp, (uint64_t) v << 1 ^ (uint64_t) (v >> 63));
+}
+
+static int get_signed(FILE* fp, int64_t* v)
+{
+    uint64_t u;
+    if (get_varint(fp, &u) < 0)
+        return -1;
+    *v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return 0;
+}
+
+static int put_bytes(FILE* fp, const char* p, int len)
+{
+    if (put_varint(fp, len) < 0)
+        return -1;
+    return len == 0 || fwrite(p, len, 1, fp) == 1 ? 0 : -1;
+}
+
+int capture_write_header(FILE* fp)
+{
+    return fwrite(CAPTURE_MAGIC, 8, 1, fp) == 1 ? 0 : -1;
+}
+
+int capture_read_header(FILE* fp)
+{
+    char magic[8];
+    if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, CAPTURE_MAGIC, 8) != 0)
+        return -1;
+    return 0;
+}
+
+int capture_write(FILE* fp, const struct capture_rec* rec, uint64_t prev_start)
+{
+    int r = 0;
+    if (putc(rec->kind, fp) == EOF)
+        return -1;
+    r |= put_signed(fp, (int64_t) (rec->start - prev_start));
+    r |= put_varint(fp, rec->dur);
+    r |= put_signed(fp, rec->result);
+    switch (rec->kind)
+    {
+    case CAP_EXEC:
+        r |= put_bytes(fp, rec->str, rec->str_len);
+        r |= put_bytes(fp, rec->data, rec->data_len);
+        break;
+    case CAP_OPEN:
+        r |= put_varint(fp, rec->arg);
+        r |= put_bytes(fp, rec->str, rec->str_len);
+        break;
+    case CAP_READ:
+        r |= put_varint(fp, rec->fd);
+        r |= put_varint(fp, rec->arg);
+        break;
+    case CAP_WRITE:
+        r |= put_varint(fp, rec->fd);
+        r |= put_bytes(fp, rec->data, rec->data_len);
+        break;
+    case CAP_LSEEK:
+        r |= put_varint(fp, rec->fd);
+        r |= put_signed(fp, rec->offset);
+        r |= put_varint(fp, rec->arg);
+        break;
+    case CAP_CLOSE:
+        r |= put_varint(fp, rec->fd);
+        break;
+    default:
+        return -1;
+    }
+    return r ? -1 : 0;
+}
+
+static int get_bytes(FILE* fp, const char** p, int* len, char* buf, int cap, int* used)
+{
+    uint64_t n;
+    // one more byte for the terminating '\0'
+    if (get_varint(fp, &n) < 0 || n >= cap - *used)
+        return -1;
+    if (n > 0 && fread(buf + *used, n, 1, fp) != 1)
+        return -1;
+    buf[*used + n] = '\0';
+    *p = buf + *used;
+    *len = n;
+    *used += n + 1;
+    return 0;
+}
+
+int capture_read(FILE* fp, struct capture_rec* rec, uint64_t prev_start, char* buf, int cap)
+{
+    uint64_t u;
+    int64_t s;
+    int used = 0, r = 0;
+    memset(rec, 0, sizeof *rec);
+    if ((rec->kind = getc(fp)) == EOF)
+        return 0;
+    if (get_signed(fp, &s) < 0 || get_varint(fp, &rec->dur) < 0)
+        return -1;
+    rec->start = prev_start + s;
+    if (get_signed(fp, &s) < 0)
+        return -1;
+    rec->result = s;
+    switch (rec->kind)
+    {
+    case CAP_EXEC:
+        r |= get_bytes(fp, &rec->str, &rec->str_len, buf, cap, &used);
+        r |= get_bytes(fp, &rec->data, &rec->data_len, buf, cap, &used);
+        break;
+    case CAP_OPEN:
+        r |= get_varint(fp, &u);
+        rec->arg = u;
+        r |= get_bytes(fp, &rec->str, &rec->str_len, buf, cap, &used);
+        break;
+    case CAP_READ:
+        r |= get_varint(fp, &u);
+        rec->fd = u;
+        r |= get_varint(fp, &u);
+        rec->arg = u;
+        break;
+    case CAP_WRITE:
+        r |= get_varint(fp, &u);
+        rec->fd = u;
+        r |= get_bytes(fp, &rec->data, &rec->data_len, buf, cap, &used);
+        break;
+    case CAP_LSEEK:
+        r |= get_varint(fp, &u);
+        rec->fd = u;
+        r |= get_signed(fp, &rec->offset);
+        r |= get_varint(fp, &u);
+        rec->arg = u;
+        break;
+    case CAP_CLOSE:
+        r |= get_varint(fp, &u);
+        rec->fd = u;
+        break;
+    default:
+        return -1;
+    }
+    if (rec->kind == CAP_OPEN)
+        rec->fd = rec->result;
+    return r ? -1 : 1;
+}
+
+static void stop_at_exit()
+{
+    capture_stop();
+}
+
+int capture_start(const char* host_path)
+{
+    static int registered = 0;
+    if (capture_fp != NULL)
+        return -1;
+    if ((capture_fp = fopen(host_path, "wb")) == NULL)
+        return -1;
+    if (capture_write_header(capture_fp) < 0)
+    {
+        fclose(capture_fp);
+        capture_fp = NULL;
+        return -1;
+    }
+    // the trace is closed properly when the shell exits while capturing
+    if (!registered)
+        atexit(stop_at_exit);
+    registered = 1;
+    capture_base = trace_now();
+    capture_prev = 0;
+    capturing = 1;
+    return 0;
+}
+
+int capture_stop()
+{
+    int r;
+    if (capture_fp == NULL)
+        return -1;
+    capturing = 0;
+    r = fclose(capture_fp);
+    capture_fp = NULL;
+    return r == 0 ? 0 : -1;
+}
+
+uint64_t capture_begin()
+{
+    if (capture_fp == NULL || depth > 0)
+        return 0;
+    return trace_now();
+}
+
+void capture_end(uint64_t start, struct capture_rec* rec)
+{
+    if (capture_fp == NULL)
+        return;
+    rec->dur = trace_now() - start;
+    rec->start = start - capture_base;
+    // a failed write is not fatal to the command, the trace just stops
+    if (capture_write(capture_fp, rec, capture_prev) < 0)
+    {
+        capture_stop();
+        return;
+    }
+    capture_prev = rec->start;
+}
+
+void capture_enter()
+{
+    ++depth;
+}
+
+void capture_leave()
+{
+    --depth;
+}
+
+void capture_input(int ch)
+{
+    char* p;
+    int cap;
+    if (capture_fp == NULL || ch == EOF)
+        return;
+    if (input_len == input_cap)
+    {
+        // the old buffer and its size stay as they are if it cannot grow
+        cap = input_cap ? input_cap * 2 : 256;
+        if ((p = realloc(input, cap)) == NULL)
+            return;
+        input = p;
+        input_cap = cap;
+    }
+    input[input_len++] = ch;
+}
+
+void capture_exec(uint64_t start, const char* cmd)
+{
+    struct capture_rec rec = {.kind = CAP_EXEC, .str = cmd, .str_len = strlen(cmd), .data = input, .data_len = input_len};
+    capture_end(start, &rec);
+    input_len = 0;
+}
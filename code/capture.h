@@ -0,0 +1,70 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "FSCAP01\n" // 捕获文件开头的8字节
+
+// 记录的类型
+enum capture_kind {
+    CAP_EXEC = 1, // 一条命令，str为命令行，data为命令从标准输入读取的内容
+    CAP_OPEN,     // fs_open，str为路径，arg为flags，result为文件句柄
+    CAP_READ,     // fs_read，arg为count
+    CAP_WRITE,    // fs_write，data为写入的内容
+    CAP_LSEEK,    // fs_lseek，offset和arg(whence)
+    CAP_CLOSE     // fs_close
+};
+
+// 一条记录，文件中的整数都用变长编码，时间为相对上一条记录的差值
+struct capture_rec {
+    int kind;
+    uint64_t start;  // 开始时间，相对捕获开始的纳秒数
+    uint64_t dur;    // 耗时，纳秒
+    int fd;
+    int arg;
+    int64_t offset;
+    int result;
+    const char* str;
+    int str_len;
+    const char* data;
+    int data_len;
+};
+
+extern int capturing; // 正在捕获时为1
+
+// 开始把命令和文件操作记录到宿主机文件host_path
+int capture_start(const char* host_path);
+
+// 停止捕获并关闭文件
+int capture_stop();
+
+// 一次调用开始，返回开始时间，不需要记录（未捕获或在命令内部调用）时返回0
+uint64_t capture_begin();
+
+// 一次调用结束，补上时间后写入记录
+void capture_end(uint64_t start, struct capture_rec* rec);
+
+// 命令执行期间的嵌套深度，命令内部的文件操作由命令本身重现，不单独记录
+void capture_enter();
+void capture_leave();
+
+// 记录当前命令从标准输入读取的一个字符
+void capture_input(int ch);
+
+// 命令结束，与其读取的输入一起写入记录
+void capture_exec(uint64_t start, const char* cmd);
+
+// 写一个文件头
+int capture_write_header(FILE* fp);
+
+// 把一条记录写入fp，prev_start为上一条记录的开始时间
+int capture_write(FILE* fp, const struct capture_rec* rec, uint64_t prev_start);
+
+// 检查文件头
+int capture_read_header(FILE* fp);
+
+// 从fp读取一条记录，str和data指向buf中，返回1，文件结束返回0，出错返回-1
+int capture_read(FILE* fp, struct capture_rec* rec, uint64_t prev_start, char* buf, int cap);
+
+#endif
@@ -1,7 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fnmatch.h>
 #include "fs.h"
+#include "file.h"
+#include "tree.h"
+#include "trace.h"
+#include "capture.h"
+#include "cache.h"
+#include "crc32c.h"
 #include "commands.h"
 
 // 返回文件名的第一个字符的位置，参考自xv6的ls.c源代码
@@ -14,12 +24,21 @@ const char* filename(const char* path)
     return p;
 }
 
+// 从标准输入读取一个字符，捕获时一并记录，以便重放时提供相同的输入
+static int input_char()
+{
+    int ch = getchar();
+    if (capturing)
+        capture_input(ch);
+    return ch;
+}
+
 void format_c()
 {
     char ch;
     printf("All data will be LOST. Are you ABSOLUTELY sure? (1 to continue)");
-    ch = getchar();
-    getchar();
+    ch = input_char();
+    input_char();
     if (ch != '1')
         return;
     if (format() == 0)
@@ -53,12 +72,12 @@ void ls_c(const char* path)
             puts("ls: load root directory data block failed");
             return;
         }
-        for (j=0; j<FS_BLOCK_SIZE / sizeof (struct dirent); ++j)
+        for (j=dirent_next(&dirents, -1); j>=0; j=dirent_next(&dirents, j))
         {
-            if (dirents.entries[j].valid)
+            if (DIRENT_AT(&dirents, j)->valid)
             {
-                printf("%s %d", dirents.entries[j].name, dirents.entries[j].index);
-                if (dirents.entries[j].type == TYPE_DIR)
+                printf("%s %d", DIRENT_AT(&dirents, j)->name, DIRENT_AT(&dirents, j)->index);
+                if (DIRENT_AT(&dirents, j)->type == TYPE_DIR)
                     printf(" <DIR>");
                 putchar('\n');
             }
@@ -68,6 +87,58 @@ void ls_c(const char* path)
     }
 }
 
+#define MAX_DIRENT (N_DIRECT_PTR * FS_BLOCK_SIZE / DIRENT_REC_LEN(1))
+#define LS_LINE_LEN (MAX_NAME_LEN + 32)
+
+void ls_l_c(const char* path)
+{
+    struct inode inode_dir;
+    static struct dirblk dirents[N_DIRECT_PTR];
+    static struct dirent* entries[MAX_DIRENT];
+    static int ids[MAX_DIRENT];
+    static struct inode inodes[MAX_DIRENT];
+    static char out[MAX_DIRENT * LS_LINE_LEN];
+    int inodeno, i, j, count = 0, len = 0;
+    if ((inodeno = openpath(path)) < 0)
+    {
+        printf("ls: open %s failed\n", path);
+        return;
+    }
+    // appended data still in memory would be missing from the sizes
+    if (fs_flush_all() < 0 || rd_inode(inodeno, &inode_dir) < 0)
+    {
+        puts("ls: load directory inode failed");
+        return;
+    }
+    // gather every entry first, then fetch the inodes sorted by inode table block
+    for (i=0; i<inode_dir.size/FS_BLOCK_SIZE; ++i)
+    {
+        if (fs_rd_block(DATA_BEGIN + inode_dir.ptr[i], (char*) &dirents[i]) < 0)
+        {
+            puts("ls: load directory data block failed");
+            return;
+        }
+        for (j=dirent_next(&dirents[i], -1); j>=0; j=dirent_next(&dirents[i], j))
+        {
+            if (DIRENT_AT(&dirents[i], j)->valid)
+            {
+                entries[count] = DIRENT_AT(&dirents[i], j);
+                ids[count++] = DIRENT_AT(&dirents[i], j)->index;
+            }
+        }
+    }
+    if (rd_inodes(ids, count, inodes) < 0)
+    {
+        puts("ls: load inodes failed");
+        return;
+    }
+    for (i=0; i<count; ++i)
+        len += snprintf(out + len, LS_LINE_LEN, "%c%c %2d %8d %5d %s\n",
+                        inodes[i].type == TYPE_DIR ? 'd' : '-', inodes[i].compressed ? 'c' : '-',
+                        inodes[i].link, inodes[i].size, ids[i], entries[i]->name);
+    fwrite(out, 1, len, stdout);
+}
+
 void mkdir_c(const char* path)
 {
     const char* newdir = filename(path);
@@ -93,6 +164,111 @@ void mkdir_c(const char* path)
     }
 }
 
+// names of the files created together by one touch
+static char bulk_names[INODE_NUM][MAX_NAME_LEN + 1];
+static const char* bulk_list[INODE_NUM];
+static int bulk_indexes[INODE_NUM];
+
+// expand the one {first..last} or {a,b,c} group of a name into bulk_names, -1 if it is malformed or too many
+static int expand_braces(const char* name)
+{
+    const char* open = strchr(name, '{');
+    const char* close = strchr(name, '}');
+    const char* dots;
+    int count = 0;
+    if (open == NULL || close == NULL || close < open || strchr(close + 1, '{') != NULL)
+        return -1;
+    int pre = open - name;
+    const char* post = close + 1;
+    if ((dots = strstr(open, "..")) != NULL && dots < close)
+    {
+        // numeric range, zero padded to the width of an endpoint written with leading zeros
+        char* end;
+        long first = strtol(open + 1, &end, 10);
+        if (end != dots)
+            return -1;
+        long last = strtol(dots + 2, &end, 10);
+        if (end != close)
+            return -1;
+        int width = (open[1] == '0' && dots - open > 2) || (dots[2] == '0' && close - dots > 3)
+            ? (dots - open - 1 > close - dots - 2 ? dots - open - 1 : close - dots - 2) : 0;
+        int step = first <= last ? 1 : -1;
+        for (long i=first; ; i+=step)
+        {
+            if (count == INODE_NUM)
+                return -1;
+            if (snprintf(bulk_names[count], MAX_NAME_LEN + 1, "%.*s%0*ld%s", pre, name, width, i, post) > MAX_NAME_LEN)
+                return -1;
+            ++count;
+            if (i == last)
+                break;
+        }
+        return count;
+    }
+    for (const char* p=open+1; p<=close; )
+    {
+        const char* q = p;
+        while (q < close && *q != ',')
+            ++q;
+        if (count == INODE_NUM)
+            return -1;
+        if (snprintf(bulk_names[count], MAX_NAME_LEN + 1, "%.*s%.*s%s", pre, name, (int) (q - p), p, post) > MAX_NAME_LEN)
+            return -1;
+        ++count;
+        p = q + 1;
+    }
+    return count;
+}
+
+// create the files named in bulk_names in one go
+static void touch_bulk_c(int inode, int count)
+{
+    for (int i=0; i<count; ++i)
+        bulk_list[i] = bulk_names[i];
+    if (touch_bulk(inode, bulk_list, count, bulk_indexes) < 0)
+        puts("touch: create new files failed");
+}
+
+// touch -f: create the files listed one name per line in a host file in a directory
+void touch_list_c(const char* host_path, const char* dir)
+{
+    FILE* host;
+    int inode, count = 0;
+    if ((inode = openpath(dir)) < 0)
+    {
+        puts("touch: open destination directory failed");
+        return;
+    }
+    if ((host = fopen(host_path, "r")) == NULL)
+    {
+        puts("touch: open list file failed");
+        return;
+    }
+    char line[MAX_NAME_LEN + 2];
+    while (fgets(line, sizeof line, host) != NULL)
+    {
+        int len = strcspn(line, "\r\n");
+        if (line[len] == '\0' && !feof(host))
+        {
+            puts("touch: file name too long");
+            fclose(host);
+            return;
+        }
+        line[len] = '\0';
+        if (len == 0)
+            continue;
+        if (count == INODE_NUM || strchr(line, '/') != NULL)
+        {
+            puts(count == INODE_NUM ? "touch: too many files" : "touch: list names a path, not a file name");
+            fclose(host);
+            return;
+        }
+        strcpy(bulk_names[count++], line);
+    }
+    fclose(host);
+    touch_bulk_c(inode, count);
+}
+
 void touch_c(const char* path)
 {
     const char* newfile = filename(path);
@@ -111,6 +287,15 @@ void touch_c(const char* path)
         puts("touch: open destination directory failed");
         return;
     }
+    if (strchr(newfile, '{') != NULL)
+    {
+        int count = expand_braces(newfile);
+        if (count < 0)
+            puts("touch: bad brace expansion");
+        else
+            touch_bulk_c(inode, count);
+        return;
+    }
     if (touch(inode, newfile) < 0)
     {
         puts("touch: create new file failed");
@@ -118,8 +303,30 @@ void touch_c(const char* path)
     }
 }
 
+// the instance named by an "id:" prefix of a path, -1 if there is none
+static int path_instance(const char* arg, const char** path)
+{
+    char* end;
+    long id = strtol(arg, &end, 10);
+    *path = arg;
+    if (end == arg || *end != ':')
+        return -1;
+    *path = end + 1;
+    return id;
+}
+
 void cp_c(const char* dst, const char* src)
 {
+    // between instances the data is copied, blocks cannot be shared
+    const char* src_path;
+    const char* dst_path;
+    int src_fs = path_instance(src, &src_path), dst_fs = path_instance(dst, &dst_path);
+    if (src_fs >= 0 || dst_fs >= 0)
+    {
+        if (fs_copy(src_fs >= 0 ? src_fs : fs_current(), src_path, dst_fs >= 0 ? dst_fs : fs_current(), dst_path) < 0)
+            printf("cp: copy %s to %s failed\n", src, dst);
+        return;
+    }
     // source
     int src_inodeno;
     if ((src_inodeno = openpath(src)) < 0)
@@ -158,6 +365,161 @@ void cp_c(const char* dst, const char* src)
     }
 }
 
+void mv_c(const char* dst, const char* src)
+{
+    struct inode dst_inode;
+    const char* src_file = filename(src);
+    const char* dst_file = filename(dst);
+    char src_dir[256], dst_dir[256];
+    int src_inodeno, dst_inodeno;
+    if (*src_file == '\0')
+    {
+        puts("mv: file name should not be empty");
+        return;
+    }
+    if (strlen(src) >= sizeof src_dir || strlen(dst) >= sizeof dst_dir)
+    {
+        puts("mv: path too long");
+        return;
+    }
+    memcpy(src_dir, src, src_file - src);
+    src_dir[src_file - src] = '\0';
+    if ((src_inodeno = openpath(src_dir)) < 0)
+    {
+        printf("mv: open %s failed\n", src_dir);
+        return;
+    }
+    // into an existing directory the name stays
+    if ((dst_inodeno = openpath(dst)) >= 0 && rd_inode(dst_inodeno, &dst_inode) == 0 && dst_inode.type == TYPE_DIR)
+        dst_file = src_file;
+    else
+    {
+        memcpy(dst_dir, dst, dst_file - dst);
+        dst_dir[dst_file - dst] = '\0';
+        if ((dst_inodeno = openpath(dst_dir)) < 0)
+        {
+            printf("mv: open %s failed\n", dst_dir);
+            return;
+        }
+    }
+    if (fs_rename(src_inodeno, src_file, dst_inodeno, dst_file) < 0)
+        printf("mv: move %s to %s failed\n", src, dst);
+}
+
+void cp_r_c(const char* dst, const char* src)
+{
+    if (tree_copy(src, dst) < 0)
+        printf("cp: copy %s to %s failed\n", src, dst);
+}
+
+void du_c(const char* path)
+{
+    struct tree_entry* entries;
+    int count;
+    if ((count = tree_walk(path, &entries)) < 0)
+    {
+        printf("du: walk %s failed\n", path);
+        return;
+    }
+    for (int i=0; i<count; ++i)
+        if (entries[i].type == TYPE_DIR)
+            printf("%ldK\t%s\n", entries[i].blocks * (FS_BLOCK_SIZE / 1024), entries[i].path);
+    tree_free(entries, count);
+}
+
+void find_c(const char* path, const char* pattern)
+{
+    struct tree_entry* entries;
+    int count;
+    if ((count = tree_walk(path, &entries)) < 0)
+    {
+        printf("find: walk %s failed\n", path);
+        return;
+    }
+    for (int i=0; i<count; ++i)
+        if (pattern == NULL || fnmatch(pattern, filename(entries[i].path), 0) == 0)
+            puts(entries[i].path);
+    tree_free(entries, count);
+}
+
+void rm_c(const char* path, int mode)
+{
+    const char* cmd = mode == RM_DIR ? "rmdir" : "rm";
+    const char* name = filename(path);
+    if (*name == '\0')
+    {
+        printf("%s: file name should not be empty\n", cmd);
+        return;
+    }
+    int position = name - path;
+    char prtdir[256];
+    memcpy(prtdir, path, position);
+    prtdir[position] = '\0';
+    int inode = openpath(prtdir);
+    if (inode < 0)
+    {
+        printf("%s: open directory failed\n", cmd);
+        return;
+    }
+    if (rm(inode, name, mode) < 0)
+    {
+        printf("%s: remove %s failed\n", cmd, path);
+        return;
+    }
+}
+
+// a size given on the command line, -1 unless it is a whole non-negative number that fits an int
+static int parse_size(const char* arg)
+{
+    char* end;
+    long size;
+    errno = 0;
+    size = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE || size < 0 || size > INT_MAX)
+        return -1;
+    return size;
+}
+
+void truncate_c(const char* path, const char* size)
+{
+    int inodeno, n;
+    if ((n = parse_size(size)) < 0)
+    {
+        printf("truncate: invalid size %s\n", size);
+        return;
+    }
+    if ((inodeno = openpath(path)) < 0)
+    {
+        printf("truncate: open %s failed\n", path);
+        return;
+    }
+    if (fs_truncate(inodeno, n) < 0)
+    {
+        printf("truncate: resize %s failed\n", path);
+        return;
+    }
+}
+
+void fallocate_c(const char* path, const char* size)
+{
+    int inodeno, n;
+    if ((n = parse_size(size)) < 0)
+    {
+        printf("fallocate: invalid size %s\n", size);
+        return;
+    }
+    if ((inodeno = openpath(path)) < 0)
+    {
+        printf("fallocate: open %s failed\n", path);
+        return;
+    }
+    if (fs_fallocate(inodeno, n) < 0)
+    {
+        printf("fallocate: reserve space for %s failed\n", path);
+        return;
+    }
+}
+
 void exit_c()
 {
     exit(0);
@@ -182,19 +544,27 @@ void tee_c(const char* path)
         puts("tee: cannot write a directory");
         return;
     }
+    int fd;
+    if ((fd = fs_open(path, FS_O_WRONLY)) < 0)
+    {
+        printf("tee: open %s failed\n", path);
+        return;
+    }
     char prev_ch;
     char ch;
     int i = 0;
-    while ((ch = getchar()) >= 0)
+    while ((ch = input_char()) >= 0)
     {
         if (i >= FS_BLOCK_SIZE * N_DIRECT_PTR) // 大于最大文件长度
             break;
         if (ch == '\n' && prev_ch == '\n')
             break;
-        writebyte(inodeno, i, ch);
+        fs_write(fd, &ch, 1);
         ++i;
         prev_ch = ch;
     }
+    if (fs_close(fd) < 0)
+        puts("tee: write back failed");
 }
 
 void cat_c(const char* path)
@@ -206,7 +576,7 @@ void cat_c(const char* path)
         printf("cat: open %s failed\n", path);
         return;
     }
-    if (rd_inode(inodeno, &file_inode) < 0)
+    if (fs_flush(inodeno) < 0 || rd_inode(inodeno, &file_inode) < 0)
     {
         puts("cat: read inode failed");
         return;
@@ -216,19 +586,343 @@ void cat_c(const char* path)
         puts("cat: cannot write a directory");
         return;
     }
-    int i;
-    for (i=0; i<file_inode.size; ++i)
-        putchar(readbyte(inodeno, i));
+    fflush(stdout);
+    if (fs_sendfile(inodeno, fileno(stdout)) < 0)
+        puts("cat: read file failed");
+}
+
+void compress_c(const char* arg)
+{
+    int inodeno;
+    struct compress_stat before, compress_stat;
+    fs_get_compress_stat(&before);
+    compress_stat = before;
+    if (arg == NULL)
+    {
+        printf("compress: %s\n", fs_get_options() & FS_COMPRESS ? "on" : "off");
+        printf("compress: %ld -> %ld bytes", compress_stat.raw_bytes, compress_stat.packed_bytes);
+        if (compress_stat.packed_bytes > 0)
+            printf(" (%.2fx)", (double) compress_stat.raw_bytes / compress_stat.packed_bytes);
+        printf(", compress %.3f ms, decompress %.3f ms\n",
+               compress_stat.compress_clock * 1000.0 / CLOCKS_PER_SEC,
+               compress_stat.decompress_clock * 1000.0 / CLOCKS_PER_SEC);
+        return;
+    }
+    if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+    {
+        fs_set_options(strcmp(arg, "on") == 0 ? fs_get_options() | FS_COMPRESS : fs_get_options() & ~FS_COMPRESS);
+        return;
+    }
+    if ((inodeno = openpath(arg)) < 0)
+    {
+        printf("compress: open %s failed\n", arg);
+        return;
+    }
+    if (fs_compress(inodeno) < 0)
+    {
+        puts("compress: compress file failed");
+        return;
+    }
+    fs_get_compress_stat(&compress_stat);
+    long raw = compress_stat.raw_bytes - before.raw_bytes;
+    long packed = compress_stat.packed_bytes - before.packed_bytes;
+    if (packed > 0)
+        printf("compress: %ld -> %ld bytes (%.2fx), %.3f ms\n", raw, packed, (double) raw / packed,
+               (compress_stat.compress_clock - before.compress_clock) * 1000.0 / CLOCKS_PER_SEC);
+    else
+        printf("compress: %s left as it is\n", arg);
+}
+
+void dedup_c(const char* arg)
+{
+    struct superblock spblock;
+    struct dedup_stat dedup_stat;
+    char buf[FS_BLOCK_SIZE];
+    if (arg != NULL)
+    {
+        if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+            fs_set_options(strcmp(arg, "on") == 0 ? fs_get_options() | FS_DEDUP : fs_get_options() & ~FS_DEDUP);
+        else
+            puts("dedup: on or off expected");
+        return;
+    }
+    if (fs_rd_block(0, buf) < 0)
+    {
+        puts("dedup: read superblock failed");
+        return;
+    }
+    memcpy(&spblock, buf, sizeof (struct superblock));
+    int shared = 0;
+    for (int i=0; i<FS_BLOCK_COUNT; ++i)
+        shared += spblock.block_ref[i];
+    fs_get_dedup_stat(&dedup_stat);
+    printf("dedup: %s\n", fs_get_options() & FS_DEDUP ? "on" : "off");
+    printf("dedup: %ld block writes, %ld hits", dedup_stat.writes, dedup_stat.hits);
+    if (dedup_stat.writes > 0)
+        printf(" (%.1f%%)", 100.0 * dedup_stat.hits / dedup_stat.writes);
+    printf(", %d blocks saved\n", shared);
+}
+
+void checksum_c(const char* arg)
+{
+    struct csum_stat csum_stat;
+    if (arg != NULL)
+    {
+        if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+            fs_set_options(strcmp(arg, "on") == 0 ? fs_get_options() | FS_CSUM_DATA : fs_get_options() & ~FS_CSUM_DATA);
+        else
+            puts("checksum: on or off expected");
+        return;
+    }
+    fs_get_csum_stat(&csum_stat);
+    printf("checksum: crc32c (%s), metadata always, data %s\n", crc32c_impl(), fs_get_options() & FS_CSUM_DATA ? "on" : "off");
+    printf("checksum: %ld blocks verified, %ld errors\n", csum_stat.verified, csum_stat.errors);
+}
+
+void trace_c(const char* arg, const char* host_path)
+{
+#ifndef FS_TRACE
+    puts("trace: compiled out, rebuild with make TRACE=1");
+    return;
+#endif
+    const struct trace_hist* h;
+    if (arg == NULL)
+    {
+        printf("trace: %s\n", trace_enabled ? "on" : "off");
+        printf("%-14s %9s %9s %9s %9s %9s %9s %9s\n", "op", "count", "mean(us)", "p50", "p90", "p99", "p99.9", "max");
+        for (int op=0; op<TRACE_OP_COUNT; ++op)
+        {
+            h = trace_hist(op);
+            if (h->count == 0)
+                continue;
+            printf("%-14s %9llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", trace_op_name[op],
+                   (unsigned long long) h->count, h->sum / 1000.0 / h->count,
+                   trace_percentile(h, 50) / 1000.0, trace_percentile(h, 90) / 1000.0,
+                   trace_percentile(h, 99) / 1000.0, trace_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+        }
+    }
+    else if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+        trace_enabled = strcmp(arg, "on") == 0;
+    else if (strcmp(arg, "reset") == 0)
+        trace_reset();
+    else if (strcmp(arg, "json") == 0 || strcmp(arg, "chrome") == 0)
+    {
+        if (host_path == NULL)
+            printf("trace: missing the host file\n");
+        else if ((strcmp(arg, "json") == 0 ? trace_dump_json(host_path) : trace_dump_chrome(host_path)) < 0)
+            printf("trace: write %s failed\n", host_path);
+    }
+    else
+        puts("trace: on, off, reset, json or chrome expected");
+}
+
+void cache_c()
+{
+    struct cache_stat stat;
+    int members, unit;
+    cache_get_stat(&stat);
+    printf("cache: %d blocks, %s disk I/O", CACHE_SLOTS, disk_get_direct() ? "direct" : "buffered");
+    if ((members = disk_get_stripe(&unit)) > 1)
+        printf(", striped over %d files in %d KiB units", members, unit / 1024);
+    putchar('\n');
+    printf("cache: %ld hits, %ld misses", stat.hits, stat.misses);
+    if (stat.hits + stat.misses > 0)
+        printf(" (%.1f%%)", 100.0 * stat.hits / (stat.hits + stat.misses));
+    putchar('\n');
+    printf("cache: %ld dirty, %ld written back, %ld KiB in %ld sectors", stat.dirty, stat.writebacks,
+           stat.sectors * DEVICE_BLOCK_SIZE / 1024, stat.sectors);
+    if (stat.writebacks > 0)
+        printf(" (%.1f of %d per block)", (double) stat.sectors / stat.writebacks, FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE);
+    putchar('\n');
+    printf("cache: %ld writes", stat.writes);
+    if (stat.writes > 0)
+        printf(" (%.1f KiB each)", stat.sectors * DEVICE_BLOCK_SIZE / 1024.0 / stat.writes);
+    printf(", %ld rewrites absorbed\n", stat.absorbed);
+}
+
+void sync_c(const char* mode, const char* interval_ms)
+{
+    struct sync_stat stat;
+    int m, ms;
+    if (mode == NULL)
+    {
+        if (fs_sync() < 0)
+        {
+            puts("sync: write back failed");
+            return;
+        }
+        m = fs_get_durability(&ms);
+        fs_get_sync_stat(&stat);
+        printf("sync: %s", durability_name[m]);
+        if (m == SYNC_GROUP)
+            printf(", every %d ms", ms);
+        printf("\nsync: %ld fdatasyncs, %ld blocks written back", stat.syncs, stat.blocks);
+        if (stat.syncs > 0)
+            printf(", %.3f ms per fdatasync", stat.sync_ns / 1e6 / stat.syncs);
+        putchar('\n');
+        return;
+    }
+    for (m=SYNC_NONE; m<=SYNC_GROUP && strcmp(mode, durability_name[m]) != 0; ++m)
+        ;
+    ms = interval_ms != NULL ? atoi(interval_ms) : SYNC_INTERVAL;
+    if (m > SYNC_GROUP || ms <= 0)
+        puts("sync: none, op or group [interval in ms] expected");
+    else if (fs_set_durability(m, ms) < 0)
+        puts("sync: switch mode failed");
+}
+
+void image_c(const char* arg, const char* id_or_path)
+{
+    char path[256];
+    int id;
+    if (arg == NULL)
+    {
+        for (id=0; id<FS_MAX_INSTANCE; ++id)
+            if (fs_instance_path(id, path, sizeof path) == 0)
+                printf("%c %d %s\n", id == fs_current() ? '*' : ' ', id, path);
+        return;
+    }
+    if (id_or_path == NULL)
+        printf("image: missing the %s\n", strcmp(arg, "open") == 0 ? "host file" : "instance");
+    else if (strcmp(arg, "open") == 0)
+    {
+        if ((id = fs_attach(id_or_path)) < 0)
+            printf("image: open host file %s failed\n", id_or_path);
+        else
+            printf("image: %s is instance %d\n", id_or_path, id);
+    }
+    else if (strcmp(arg, "use") == 0)
+    {
+        if (fs_use(atoi(id_or_path)) < 0)
+            printf("image: no instance %s\n", id_or_path);
+    }
+    else if (strcmp(arg, "close") == 0)
+    {
+        if (atoi(id_or_path) == fs_current())
+            puts("image: the instance in use cannot be closed");
+        else if (fs_detach(atoi(id_or_path)) < 0)
+            printf("image: close instance %s failed\n", id_or_path);
+    }
+    else
+        puts("image: open, use or close expected");
+}
+
+void capture_c(const char* arg)
+{
+    if (arg == NULL)
+        printf("capture: %s\n", capturing ? "on" : "off");
+    else if (strcmp(arg, "stop") == 0)
+    {
+        if (capture_stop() < 0)
+            puts("capture: not capturing");
+    }
+    else if (capture_start(arg) < 0)
+        printf("capture: open host file %s failed\n", arg);
+}
+
+void export_c(const char* path, const char* host_path)
+{
+    int inodeno;
+    FILE* host;
+    if ((inodeno = openpath(path)) < 0)
+    {
+        printf("export: open %s failed\n", path);
+        return;
+    }
+    if ((host = fopen(host_path, "w")) == NULL)
+    {
+        printf("export: open host file %s failed\n", host_path);
+        return;
+    }
+    if (fs_sendfile(inodeno, fileno(host)) < 0)
+        puts("export: copy file failed");
+    fclose(host);
+}
+
+#define DEFRAG_BATCH (4)
+
+static void frag_report(const char* path, int inodeno)
+{
+    struct frag_stat stat = {0};
+    int extents;
+    if ((extents = fs_frag(inodeno, &stat)) < 0)
+        printf("defrag: read %s failed\n", path);
+    else if (stat.files > 0)
+        printf("%s: %d blocks in %d extent%s\n", path, stat.blocks, extents, extents == 1 ? "" : "s");
+}
+
+void defrag_c(const char* arg, const char* count)
+{
+    struct frag_stat stat = {0};
+    struct tree_entry* entries;
+    int n, r;
+    if (arg == NULL)
+    {
+        if (fs_frag_image(&stat) < 0)
+        {
+            puts("defrag: read file system failed");
+            return;
+        }
+        printf("defrag: %d files, %d fragmented, %d blocks in %d extents", stat.files, stat.fragmented,
+               stat.blocks, stat.extents);
+        if (stat.files > 0)
+            printf(" (%.2f per file)", (double) stat.extents / stat.files);
+        putchar('\n');
+        printf("defrag: free space in %d extents, the largest %d blocks\n", stat.free_extents, stat.largest_free);
+    }
+    else if (strcmp(arg, "run") == 0 || strcmp(arg, "all") == 0)
+    {
+        // run goes on with one batch where the last one stopped, all finishes the pass
+        n = count != NULL ? atoi(count) : DEFRAG_BATCH;
+        if (n <= 0)
+        {
+            puts("defrag: batch size should be positive");
+            return;
+        }
+        while ((r = fs_defrag_batch(n, &stat)) == 0 && strcmp(arg, "all") == 0)
+            ;
+        if (r < 0)
+            puts("defrag: move blocks failed");
+        printf("defrag: %d files defragmented, %d blocks moved, %d shared, %d without space, %s\n",
+               stat.defragged, stat.moved, stat.shared, stat.no_space, r == 1 ? "pass done" : "more to do");
+    }
+    else if ((n = tree_walk(arg, &entries)) >= 0)
+    {
+        for (int i=0; i<n; ++i)
+            frag_report(entries[i].path, entries[i].index);
+        tree_free(entries, n);
+    }
+    else if ((n = openpath(arg)) >= 0)
+        frag_report(arg, n);
+    else
+        printf("defrag: open %s failed\n", arg);
 }
 
 void help_c()
 {
-    puts("ls: list all contents of a directory");
+    puts("ls: list all contents of a directory, -l shows type, links and size");
     puts("mkdir: create a blank directory");
-    puts("touch: create a blank file");
-    puts("cp: copy a file");
+    puts("touch: create a blank file, a {1..100} or {a,b} group creates many at once, -f <hostfile> <dir> creates the names listed");
+    puts("cp: copy a file, -r copies a directory and its contents, id:path copies between images");
+    puts("mv: move or rename a file or directory, the data stays where it is, rename is the same");
+    puts("du: show the space used by each directory of a tree");
+    puts("find: list the files and directories of a tree, optionally matching a name pattern");
+    puts("rm: remove a file, -r removes a directory and its contents");
+    puts("rmdir: remove an empty directory");
+    puts("truncate: shrink or extend a file to the given size");
+    puts("fallocate: reserve zeroed space for a file up to the given size");
     puts("tee: write a file");
     puts("cat: read a file");
+    puts("export: copy a file out to the host");
+    puts("dedup: on/off toggles sharing of identical blocks, no argument shows statistics");
+    puts("compress: compress a file, on/off toggles compression on write back, no argument shows statistics");
+    puts("checksum: on/off toggles checksums of data blocks written from now on, no argument shows statistics");
+    puts("trace: on/off toggles tracing, reset clears it, json/chrome <hostfile> dumps it, no argument shows latencies");
+    puts("cache: show block cache statistics");
+    puts("sync: write back and fdatasync, none/op/group [ms] selects when that happens by itself");
+    puts("image: list the open images, open <hostfile>, use <id> or close <id> them");
+    puts("defrag: show fragmentation, of the files under a path if given, run [n] moves the next n files, all the rest");
+    puts("capture: record commands and file operations to a host file for fsreplay, stop ends it");
     puts("help: show this help");
     puts("stat: show information of a file or directory");
     puts("format: deploy a fresh new file system");
@@ -245,7 +939,7 @@ void stat_c(const char* path)
         printf("stat: open %s failed\n", path);
         return;
     }
-    if (rd_inode(inodeno, &file_inode) < 0)
+    if (fs_flush(inodeno) < 0 || rd_inode(inodeno, &file_inode) < 0)
     {
         puts("stat: read inode failed");
         return;
@@ -253,24 +947,33 @@ void stat_c(const char* path)
     printf("Type: %s\n", inode_type[file_inode.type == TYPE_DIR]);
     printf("Size: %d\n", file_inode.size);
     printf("Links: %d\n", file_inode.link);
+    if (file_inode.compressed)
+    {
+        puts("Compressed: yes");
+        for (int i=0; i<N_DIRECT_PTR; ++i)
+            printf("Pointer %d: %d+%d (%d bytes)\n", i, CPTR_BLOCK(file_inode.ptr[i]),
+                   CPTR_OFFSET(file_inode.ptr[i]), CPTR_LEN(file_inode.ptr[i]));
+        return;
+    }
     for (int i=0; i<N_DIRECT_PTR; ++i)
         printf("Pointer %d: %d\n", i, file_inode.ptr[i]);
 }
 
-void exec(const char* cmd)
+static void dispatch(const char* cmd)
 {
     int argc = 0;
-    static char argv[3][256];
+    static char argv[4][256];
     const char* ptr_cmd;
     char* ptr_argv;
     ptr_cmd = cmd;
     memset(argv[0], 0, 256);
     memset(argv[1], 0, 256);
     memset(argv[2], 0, 256);
+    memset(argv[3], 0, 256);
     while (*ptr_cmd == ' ')
         ++ptr_cmd;
-    // 最多接受三个参数
-    while (argc < 3)
+    // 最多接受四个参数
+    while (argc < 4)
     {
         ptr_argv = argv[argc];
         while (*ptr_cmd != ' ' && *ptr_cmd != '\0')
@@ -290,6 +993,10 @@ void exec(const char* cmd)
     {
         if (argc == 1)
             ls_c("/");
+        else if (strcmp(argv[1], "-l") == 0 && argc == 2)
+            ls_l_c("/");
+        else if (strcmp(argv[1], "-l") == 0 && argc == 3)
+            ls_l_c(argv[2]);
         else if (argc == 2)
             ls_c(argv[1]);
         else
@@ -310,15 +1017,93 @@ void exec(const char* cmd)
             puts("touch: missing the path");
         else if (argc == 2)
             touch_c(argv[1]);
+        else if (argc == 4 && strcmp(argv[1], "-f") == 0)
+            touch_list_c(argv[2], argv[3]);
         else
             puts("touch: too many arguments");
     }
     else if (strcmp(argv[0], "cp") == 0)
     {
-        if (argc <= 2)
+        if (strcmp(argv[1], "-r") == 0)
+        {
+            if (argc <= 3)
+                puts("cp: too few arguments");
+            else
+                cp_r_c(argv[3], argv[2]);
+        }
+        else if (argc <= 2)
             puts("cp: too few arguments");
-        else
+        else if (argc == 3)
             cp_c(argv[2], argv[1]);
+        else
+            puts("cp: too many arguments");
+    }
+    else if (strcmp(argv[0], "mv") == 0 || strcmp(argv[0], "rename") == 0)
+    {
+        if (argc <= 2)
+            printf("%s: too few arguments\n", argv[0]);
+        else if (argc == 3)
+            mv_c(argv[2], argv[1]);
+        else
+            printf("%s: too many arguments\n", argv[0]);
+    }
+    else if (strcmp(argv[0], "du") == 0)
+    {
+        if (argc == 1)
+            du_c("/");
+        else if (argc == 2)
+            du_c(argv[1]);
+        else
+            puts("du: too many arguments");
+    }
+    else if (strcmp(argv[0], "find") == 0)
+    {
+        if (argc == 1)
+            find_c("/", NULL);
+        else if (argc == 2)
+            find_c(argv[1], NULL);
+        else if (argc == 3)
+            find_c(argv[1], argv[2]);
+        else
+            puts("find: too many arguments");
+    }
+    else if (strcmp(argv[0], "rm") == 0)
+    {
+        if (argc == 1)
+            puts("rm: missing the path");
+        else if (argc == 2)
+            rm_c(argv[1], RM_FILE);
+        else if (argc == 3 && strcmp(argv[1], "-r") == 0)
+            rm_c(argv[2], RM_RECURSIVE);
+        else
+            puts("rm: too many arguments");
+    }
+    else if (strcmp(argv[0], "rmdir") == 0)
+    {
+        if (argc == 1)
+            puts("rmdir: missing the path");
+        else if (argc == 2)
+            rm_c(argv[1], RM_DIR);
+        else
+            puts("rmdir: too many arguments");
+    }
+    else if (strcmp(argv[0], "truncate") == 0)
+    {
+        if (argc <= 2)
+            puts("truncate: too few arguments");
+        else if (argc == 3)
+            truncate_c(argv[1], argv[2]);
+        else
+            puts("truncate: too many arguments");
+    }
+    else if (strcmp(argv[0], "fallocate") == 0)
+    {
+        if (argc <= 2)
+            puts("fallocate: too few arguments");
+        else if (argc == 3)
+            fallocate_c(argv[1], argv[2]);
+        else
+            puts("fallocate: too many arguments");
     }
     else if (strcmp(argv[0], "exit") == 0)
         exit_c();
@@ -342,6 +1127,100 @@ void exec(const char* cmd)
         else
             puts("cat: too many arguments");
     }
+    else if (strcmp(argv[0], "compress") == 0)
+    {
+        if (argc == 1)
+            compress_c(NULL);
+        else if (argc == 2)
+            compress_c(argv[1]);
+        else
+            puts("compress: too many arguments");
+    }
+    else if (strcmp(argv[0], "checksum") == 0)
+    {
+        if (argc == 1)
+            checksum_c(NULL);
+        else if (argc == 2)
+            checksum_c(argv[1]);
+        else
+            puts("checksum: too many arguments");
+    }
+    else if (strcmp(argv[0], "dedup") == 0)
+    {
+        if (argc == 1)
+            dedup_c(NULL);
+        else if (argc == 2)
+            dedup_c(argv[1]);
+        else
+            puts("dedup: too many arguments");
+    }
+    else if (strcmp(argv[0], "trace") == 0)
+    {
+        if (argc == 1)
+            trace_c(NULL, NULL);
+        else if (argc == 2)
+            trace_c(argv[1], NULL);
+        else if (argc == 3)
+            trace_c(argv[1], argv[2]);
+        else
+            puts("trace: too many arguments");
+    }
+    else if (strcmp(argv[0], "cache") == 0)
+    {
+        if (argc == 1)
+            cache_c();
+        else
+            puts("cache: too many arguments");
+    }
+    else if (strcmp(argv[0], "sync") == 0)
+    {
+        if (argc == 1)
+            sync_c(NULL, NULL);
+        else if (argc == 2)
+            sync_c(argv[1], NULL);
+        else if (argc == 3)
+            sync_c(argv[1], argv[2]);
+        else
+            puts("sync: too many arguments");
+    }
+    else if (strcmp(argv[0], "image") == 0)
+    {
+        if (argc == 1)
+            image_c(NULL, NULL);
+        else if (argc == 2)
+            image_c(argv[1], NULL);
+        else if (argc == 3)
+            image_c(argv[1], argv[2]);
+        else
+            puts("image: too many arguments");
+    }
+    else if (strcmp(argv[0], "defrag") == 0)
+    {
+        if (argc == 1)
+            defrag_c(NULL, NULL);
+        else if (argc == 2)
+            defrag_c(argv[1], NULL);
+        else if (argc == 3)
+            defrag_c(argv[1], argv[2]);
+        else
+            puts("defrag: too many arguments");
+    }
+    else if (strcmp(argv[0], "capture") == 0)
+    {
+        if (argc == 1)
+            capture_c(NULL);
+        else if (argc == 2)
+            capture_c(argv[1]);
+        else
+            puts("capture: too many arguments");
+    }
+    else if (strcmp(argv[0], "export") == 0)
+    {
+        if (argc <= 2)
+            puts("export: too few arguments");
+        else
+            export_c(argv[1], argv[2]);
+    }
     else if (strcmp(argv[0], "stat") == 0)
     {
         if (argc == 1)
@@ -356,3 +1235,17 @@ void exec(const char* cmd)
     else
         printf("exec %s failed\n", argv[0]);
 }
+
+void exec(const char* cmd)
+{
+    uint64_t start = capturing ? capture_begin() : 0;
+    // the file operations of a command are reproduced by the command itself
+    capture_enter();
+    int op = fs_op_begin();
+    dispatch(cmd);
+    if (fs_op_end(op) < 0)
+        puts("sync: write back failed");
+    capture_leave();
+    if (start)
+        capture_exec(start, cmd);
+}
@@ -9,15 +9,42 @@ void format_c();
 // ls command
 void ls_c(const char*);
 
+// ls -l command
+void ls_l_c(const char*);
+
 // mkdir command
 void mkdir_c(const char*);
 
 // touch command
 void touch_c(const char*);
 
+// touch -f command
+void touch_list_c(const char*, const char*);
+
 // cp command
 void cp_c(const char*, const char*);
 
+// cp -r command
+void cp_r_c(const char*, const char*);
+
+// mv command
+void mv_c(const char*, const char*);
+
+// du command
+void du_c(const char*);
+
+// find command
+void find_c(const char*, const char*);
+
+// rm command
+void rm_c(const char*, int);
+
+// truncate command
+void truncate_c(const char*, const char*);
+
+// fallocate command
+void fallocate_c(const char*, const char*);
+
 // exit command
 void exit_c();
 
@@ -27,6 +54,36 @@ void tee_c(const char*);
 // cat command
 void cat_c(const char*);
 
+// compress command
+void compress_c(const char*);
+
+// dedup command
+void dedup_c(const char*);
+
+// checksum command
+void checksum_c(const char*);
+
+// trace command
+void trace_c(const char*, const char*);
+
+// cache command
+void cache_c();
+
+// sync command
+void sync_c(const char*, const char*);
+
+// image command
+void image_c(const char*, const char*);
+
+// defrag command
+void defrag_c(const char*, const char*);
+
+// capture command
+void capture_c(const char*);
+
+// export command
+void export_c(const char*, const char*);
+
 // help command
 void help_c();
 
@@ -0,0 +1,101 @@
+#include "crc32c.h"
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define POLY (0x82f63b78) // reflected Castagnoli polynomial
+
+// slicing by 8, table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+
+static uint32_t crc_table(uint32_t crc, const unsigned char* p, size_t len)
+{
+    uint64_t v;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        memcpy(&v, p, sizeof v);
+        v ^= crc;
+        crc = table[7][v & 0xff] ^ table[6][v >> 8 & 0xff] ^ table[5][v >> 16 & 0xff] ^ table[4][v >> 24 & 0xff]
+            ^ table[3][v >> 32 & 0xff] ^ table[2][v >> 40 & 0xff] ^ table[1][v >> 48 & 0xff] ^ table[0][v >> 56];
+    }
+    while (len-- > 0)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ crc >> 8;
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    uint64_t v, c = crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        memcpy(&v, p, sizeof v);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#define HW_NAME "sse4.2"
+#define HW_PRESENT() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    uint64_t v;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        memcpy(&v, p, sizeof v);
+        crc = __crc32cd(crc, v);
+    }
+    while (len-- > 0)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#define HW_NAME "armv8"
+#define HW_PRESENT() (getauxval(AT_HWCAP) & HWCAP_CRC32)
+#endif
+
+static uint32_t (*crc_fn)(uint32_t, const unsigned char*, size_t) = crc_table;
+static const char* impl = "table";
+
+// the instructions are picked up before main() runs, the tables are built in any case
+__attribute__((constructor))
+static void crc32c_init()
+{
+    for (int b=0; b<256; ++b)
+    {
+        uint32_t crc = b;
+        for (int i=0; i<8; ++i)
+            crc = crc >> 1 ^ (crc & 1 ? POLY : 0);
+        table[0][b] = crc;
+    }
+    for (int k=1; k<8; ++k)
+        for (int b=0; b<256; ++b)
+            table[k][b] = table[0][table[k - 1][b] & 0xff] ^ table[k - 1][b] >> 8;
+#ifdef HW_NAME
+    if (HW_PRESENT())
+    {
+        crc_fn = crc_hw;
+        impl = HW_NAME;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+{
+    return ~crc_fn(~crc, buf, len);
+}
+
+const char* crc32c_impl()
+{
+    return impl;
+}
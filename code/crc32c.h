@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 计算buf中len字节的CRC32C（Castagnoli多项式），crc为前面数据的结果，从0开始；
+// 有SSE4.2或ARMv8 CRC指令时用指令计算，否则查表
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+// 当前使用的实现，"sse4.2"、"armv8"或"table"
+const char* crc32c_impl();
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "fs.h"
+#include "file.h"
+
+#define IMAGE "dedupclone.img"
+
+static int failed = 0;
+
+static void check(int ok, const char* what)
+{
+    if (!ok)
+    {
+        printf("dedupclone: %s\n", what);
+        failed = 1;
+    }
+}
+
+// blocks in use by the bitmap and by the free count must agree
+static int used_blocks()
+{
+    struct superblock spblock;
+    int used = 0;
+    fs_rd_block(0, fs_buf);
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    for (int i=0; i<DATA_BLOCK_COUNT; ++i)
+        used += bmap_test(i, &spblock);
+    check(used == DATA_BLOCK_COUNT - spblock.free_block_count, "bitmap and free count disagree");
+    return used;
+}
+
+// a file whose blocks dedup against each other is cloned and removed
+int main()
+{
+    static char data[3 * FS_BLOCK_SIZE + 1], back[sizeof data];
+    struct inode inode_a, inode_b;
+    int id, fd, a, b, before;
+    unlink(IMAGE);
+    if ((id = fs_attach(IMAGE)) < 0)
+    {
+        puts("dedupclone: attach failed");
+        return 1;
+    }
+    fs_use(id);
+    format();
+    fs_set_options(FS_DEDUP);
+    before = used_blocks();
+    // three identical blocks and a tail
+    memset(data, 'x', sizeof data);
+    fd = fs_open("/a", FS_O_WRONLY | FS_O_CREAT);
+    check(fs_write(fd, data, sizeof data) == sizeof data, "write /a failed");
+    fs_close(fd);
+    a = openpath("/a");
+    rd_inode(a, &inode_a);
+    check(inode_a.ptr[1] == inode_a.ptr[2], "blocks of /a not shared");
+    b = touch(0, "b");
+    check(clone(a, b) == 0, "clone failed");
+    rd_inode(b, &inode_b);
+    check(inode_b.size == sizeof data, "size of /b wrong");
+    fd = fs_open("/b", FS_O_RDONLY);
+    check(fs_read(fd, back, sizeof back) == sizeof back && memcmp(data, back, sizeof data) == 0, "content of /b wrong");
+    fs_close(fd);
+    check(rm(0, "b", RM_FILE) == 0 && rm(0, "a", RM_FILE) == 0, "rm failed");
+    check(used_blocks() == before, "blocks leaked");
+    fs_use(0);
+    fs_detach(id);
+    unlink(IMAGE);
+    if (!failed)
+        puts("dedupclone: ok");
+    return failed;
+}
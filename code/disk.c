@@ -1,79 +1,634 @@
+#define _GNU_SOURCE
 #include "disk.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 inline int get_disk_size()
 {
         return 4*1024*1024; 
 }
 
-static FILE* disk;
+enum {JOB_READ, JOB_WRITE, JOB_DISCARD, JOB_SYNC};
 
-static int create_disk()
+// the part of a transfer that falls on one member of a striped disk
+struct job {
+        struct job* next;
+        int op;
+        int member;
+        int fd;
+        off_t off;
+        struct iovec* iov;
+        int iovcnt;
+        int r;
+        int done;
+};
+
+// one virtual disk, disk 0 is the file "disk"
+struct image {
+        int fd;         // member 0, -1 while the disk is closed
+        int direct;
+        char path[256];
+        // a striped disk spreads its stripe units round robin over the members
+        int members;
+        int unit;       // bytes
+        int fds[DISK_STRIPE_MAX];
+        // every member has a worker thread, so the members are busy at the same time
+        pthread_t workers[DISK_STRIPE_MAX];
+        struct job* queue[DISK_STRIPE_MAX];
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t done;
+        int stop;
+        // the members are mapped read-only on first use, the mappings handed out are counted
+        char* maps[DISK_STRIPE_MAX];
+        size_t map_len;
+        int mapped;
+};
+
+static struct image images[DISK_MAX] = {
+        [0] = {.fd = -1, .path = "disk", .members = 1, .unit = DISK_STRIPE_UNIT},
+        [1 ... DISK_MAX - 1] = {.fd = -1, .members = 1, .unit = DISK_STRIPE_UNIT},
+};
+static _Thread_local int selected;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int create_disk(const char* path, off_t size)
 {
-        FILE* tmp = fopen("disk","w");
-        for(int i = 0; i < get_disk_size(); i++){
+        FILE* tmp = fopen(path,"w");
+        if(tmp == NULL){
+                return -1;
+        }
+        for(off_t i = 0; i < size; i++){
                 fputc(0,tmp);
         }
         fclose(tmp);
+        return 0;
 }
 
-int open_disk()
+int disk_select(int id)
+{
+        int prev = selected;
+        if(id < 0 || id >= DISK_MAX){
+                return -1;
+        }
+        selected = id;
+        return prev;
+}
+
+int disk_selected()
+{
+        return selected;
+}
+
+int disk_set_path(const char* path)
+{
+        struct image* d = &images[selected];
+        if(d->fd != -1 || strlen(path) >= sizeof d->path){
+                return -1;
+        }
+        strcpy(d->path, path);
+        return 0;
+}
+
+int disk_get_path(char* path, int size)
+{
+        struct image* d = &images[selected];
+        if(strlen(d->path) >= size){
+                return -1;
+        }
+        strcpy(path, d->path);
+        return 0;
+}
+
+int disk_set_direct(int on)
 {
-        if(disk != 0){
+        struct image* d = &images[selected];
+        if(d->fd != -1){
                 return -1;
         }
-        disk = fopen("disk","r+");
-        if(disk == 0){
-                create_disk();
-                disk = fopen("disk","r+");
-                if(disk == 0){
+        d->direct = on;
+        return 0;
+}
+
+int disk_get_direct()
+{
+        struct image* d = &images[selected];
+        return d->direct;
+}
+
+int disk_set_stripe(int members, int unit)
+{
+        struct image* d = &images[selected];
+        if(d->fd != -1 || members < 1 || members > DISK_STRIPE_MAX){
+                return -1;
+        }
+        // a stripe unit holds whole aligned blocks, direct I/O stays aligned on every member
+        if(unit <= 0 || unit % DISK_DIRECT_ALIGN != 0){
+                return -1;
+        }
+        d->members = members;
+        d->unit = unit;
+        return 0;
+}
+
+int disk_get_stripe(int* unit)
+{
+        struct image* d = &images[selected];
+        *unit = d->unit;
+        return d->members;
+}
+
+static int run_job(struct job* j)
+{
+        ssize_t n;
+        size_t len;
+        off_t off = j->off;
+        if(j->op == JOB_SYNC){
+                return fdatasync(j->fd);
+        }
+        if(j->op == JOB_DISCARD){
+                for(len = 0; j->iovcnt-- > 0; j->iov++){
+                        len += j->iov->iov_len;
+                }
+                return fallocate(j->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+        }
+        // at most IOV_MAX buffers go with one call
+        for(int i = 0; i < j->iovcnt; i += IOV_MAX){
+                int cnt = j->iovcnt - i < IOV_MAX ? j->iovcnt - i : IOV_MAX;
+                len = 0;
+                for(int k = i; k < i + cnt; k++){
+                        len += j->iov[k].iov_len;
+                }
+                if(j->op == JOB_WRITE){
+                        n = pwritev(j->fd, j->iov + i, cnt, off);
+                }else{
+                        n = preadv(j->fd, j->iov + i, cnt, off);
+                }
+                if(n != len){
                         return -1;
                 }
+                off += len;
         }
         return 0;
 }
 
-int disk_read_block(unsigned int block_num, char* buf)
+static void* worker_main(void* arg)
+{
+        struct image* d = &images[(intptr_t)arg / DISK_STRIPE_MAX];
+        int m = (intptr_t)arg % DISK_STRIPE_MAX;
+        struct job* j;
+        pthread_mutex_lock(&d->lock);
+        for(;;){
+                while(!d->stop && d->queue[m] == NULL){
+                        pthread_cond_wait(&d->work, &d->lock);
+                }
+                if(d->queue[m] == NULL){
+                        break;
+                }
+                j = d->queue[m];
+                d->queue[m] = j->next;
+                pthread_mutex_unlock(&d->lock);
+                j->r = run_job(j);
+                pthread_mutex_lock(&d->lock);
+                j->done = 1;
+                pthread_cond_broadcast(&d->done);
+        }
+        pthread_mutex_unlock(&d->lock);
+        return NULL;
+}
+
+// run the jobs of different members at the same time, the calling thread takes the first one
+static int run_jobs(struct image* d, struct job* jobs, int n)
 {
-        if(disk == 0){
+        int r;
+        if(n > 1){
+                pthread_mutex_lock(&d->lock);
+                for(int i = 1; i < n; i++){
+                        jobs[i].done = 0;
+                        jobs[i].next = d->queue[jobs[i].member];
+                        d->queue[jobs[i].member] = &jobs[i];
+                }
+                pthread_cond_broadcast(&d->work);
+                pthread_mutex_unlock(&d->lock);
+        }
+        r = run_job(&jobs[0]);
+        if(n > 1){
+                pthread_mutex_lock(&d->lock);
+                for(int i = 1; i < n; i++){
+                        while(!jobs[i].done){
+                                pthread_cond_wait(&d->done, &d->lock);
+                        }
+                        r |= jobs[i].r;
+                }
+                pthread_mutex_unlock(&d->lock);
+        }
+        return r ? -1 : 0;
+}
+
+// move the buffers of iov from or to the range starting at off, a range over
+// several stripe units is cut into one job per member; the stripe units a
+// member holds of a contiguous range are contiguous on it too
+static int stripe_io(int op, off_t off, const struct iovec* iov, int iovcnt)
+{
+        struct image* d = &images[selected];
+        struct job jobs[DISK_STRIPE_MAX];
+        int job_of[DISK_STRIPE_MAX];
+        struct iovec* pieces;
+        size_t len = 0, p = 0, chunk;
+        off_t stripe;
+        int n = 0, max, m, r;
+        for(int i = 0; i < iovcnt; i++){
+                len += iov[i].iov_len;
+        }
+        stripe = off / d->unit;
+        if(d->members == 1 || len == 0 || stripe == (off + len - 1) / d->unit){
+                m = stripe % d->members;
+                jobs[0] = (struct job){.op = op, .fd = d->fds[m], .iov = (struct iovec*)iov, .iovcnt = iovcnt,
+                        .off = stripe / d->members * d->unit + off % d->unit};
+                return run_job(&jobs[0]);
+        }
+        max = iovcnt + len / d->unit / d->members + 2;
+        if((pieces = malloc(sizeof (struct iovec) * max * d->members)) == NULL){
                 return -1;
         }
-        if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
+        for(m = 0; m < d->members; m++){
+                job_of[m] = -1;
+        }
+        for(int i = 0; i < iovcnt; ){
+                if(p == iov[i].iov_len){
+                        i++;
+                        p = 0;
+                        continue;
+                }
+                stripe = off / d->unit;
+                m = stripe % d->members;
+                chunk = d->unit - off % d->unit;
+                if(chunk > iov[i].iov_len - p){
+                        chunk = iov[i].iov_len - p;
+                }
+                if(job_of[m] == -1){
+                        job_of[m] = n;
+                        jobs[n++] = (struct job){.op = op, .member = m, .fd = d->fds[m], .iov = pieces + m * max,
+                                .off = stripe / d->members * d->unit + off % d->unit};
+                }
+                struct job* j = &jobs[job_of[m]];
+                j->iov[j->iovcnt].iov_base = iov[i].iov_base == NULL ? NULL : (char*)iov[i].iov_base + p;
+                j->iov[j->iovcnt++].iov_len = chunk;
+                off += chunk;
+                p += chunk;
+        }
+        r = run_jobs(d, jobs, n);
+        free(pieces);
+        return r;
+}
+
+static void stop_workers(struct image* d, int n)
+{
+        pthread_mutex_lock(&d->lock);
+        d->stop = 1;
+        pthread_cond_broadcast(&d->work);
+        pthread_mutex_unlock(&d->lock);
+        for(int m = 0; m < n; m++){
+                pthread_join(d->workers[m], NULL);
+        }
+}
+
+static int start_workers(struct image* d)
+{
+        d->stop = 0;
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->work, NULL);
+        pthread_cond_init(&d->done, NULL);
+        for(int m = 0; m < d->members; m++){
+                d->queue[m] = NULL;
+                if(pthread_create(&d->workers[m], NULL, worker_main, (void*)(intptr_t)(selected * DISK_STRIPE_MAX + m))){
+                        stop_workers(d, m);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+int open_disk()
+{
+        struct image* d = &images[selected];
+        int flags = O_RDWR | (d->direct ? O_DIRECT : 0);
+        char path[sizeof d->path + 16];
+        off_t units = (get_disk_size() + d->unit - 1) / d->unit;
+        int m;
+        if(d->fd != -1){
                 return -1;
         }
-        if(fseek(disk, block_num * DEVICE_BLOCK_SIZE, SEEK_SET)){
+        if(d->path[0] == '\0'){
                 return -1;
         }
-        if(fread(buf, DEVICE_BLOCK_SIZE,1,disk) != 1){
+        // a plain image is the file itself, the members of a striped one are path.0, path.1, ...
+        for(m = 0; m < d->members; m++){
+                if(d->members == 1){
+                        strcpy(path, d->path);
+                }else{
+                        snprintf(path, sizeof path, "%s.%d", d->path, m);
+                }
+                d->fds[m] = open(path, flags);
+                if(d->fds[m] == -1){
+                        create_disk(path, d->members == 1 ? get_disk_size()
+                                        : (units + d->members - 1) / d->members * d->unit);
+                        d->fds[m] = open(path, flags);
+                        if(d->fds[m] == -1){
+                                break;
+                        }
+                }
+                // only one process may use the image at a time
+                if(flock(d->fds[m], LOCK_EX | LOCK_NB)){
+                        close(d->fds[m]);
+                        break;
+                }
+        }
+        if(m == d->members && (d->members == 1 || start_workers(d) == 0)){
+                d->fd = d->fds[0];
+                return 0;
+        }
+        while(m-- > 0){
+                close(d->fds[m]);
+        }
+        return -1;
+}
+
+// move len bytes at off, direct I/O goes through an aligned bounce buffer
+// when buf, off or len are not aligned
+static int transfer(off_t off, size_t len, char* buf, int write)
+{
+        struct image* d = &images[selected];
+        off_t begin, end;
+        char* bounce;
+        int r = 0;
+        if(!d->direct || ((uintptr_t)buf % DISK_DIRECT_ALIGN == 0 && off % DISK_DIRECT_ALIGN == 0
+                        && len % DISK_DIRECT_ALIGN == 0)){
+                return stripe_io(write ? JOB_WRITE : JOB_READ, off, &(struct iovec){buf, len}, 1);
+        }
+        begin = off / DISK_DIRECT_ALIGN * DISK_DIRECT_ALIGN;
+        end = (off + len + DISK_DIRECT_ALIGN - 1) / DISK_DIRECT_ALIGN * DISK_DIRECT_ALIGN;
+        if(posix_memalign((void**)&bounce, DISK_DIRECT_ALIGN, end - begin)){
                 return -1;
         }
-        return 0;
+        // a partial write is a read-modify-write of the surrounding aligned blocks
+        if(stripe_io(JOB_READ, begin, &(struct iovec){bounce, end - begin}, 1)){
+                r = -1;
+        }else if(write){
+                memcpy(bounce + (off - begin), buf, len);
+                r = stripe_io(JOB_WRITE, begin, &(struct iovec){bounce, end - begin}, 1);
+        }else{
+                memcpy(buf, bounce + (off - begin), len);
+        }
+        free(bounce);
+        return r;
+}
+
+int disk_read_block(unsigned int block_num, char* buf)
+{
+        struct image* d = &images[selected];
+        if(d->fd == -1){
+                return -1;
+        }
+        if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
+                return -1;
+        }
+        return transfer((off_t)block_num * DEVICE_BLOCK_SIZE, DEVICE_BLOCK_SIZE, buf, 0);
 }
 
 int disk_write_block(unsigned int block_num, char* buf)
 {
-        if(disk == 0){
+        struct image* d = &images[selected];
+        if(d->fd == -1){
                 return -1;
         }
         if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
                 return -1;
         }
-        if(fseek(disk, block_num * DEVICE_BLOCK_SIZE, SEEK_SET)){
+        return transfer((off_t)block_num * DEVICE_BLOCK_SIZE, DEVICE_BLOCK_SIZE, buf, 1);
+}
+
+int disk_read_blocks(unsigned int block_num, unsigned int count, char* buf)
+{
+        struct image* d = &images[selected];
+        if(d->fd == -1){
+                return -1;
+        }
+        if((off_t)(block_num + count) * DEVICE_BLOCK_SIZE > get_disk_size()){
                 return -1;
         }
-        if(fwrite(buf,DEVICE_BLOCK_SIZE,1,disk) != 1){
+        return transfer((off_t)block_num * DEVICE_BLOCK_SIZE, (size_t)count * DEVICE_BLOCK_SIZE, buf, 0);
+}
+
+int disk_write_blocks(unsigned int block_num, unsigned int count, const char* buf)
+{
+        struct image* d = &images[selected];
+        if(d->fd == -1){
+                return -1;
+        }
+        if((off_t)(block_num + count) * DEVICE_BLOCK_SIZE > get_disk_size()){
+                return -1;
+        }
+        return transfer((off_t)block_num * DEVICE_BLOCK_SIZE, (size_t)count * DEVICE_BLOCK_SIZE, (char*)buf, 1);
+}
+
+int disk_write_vec(unsigned int block_num, const struct iovec* iov, int iovcnt)
+{
+        struct image* d = &images[selected];
+        off_t off = (off_t)block_num * DEVICE_BLOCK_SIZE;
+        size_t len = 0;
+        int aligned = off % DISK_DIRECT_ALIGN == 0;
+        if(d->fd == -1){
                 return -1;
         }
+        for(int i = 0; i < iovcnt; i++){
+                len += iov[i].iov_len;
+                aligned &= (uintptr_t)iov[i].iov_base % DISK_DIRECT_ALIGN == 0 && iov[i].iov_len % DISK_DIRECT_ALIGN == 0;
+        }
+        if(off + len > get_disk_size()){
+                return -1;
+        }
+        if(d->direct && !aligned){
+                for(int i = 0; i < iovcnt; i++){
+                        if(transfer(off, iov[i].iov_len, iov[i].iov_base, 1)){
+                                return -1;
+                        }
+                        off += iov[i].iov_len;
+                }
+                return 0;
+        }
+        return stripe_io(JOB_WRITE, off, iov, iovcnt);
+}
+
+int disk_discard_block(unsigned int block_num, unsigned int count)
+{
+        struct image* d = &images[selected];
+        if(d->fd == -1){
+                return -1;
+        }
+        if((block_num + count) * DEVICE_BLOCK_SIZE > get_disk_size()){
+                return -1;
+        }
+        return stripe_io(JOB_DISCARD, (off_t)block_num * DEVICE_BLOCK_SIZE,
+                        &(struct iovec){NULL, (size_t)count * DEVICE_BLOCK_SIZE}, 1);
+}
+
+static int map_image(struct image* d)
+{
+        off_t units = (get_disk_size() + d->unit - 1) / d->unit;
+        d->map_len = d->members == 1 ? (size_t)get_disk_size()
+                : (size_t)((units + d->members - 1) / d->members * d->unit);
+        for(int m = 0; m < d->members; m++){
+                d->maps[m] = mmap(NULL, d->map_len, PROT_READ, MAP_SHARED, d->fds[m], 0);
+                if(d->maps[m] == MAP_FAILED){
+                        d->maps[m] = NULL;
+                        while(m-- > 0){
+                                munmap(d->maps[m], d->map_len);
+                                d->maps[m] = NULL;
+                        }
+                        return -1;
+                }
+        }
         return 0;
 }
 
-int close_disk()
+const char* disk_map_block(unsigned int block_num, unsigned int nbytes, unsigned int* len)
 {
-        if(disk == 0){
+        struct image* d = &images[selected];
+        off_t off = (off_t)block_num * DEVICE_BLOCK_SIZE;
+        off_t stripe = off / d->unit;
+        const char* p;
+        if(d->fd == -1 || nbytes == 0){
+                return NULL;
+        }
+        if(off + nbytes > get_disk_size()){
+                return NULL;
+        }
+        pthread_mutex_lock(&map_lock);
+        if(d->maps[0] == NULL && map_image(d) == -1){
+                pthread_mutex_unlock(&map_lock);
+                return NULL;
+        }
+        p = d->maps[stripe % d->members] + stripe / d->members * d->unit + off % d->unit;
+        *len = nbytes;
+        if(d->members > 1 && *len > d->unit - off % d->unit){
+                *len = d->unit - off % d->unit;
+        }
+        d->mapped++;
+        pthread_mutex_unlock(&map_lock);
+        return p;
+}
+
+int disk_unmap_block(const char* addr)
+{
+        pthread_mutex_lock(&map_lock);
+        for(int i = 0; i < DISK_MAX; i++){
+                struct image* d = &images[i];
+                for(int m = 0; m < d->members && d->maps[m] != NULL; m++){
+                        if(addr >= d->maps[m] && addr < d->maps[m] + d->map_len && d->mapped > 0){
+                                d->mapped--;
+                                pthread_mutex_unlock(&map_lock);
+                                return 0;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&map_lock);
+        return -1;
+}
+
+int disk_send_block(unsigned int block_num, unsigned int nbytes, int out_fd)
+{
+        struct image* d = &images[selected];
+        if(d->fd == -1){
                 return -1;
         }
-        int r = fclose(disk);
-        disk = 0;
+        if((off_t)block_num * DEVICE_BLOCK_SIZE + nbytes > get_disk_size()){
+                return -1;
+        }
+        int in_fd = d->fd;
+        off_t off = (off_t)block_num * DEVICE_BLOCK_SIZE;
+        ssize_t n = 0;
+        // the page cache is bypassed in direct mode, so are the in-kernel copies,
+        // which cannot gather the members of a striped disk either
+        int copy = !d->direct && d->members == 1;
+        // a chunk covers every member once
+        size_t chunk = d->members == 1 ? 4 * DISK_DIRECT_ALIGN : (size_t)d->members * d->unit;
+        char* buf;
+        int r = 0;
+        while(copy && nbytes > 0 && (n = copy_file_range(in_fd, &off, out_fd, 0, nbytes, 0)) > 0){
+                nbytes -= n;
+        }
+        while(copy && nbytes > 0 && (n = sendfile(out_fd, in_fd, &off, nbytes)) > 0){
+                nbytes -= n;
+        }
+        if(nbytes == 0){
+                return 0;
+        }
+        if(posix_memalign((void**)&buf, DISK_DIRECT_ALIGN, chunk)){
+                return -1;
+        }
+        while(nbytes > 0 && r == 0){
+                n = nbytes < chunk ? nbytes : chunk;
+                if(transfer(off, n, buf, 0) || write(out_fd, buf, n) != n){
+                        r = -1;
+                }
+                off += n;
+                nbytes -= n;
+        }
+        free(buf);
         return r;
+}
+
+int disk_sync()
+{
+        struct image* d = &images[selected];
+        if(d->fd == -1){
+                return -1;
+        }
+        if(d->members == 1){
+                return fdatasync(d->fd);
+        }
+        // the members are synced at the same time
+        struct job jobs[DISK_STRIPE_MAX];
+        for(int m = 0; m < d->members; m++){
+                jobs[m] = (struct job){.op = JOB_SYNC, .member = m, .fd = d->fds[m]};
+        }
+        return run_jobs(d, jobs, d->members);
+}
+
+int close_disk()
+{
+        struct image* d = &images[selected];
+        int r = 0;
+        if(d->fd == -1){
+                return -1;
+        }
+        pthread_mutex_lock(&map_lock);
+        if(d->mapped > 0){
+                pthread_mutex_unlock(&map_lock);
+                return -1;
+        }
+        for(int m = 0; m < d->members && d->maps[m] != NULL; m++){
+                munmap(d->maps[m], d->map_len);
+                d->maps[m] = NULL;
+        }
+        pthread_mutex_unlock(&map_lock);
+        if(d->members > 1){
+                stop_workers(d, d->members);
+        }
+        for(int m = 0; m < d->members; m++){
+                r |= close(d->fds[m]);
+        }
+        d->fd = -1;
+        return r ? -1 : 0;
 }
\ No newline at end of file
@@ -1,25 +1,122 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <sys/uio.h>
+
 // The size of one single disk block in bytes
 #define DEVICE_BLOCK_SIZE 512
 
+// The alignment of buffers, offsets and lengths of direct I/O transfers
+#define DISK_DIRECT_ALIGN 4096
+
+// The number of virtual disks a process can use at the same time
+#define DISK_MAX 8
+
+// The number of image files a striped virtual disk can spread over
+#define DISK_STRIPE_MAX 8
+
+// The default stripe unit in bytes, one file system block
+#define DISK_STRIPE_UNIT 4096
+
 
 // Total disk size in bytes, 4 * 1024 * 1024 bytes (4 MiB) in total
 int get_disk_size();
 
+/**
+ * @brief Select the virtual disk the calling thread works on.
+ * 
+ * @param id The index of the disk, from 0 to DISK_MAX - 1.
+ * @return returns the previously selected disk on success, -1 otherwise.
+ * 
+ * @note Every thread starts on disk 0, which is backed by the file "disk".
+ * All other functions act on the disk selected by the calling thread,
+ * so threads working on different disks do not interfere.
+ */
+int disk_select(int id);
+
+/**
+ * @brief Tell which virtual disk the calling thread works on.
+ * 
+ * @return returns the index of the selected disk.
+ */
+int disk_selected();
+
+/**
+ * @brief Set the file backing the selected virtual disk.
+ * 
+ * @param path The path of the image file.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note Disk 0 defaults to "disk", the other disks have no file until one is set.
+ * This function must be called before open_disk().
+ */
+int disk_set_path(const char* path);
+
+/**
+ * @brief Get the file backing the selected virtual disk.
+ * 
+ * @param path The space where the path is placed.
+ * @param size The size of that space.
+ * @return returns 0 on success, -1 otherwise.
+ */
+int disk_get_path(char* path, int size);
+
 /**
  * @brief Open the virtual disk.
  * 
  * @return returns 0 on success, -1 otherwise. 
  * 
- * @note This function will open a file named "disk" as a vritual disk
+ * @note This function will open the file set by disk_set_path() as a vritual disk, "disk" for disk 0.
  * If the file is not found, it will try to create the file, and fill it with zeros of 4 MiB.
  * This function must be called before any calls to disk_read_block() and disk_write_block().
- * This function will fail if the disk is already opened.
+ * This function will fail if the disk is already opened, or if another process holds it open.
  */
 int open_disk();
 
+/**
+ * @brief Stripe the selected virtual disk over several image files.
+ * 
+ * @param members The number of image files, from 1 to DISK_STRIPE_MAX, 1 for a plain image.
+ * @param unit    The stripe unit in bytes, a multiple of DISK_DIRECT_ALIGN.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The disk is cut into stripe units, which go round robin to the files
+ * "<path>.0", "<path>.1", ... A transfer over several units is split into one
+ * transfer per file and the files are accessed at the same time, so they
+ * should live on different devices. The size of the disk does not change.
+ * An image has to be opened with the geometry it was written with.
+ * This function must be called before open_disk().
+ */
+int disk_set_stripe(int members, int unit);
+
+/**
+ * @brief Tell how the selected virtual disk is striped.
+ * 
+ * @param unit The space where the stripe unit in bytes is placed.
+ * @return returns the number of image files, 1 for a plain image.
+ */
+int disk_get_stripe(int* unit);
+
+/**
+ * @brief Choose between buffered and direct I/O.
+ * 
+ * @param on 1 to open the disk with O_DIRECT, 0 for buffered I/O (the default).
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note Direct I/O bypasses the host page cache, so blocks are not cached twice
+ * when the file system has its own cache. Transfers whose buffer, offset or length
+ * are not aligned to DISK_DIRECT_ALIGN go through a bounce buffer.
+ * This function must be called before open_disk().
+ */
+int disk_set_direct(int on);
+
+/**
+ * @brief Tell whether direct I/O is selected.
+ * 
+ * @return returns 1 for direct I/O, 0 for buffered I/O.
+ */
+int disk_get_direct();
+
 /**
  * @brief Close the virtual disk.
  * 
@@ -54,4 +151,115 @@ int disk_read_block(unsigned int block_num, char* buf);
  */
 int disk_write_block(unsigned int block_num, char* buf);
 
+/**
+ * @brief Fill buf with count blocks starting at the block_num-th block, in one transfer.
+ * 
+ * @param block_num The index of the first block to be read.
+ * @param count     The number of blocks to be read.
+ * @param buf       The pointer to the space where the function shall place the content.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note In direct mode buf and the range should be aligned to DISK_DIRECT_ALIGN
+ * to avoid a bounce buffer.
+ * Make sure open_disk() is called before calling this function.
+ */
+int disk_read_blocks(unsigned int block_num, unsigned int count, char* buf);
+
+/**
+ * @brief Write count blocks starting at the block_num-th block from buf, in one transfer.
+ * 
+ * @param block_num The index of the first block to be written.
+ * @param count     The number of blocks to be written.
+ * @param buf       The pointer to the data to be written.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note In direct mode buf and the range should be aligned to DISK_DIRECT_ALIGN
+ * to avoid a bounce buffer.
+ * Make sure open_disk() is called before calling this function.
+ */
+int disk_write_blocks(unsigned int block_num, unsigned int count, const char* buf);
+
+/**
+ * @brief Write the buffers of iov one after another, starting at the block_num-th block, in one transfer.
+ * 
+ * @param block_num The index of the first block to be written.
+ * @param iov       The buffers, each a whole number of blocks long.
+ * @param iovcnt    The number of buffers, at most IOV_MAX.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The buffers land on consecutive blocks with a single pwritev().
+ * In direct mode every buffer has to be aligned to DISK_DIRECT_ALIGN, otherwise
+ * they are written one by one through a bounce buffer.
+ * Make sure open_disk() is called before calling this function.
+ */
+int disk_write_vec(unsigned int block_num, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Release count blocks starting at block_num to the host.
+ * 
+ * @param block_num The index of the first block to be released.
+ * @param count     The number of blocks to be released.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The blocks read back as zeros afterwards. The virtual disk keeps its size,
+ * only the space the host file system uses for it shrinks.
+ * Make sure open_disk() is called before calling this function.
+ */
+int disk_discard_block(unsigned int block_num, unsigned int count);
+
+/**
+ * @brief Copy nbytes starting at the block_num-th block to the file descriptor out_fd.
+ * 
+ * @param block_num The index of the first block to be copied.
+ * @param nbytes    The number of bytes to be copied.
+ * @param out_fd    The file descriptor the data is written to, at its current offset.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The data moves inside the kernel with copy_file_range() or sendfile(),
+ * without passing through a user space buffer. A read/write loop is used when
+ * neither works for out_fd, and always in direct mode.
+ * Make sure open_disk() is called before calling this function.
+ */
+int disk_send_block(unsigned int block_num, unsigned int nbytes, int out_fd);
+
+/**
+ * @brief Map nbytes starting at the block_num-th block read-only into memory.
+ * 
+ * @param block_num The index of the first block to be mapped.
+ * @param nbytes    The number of bytes wanted.
+ * @param len       The space where the number of bytes mapped is placed, at most nbytes.
+ * @return returns the address of the data on success, NULL otherwise.
+ * 
+ * @note The image files are mapped shared on first use, so the data is read
+ * straight from the host page cache without a copy, and blocks written later
+ * show through. On a striped disk a mapping ends where its stripe unit ends,
+ * the rest is mapped with another call.
+ * Every mapping has to be released with disk_unmap_block(), close_disk() fails
+ * while any is held.
+ * Make sure open_disk() is called before calling this function.
+ */
+const char* disk_map_block(unsigned int block_num, unsigned int nbytes, unsigned int* len);
+
+/**
+ * @brief Release a mapping made by disk_map_block().
+ * 
+ * @param addr The address returned by disk_map_block().
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note Any thread may release a mapping, whichever disk it selected.
+ */
+int disk_unmap_block(const char* addr);
+
+/**
+ * @brief Make the blocks written so far durable.
+ * 
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The data reaches stable storage with fdatasync(), the file size and
+ * times are not synced as the disk never changes its size.
+ * The members of a striped disk are synced at the same time.
+ * Make sure open_disk() is called before calling this function.
+ */
+int disk_sync();
+
 #endif 
\ No newline at end of file
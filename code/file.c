@@ -0,0 +1,360 @@
+#include "file.h"
+#include "trace.h"
+#include "capture.h"
+
+// every instance has its own descriptors
+static struct open_file open_files[FS_MAX_INSTANCE][N_OPEN_FILE];
+// the inode the incremental defragmentation of each instance goes on with
+static int defrag_next[FS_MAX_INSTANCE];
+
+static struct open_file* get_file(int fd)
+{
+    if (fd < 0 || fd >= N_OPEN_FILE || !open_files[fs_current()][fd].used)
+        return NULL;
+    return &open_files[fs_current()][fd];
+}
+
+// create the file at path, its parent directory must exist
+static int create(const char* path)
+{
+    char prtdir[256];
+    const char* p = strrchr(path, '/');
+    int dir;
+    if (p == NULL || p[1] == '\0' || p - path + 1 >= sizeof prtdir)
+        return -1;
+    memcpy(prtdir, path, p - path + 1);
+    prtdir[p - path + 1] = '\0';
+    if ((dir = openpath(prtdir)) < 0)
+        return -1;
+    return touch(dir, p + 1);
+}
+
+// write the cached block back
+static int wb_block(struct open_file* f)
+{
+    if (!f->dirty)
+        return 0;
+    if (fs_wr_block(DATA_BEGIN + f->inode.ptr[f->blockno], f->buf) < 0)
+        return -1;
+    f->dirty = 0;
+    return 0;
+}
+
+// load the blockno-th block of the file into the cache
+static int load_block(struct open_file* f, int blockno)
+{
+    if (f->blockno == blockno)
+        return 0;
+    if (wb_block(f) < 0)
+        return -1;
+    f->blockno = -1;
+    if (rd_file_block(&f->inode, blockno, f->buf) < 0)
+        return -1;
+    f->blockno = blockno;
+    return 0;
+}
+
+// read the inode again, a file open for writing is kept uncompressed
+static int reload(struct open_file* f)
+{
+    f->blockno = -1;
+    if (rd_inode(f->index, &f->inode) < 0)
+        return -1;
+    if (f->inode.compressed && (f->flags & FS_O_ACCMODE) != FS_O_RDONLY)
+        if (fs_decompress(f->index) < 0 || rd_inode(f->index, &f->inode) < 0)
+            return -1;
+    return 0;
+}
+
+// commit appended data, so that the cached inode covers the whole file
+static int sync_inode(struct open_file* f)
+{
+    if (f->size == f->inode.size)
+        return 0;
+    if (wb_block(f) < 0 || fs_flush(f->index) < 0)
+        return -1;
+    return reload(f);
+}
+
+static int do_open(const char* path, int flags)
+{
+    struct open_file* tab = open_files[fs_current()];
+    struct open_file* f;
+    int fd, index;
+    for (fd=0; fd<N_OPEN_FILE && tab[fd].used; ++fd)
+        ;
+    if (fd == N_OPEN_FILE)
+        return -1;
+    if ((index = openpath(path)) < 0)
+        if (!(flags & FS_O_CREAT) || (index = create(path)) < 0)
+            return -1;
+    f = &tab[fd];
+    f->index = index;
+    f->flags = flags;
+    if ((flags & FS_O_TRUNC) && (flags & FS_O_ACCMODE) != FS_O_RDONLY)
+        if (fs_truncate(index, 0) < 0)
+            return -1;
+    if (fs_flush(index) < 0 || reload(f) < 0)
+        return -1;
+    if (f->inode.type == TYPE_DIR)
+        return -1;
+    f->used = 1;
+    f->pos = 0;
+    f->size = f->inode.size;
+    f->dirty = 0;
+    return fd;
+}
+
+static int do_read(int fd, char* buf, int count)
+{
+    struct open_file* f;
+    int blockno, offset, n;
+    int done = 0;
+    if ((f = get_file(fd)) == NULL || (f->flags & FS_O_ACCMODE) == FS_O_WRONLY || count < 0)
+        return -1;
+    if (f->pos >= f->size)
+        return 0;
+    if (count > f->size - f->pos)
+        count = f->size - f->pos;
+    if (f->pos + count > f->inode.size && sync_inode(f) < 0)
+        return -1;
+    while (done < count)
+    {
+        blockno = f->pos / FS_BLOCK_SIZE;
+        offset = f->pos % FS_BLOCK_SIZE;
+        n = FS_BLOCK_SIZE - offset < count - done ? FS_BLOCK_SIZE - offset : count - done;
+        if (load_block(f, blockno) < 0)
+            return done > 0 ? done : -1;
+        memcpy(buf + done, f->buf + offset, n);
+        f->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+int fs_read(int fd, char* buf, int count)
+{
+    TRACE_BEGIN(start);
+    uint64_t cap = capturing ? capture_begin() : 0;
+    int op = fs_op_begin();
+    int r = do_read(fd, buf, count);
+    if (fs_op_end(op) < 0)
+        r = -1;
+    TRACE_END(TRACE_READ, start, r);
+    if (cap)
+        capture_end(cap, &(struct capture_rec) {.kind = CAP_READ, .fd = fd, .arg = count, .result = r});
+    return r;
+}
+
+static int do_write(int fd, const char* buf, int count)
+{
+    struct open_file* f;
+    int blockno, offset, n;
+    int done = 0;
+    if ((f = get_file(fd)) == NULL || (f->flags & FS_O_ACCMODE) == FS_O_RDONLY || count < 0)
+        return -1;
+    // a mapped file keeps what its views show
+    if (fs_viewed(f->index))
+        return -1;
+    if (f->flags & FS_O_APPEND)
+        f->pos = f->size;
+    // a modified cached block may only exist while nothing is pending behind it
+    if (f->pos < f->size && sync_inode(f) < 0)
+        return -1;
+    // overwrite the committed part through the cached block
+    while (done < count && f->pos < f->inode.size)
+    {
+        blockno = f->pos / FS_BLOCK_SIZE;
+        offset = f->pos % FS_BLOCK_SIZE;
+        n = FS_BLOCK_SIZE - offset < count - done ? FS_BLOCK_SIZE - offset : count - done;
+        if (n > f->inode.size - f->pos)
+            n = f->inode.size - f->pos;
+        if (f->blockno != blockno || !f->dirty)
+        {
+            if (load_block(f, blockno) < 0 || unshare_block(f->index, &f->inode, blockno) < 0)
+                return done > 0 ? done : -1;
+        }
+        memcpy(f->buf + offset, buf + done, n);
+        f->dirty = 1;
+        f->pos += n;
+        done += n;
+    }
+    if (done == count)
+        return done;
+    // the rest goes past the end of the file, into the delayed allocation cache
+    if (wb_block(f) < 0)
+        return done > 0 ? done : -1;
+    if (f->pos > f->size)
+    {
+        if ((n = fs_append(f->index, NULL, f->pos - f->size)) < 0)
+            return done > 0 ? done : -1;
+        f->size += n;
+        f->pos = f->size;
+    }
+    if ((n = fs_append(f->index, buf + done, count - done)) < 0)
+        return done > 0 ? done : -1;
+    f->size += n;
+    f->pos += n;
+    return done + n;
+}
+
+int fs_write(int fd, const char* buf, int count)
+{
+    TRACE_BEGIN(start);
+    uint64_t cap = capturing ? capture_begin() : 0;
+    int op = fs_op_begin();
+    int r = do_write(fd, buf, count);
+    if (fs_op_end(op) < 0)
+        r = -1;
+    TRACE_END(TRACE_WRITE, start, r);
+    if (cap)
+        capture_end(cap, &(struct capture_rec) {.kind = CAP_WRITE, .fd = fd, .data = buf, .data_len = count, .result = r});
+    return r;
+}
+
+static int do_lseek(int fd, int offset, int whence)
+{
+    struct open_file* f;
+    int pos;
+    if ((f = get_file(fd)) == NULL)
+        return -1;
+    if (whence == FS_SEEK_SET)
+        pos = offset;
+    else if (whence == FS_SEEK_CUR)
+        pos = f->pos + offset;
+    else if (whence == FS_SEEK_END)
+        pos = f->size + offset;
+    else
+        return -1;
+    if (pos < 0 || pos > FS_BLOCK_SIZE * N_DIRECT_PTR)
+        return -1;
+    f->pos = pos;
+    return pos;
+}
+
+static int do_close(int fd)
+{
+    struct open_file* f;
+    int r = 0;
+    if ((f = get_file(fd)) == NULL)
+        return -1;
+    if (wb_block(f) < 0 || fs_flush(f->index) < 0)
+        r = -1;
+    f->used = 0;
+    return r;
+}
+
+int fs_open(const char* path, int flags)
+{
+    uint64_t cap = capturing ? capture_begin() : 0;
+    int op = fs_op_begin();
+    int r = do_open(path, flags);
+    if (fs_op_end(op) < 0)
+        r = -1;
+    if (cap)
+        capture_end(cap, &(struct capture_rec) {.kind = CAP_OPEN, .arg = flags, .str = path, .str_len = strlen(path), .result = r});
+    return r;
+}
+
+int fs_lseek(int fd, int offset, int whence)
+{
+    uint64_t cap = capturing ? capture_begin() : 0;
+    int r = do_lseek(fd, offset, whence);
+    if (cap)
+        capture_end(cap, &(struct capture_rec) {.kind = CAP_LSEEK, .fd = fd, .offset = offset, .arg = whence, .result = r});
+    return r;
+}
+
+int fs_close(int fd)
+{
+    uint64_t cap = capturing ? capture_begin() : 0;
+    int op = fs_op_begin();
+    int r = do_close(fd);
+    if (fs_op_end(op) < 0)
+        r = -1;
+    if (cap)
+        capture_end(cap, &(struct capture_rec) {.kind = CAP_CLOSE, .fd = fd, .result = r});
+    return r;
+}
+
+int fs_close_all()
+{
+    int r = 0;
+    for (int fd=0; fd<N_OPEN_FILE; ++fd)
+        if (open_files[fs_current()][fd].used && do_close(fd) < 0)
+            r = -1;
+    defrag_next[fs_current()] = 0;
+    return r;
+}
+
+// whether a descriptor holds the inode, whose block map it keeps a copy of
+static int is_open(int index)
+{
+    for (int fd=0; fd<N_OPEN_FILE; ++fd)
+        if (open_files[fs_current()][fd].used && open_files[fs_current()][fd].index == index)
+            return 1;
+    return 0;
+}
+
+static int do_defrag_batch(int batch, struct frag_stat* stat)
+{
+    int* next = &defrag_next[fs_current()];
+    int done = stat->defragged + batch;
+    while (*next < INODE_NUM && stat->defragged < done)
+    {
+        int index = (*next)++;
+        // a file that fails is not tried again before the next pass
+        if (!is_open(index) && fs_defrag(index, stat) < 0)
+            return -1;
+    }
+    if (*next < INODE_NUM)
+        return 0;
+    *next = 0;
+    return 1;
+}
+
+int fs_defrag_batch(int batch, struct frag_stat* stat)
+{
+    // a batch is one operation, other operations go in between batches
+    int op = fs_op_begin();
+    int r = do_defrag_batch(batch, stat);
+    if (fs_op_end(op) < 0)
+        r = -1;
+    return r;
+}
+
+int fs_copy(int src_fs, const char* src, int dst_fs, const char* dst)
+{
+    static _Thread_local char buf[FS_BLOCK_SIZE * N_DIRECT_PTR];
+    struct fs_view views[N_DIRECT_PTR];
+    int prev, fd, i, index = -1, nviews = -1, n = -1, r = -1;
+    if ((prev = fs_use(src_fs)) < 0)
+        return -1;
+    // the source is written from the mapped image of another instance, a compressed file has to be read
+    if (src_fs != dst_fs && (index = openpath(src)) >= 0 && (nviews = fs_map(index, views)) >= 0)
+    {
+        for (i=0, n=0; i<nviews; ++i)
+            n += views[i].len;
+    }
+    else if ((fd = fs_open(src, FS_O_RDONLY)) >= 0)
+    {
+        n = fs_read(fd, buf, sizeof buf);
+        fs_close(fd);
+    }
+    // a whole file fits in the buffer, it is written in one go on the other side
+    if (n >= 0 && fs_use(dst_fs) >= 0 && (fd = fs_open(dst, FS_O_WRONLY | FS_O_CREAT | FS_O_TRUNC)) >= 0)
+    {
+        r = n;
+        if (nviews < 0 && fs_write(fd, buf, n) != n)
+            r = -1;
+        for (i=0; i<nviews; ++i)
+            if (fs_write(fd, views[i].data, views[i].len) != views[i].len)
+                r = -1;
+        if (fs_close(fd) < 0)
+            r = -1;
+    }
+    if (nviews >= 0 && fs_use(src_fs) >= 0)
+        fs_unmap(index, views, nviews);
+    fs_use(prev);
+    return r;
+}
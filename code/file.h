@@ -0,0 +1,58 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "fs.h"
+
+#define FS_O_RDONLY (0)
+#define FS_O_WRONLY (1)
+#define FS_O_RDWR (2)
+#define FS_O_ACCMODE (3)
+#define FS_O_CREAT (4)  // 文件不存在时创建
+#define FS_O_TRUNC (8)  // 打开时把文件截断为0字节
+#define FS_O_APPEND (16) // 每次写入都追加到文件末尾
+
+#define FS_SEEK_SET (0)
+#define FS_SEEK_CUR (1)
+#define FS_SEEK_END (2)
+
+#define N_OPEN_FILE (16)
+
+// 打开文件表项，缓存了inode（即数据块映射）、读写位置和一个数据块
+struct open_file {
+    int used;
+    int index;          // inode序号
+    int flags;
+    int pos;            // 读写位置
+    int size;           // 文件长度，包括尚未写回的追加数据
+    struct inode inode; // 缓存的inode，inode.size之后的数据还在延迟分配的缓存中
+    int blockno;        // buf中缓存的数据块，-1表示没有
+    int dirty;          // buf被修改过，需要写回
+    char buf[FS_BLOCK_SIZE];
+};
+
+// 打开文件，返回文件句柄，失败返回-1
+int fs_open(const char* path, int flags);
+
+// 从当前位置读取至多count字节，返回读到的字节数
+int fs_read(int fd, char* buf, int count);
+
+// 在当前位置写入count字节，返回写入的字节数
+int fs_write(int fd, const char* buf, int count);
+
+// 移动读写位置，返回新的位置
+int fs_lseek(int fd, int offset, int whence);
+
+// 关闭文件，写回缓存的数据
+int fs_close(int fd);
+
+// 关闭当前实例的所有文件，写回缓存的数据；实例被fs_detach关闭时调用，之后该实例的描述符都失效
+int fs_close_all();
+
+// 从上次停下的inode接着整理碎片，至多整理batch个文件后停下，打开着的文件跳过；结果累加到stat，
+// 扫描完整个inode表时返回1，否则返回0，失败返回-1
+int fs_defrag_batch(int batch, struct frag_stat* stat);
+
+// 把实例src_fs中的文件src复制到实例dst_fs中的dst，dst不存在时创建，返回复制的字节数
+int fs_copy(int src_fs, const char* src, int dst_fs, const char* dst);
+
+#endif
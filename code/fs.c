@@ -1,49 +1,648 @@
 #include "fs.h"
+#include "file.h"
+#include "lz.h"
+#include "trace.h"
+#include "cache.h"
+#include "crc32c.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 const char* curdir = ".";
 const char* prtdir = "..";
+const char* const durability_name[3] = {"none", "op", "group"};
 
-int fs_rd_block(unsigned int index, char* const fs_buf)
+// the state of one file system instance, a thread works on the instance
+// of the disk it selected, disk_selected() is its number
+static struct instance {
+    int reserved;       // taken by fs_attach, instance 0 always is
+    int closing;        // set by fs_detach, the disk is not opened again until fs_attach takes the slot
+    int attached;
+    int durability;
+    int interval;
+    int op_depth;
+    int options;        // FS_COMPRESS and the like, set by fs_set_options
+    struct compress_stat compress_stat;
+    struct dedup_stat dedup_stat;
+    struct csum_stat csum_stat;
+    // one write back at a time, so that a sync returns only after the blocks
+    // written by a concurrent one are durable as well
+    pthread_mutex_t sync_lock;
+    long unsynced;      // blocks written to the disk but not synced yet
+    struct sync_stat sync_stat;
+    pthread_mutex_t flusher_lock;
+    pthread_cond_t flusher_cond;
+    pthread_t flusher;
+    int flusher_running;
+    // views handed out by fs_map, the data blocks of such files stay where they are
+    int nviews;
+    unsigned short viewed[INODE_NUM];
+    // the checksum block, read on first use and kept up by csum_hook
+    pthread_mutex_t csum_lock;
+    int csum_loaded;
+    int csum_dirty;     // csum differs from the block on the disk
+    int csum_zero;      // csum_disk has slots zeroed that are not on the disk yet
+    uint32_t csum[FS_BLOCK_COUNT];      // of the blocks as they are on the disk
+    uint32_t csum_disk[FS_BLOCK_COUNT]; // the checksum block as it is on the disk
+} instances[FS_MAX_INSTANCE] = {
+    [0 ... FS_MAX_INSTANCE - 1] = {
+        .durability = SYNC_NONE,
+        .interval = SYNC_INTERVAL,
+        .sync_lock = PTHREAD_MUTEX_INITIALIZER,
+        .flusher_lock = PTHREAD_MUTEX_INITIALIZER,
+        .flusher_cond = PTHREAD_COND_INITIALIZER,
+        .csum_lock = PTHREAD_MUTEX_INITIALIZER,
+    },
+    [0].reserved = 1,
+};
+static pthread_mutex_t instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct instance* cur()
 {
-    if (index >= FS_BLOCK_COUNT)
+    return &instances[disk_selected()];
+}
+
+// an option of the current instance
+static int option(int flag)
+{
+    return cur()->options & flag;
+}
+
+static void sync_atexit();
+static void dalloc_atexit();
+static void dalloc_forget();
+static void dedup_forget();
+static int csum_hook(int phase, unsigned int index, const char* data);
+
+// the disk is opened on first use and stays open until the process exits or the instance is detached
+static int attach_disk()
+{
+    static int registered = 0;
+    struct instance* in = cur();
+    if (!in->attached)
+    {
+        // a thread still on a detached instance must not bring its image back
+        if (!in->reserved || in->closing)
+            return -1;
+        if (open_disk() == -1)
+            return -1;
+        // the delayed allocation is flushed first, the handlers run in reverse order
+        pthread_mutex_lock(&instance_lock);
+        if (!registered)
+        {
+            atexit(sync_atexit);
+            atexit(dalloc_atexit);
+            cache_set_hook(csum_hook);
+        }
+        registered = 1;
+        pthread_mutex_unlock(&instance_lock);
+        in->attached = 1;
+    }
+    return 0;
+}
+
+// CRC32C of a block, that of the checksum block leaves out its own slot at the end
+static uint32_t block_crc(unsigned int index, const char* buf)
+{
+    return crc32c(0, buf, index == CSUM_BLOCK ? FS_BLOCK_SIZE - sizeof (uint32_t) : FS_BLOCK_SIZE);
+}
+
+// read the checksum block on first use, the caller holds csum_lock; a block that does not
+// check itself, or the data an old image keeps there, leaves every block unchecked, so that
+// the image can still be read and formatted, until the blocks are written again
+static int csum_load(struct instance* in)
+{
+    _Alignas(DISK_DIRECT_ALIGN) char disk_buf[FS_BLOCK_SIZE];
+    uint32_t self;
+    if (in->csum_loaded)
+        return 0;
+    if (disk_read_blocks(CSUM_BLOCK * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE), FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE, disk_buf) == -1)
+        return -1;
+    memcpy(&self, disk_buf + FS_BLOCK_SIZE - sizeof self, sizeof self);
+    // a bad block is written again at the next flush
+    in->csum_dirty = self != 0 && self != block_crc(CSUM_BLOCK, disk_buf);
+    if (in->csum_dirty)
+    {
+        __atomic_fetch_add(&in->csum_stat.errors, 1, __ATOMIC_RELAXED);
+        memset(disk_buf, 0, FS_BLOCK_SIZE);
+    }
+    memcpy(in->csum, disk_buf, FS_BLOCK_SIZE);
+    memcpy(in->csum_disk, disk_buf, FS_BLOCK_SIZE);
+    in->csum_zero = 0;
+    in->csum_loaded = 1;
+    return 0;
+}
+
+// write a table to the checksum block, past the cache so that it is ordered against the blocks
+// it covers; with durability on it is synced, a crash must not find it after the blocks
+static int csum_write(struct instance* in, const uint32_t* table)
+{
+    _Alignas(DISK_DIRECT_ALIGN) char disk_buf[FS_BLOCK_SIZE];
+    uint32_t self;
+    memcpy(disk_buf, table, FS_BLOCK_SIZE);
+    self = block_crc(CSUM_BLOCK, disk_buf);
+    memcpy(disk_buf + FS_BLOCK_SIZE - sizeof self, &self, sizeof self);
+    if (disk_write_blocks(CSUM_BLOCK * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE), FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE, disk_buf) == -1)
         return -1;
-    char disk_buf[DEVICE_BLOCK_SIZE];
-    char* p = fs_buf;
-    if (open_disk() == -1)
+    return in->durability != SYNC_NONE ? disk_sync() : 0;
+}
+
+// check a block read from the disk, 1 if it does not match
+static int csum_verify(unsigned int index, const char* buf)
+{
+    struct instance* in = cur();
+    uint32_t want;
+    int r;
+    pthread_mutex_lock(&in->csum_lock);
+    r = csum_load(in);
+    want = in->csum[index];
+    pthread_mutex_unlock(&in->csum_lock);
+    if (r < 0)
         return -1;
-    for (int i=0; i<FS_BLOCK_SIZE/DEVICE_BLOCK_SIZE; ++i)
+    if (want == 0)
+        return 0;
+    if (block_crc(index, buf) != want)
+        return 1;
+    __atomic_fetch_add(&in->csum_stat.verified, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// called by the cache whenever it writes blocks back, on eviction as well as at a flush:
+// each block gets the checksum of what goes to the disk, data blocks only with FS_CSUM_DATA
+// mode; a slot of the checksum block that no longer matches is zeroed on the disk before
+// the blocks are written, and the new checksums are written after a flush is done, so that
+// a crash in between leaves a block unchecked rather than failing the check
+static int csum_hook(int phase, unsigned int index, const char* data)
+{
+    struct instance* in = cur();
+    uint32_t crc;
+    int r;
+    pthread_mutex_lock(&in->csum_lock);
+    if ((r = csum_load(in)) == 0 && phase == CACHE_HOOK_BLOCK)
+    {
+        crc = index < DATA_BEGIN || in->options & FS_CSUM_DATA ? block_crc(index, data) : 0;
+        if (in->csum[index] != crc)
+        {
+            in->csum[index] = crc;
+            in->csum_dirty = 1;
+        }
+        if (in->csum_disk[index] != 0 && in->csum_disk[index] != crc)
+        {
+            in->csum_disk[index] = 0;
+            in->csum_zero = 1;
+        }
+    }
+    else if (r == 0 && phase == CACHE_HOOK_BEFORE && in->csum_zero)
+    {
+        if ((r = csum_write(in, in->csum_disk)) == 0)
+            in->csum_zero = 0;
+    }
+    else if (r == 0 && phase == CACHE_HOOK_AFTER && in->csum_dirty)
+    {
+        // the blocks must be durable before the table that covers them
+        if ((r = in->durability != SYNC_NONE ? disk_sync() : 0) == 0 && (r = csum_write(in, in->csum)) == 0)
+        {
+            memcpy(in->csum_disk, in->csum, sizeof in->csum);
+            in->csum_dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&in->csum_lock);
+    return r;
+}
+
+// blocks released to the host read back as zeros, they are not checked until written again;
+// their slots are zeroed on the disk before the hole is punched
+static int csum_clear(unsigned int index, unsigned int count)
+{
+    struct instance* in = cur();
+    int r;
+    pthread_mutex_lock(&in->csum_lock);
+    if ((r = csum_load(in)) == 0)
     {
-        if (disk_read_block(index * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE) + i, disk_buf) == -1)
+        for (unsigned int i=index; i<index+count; ++i)
         {
-            close_disk();
+            in->csum[i] = 0;
+            in->csum_zero |= in->csum_disk[i] != 0;
+            in->csum_disk[i] = 0;
+        }
+        if (in->csum_zero && (r = csum_write(in, in->csum_disk)) == 0)
+            in->csum_zero = 0;
+    }
+    pthread_mutex_unlock(&in->csum_lock);
+    return r;
+}
+
+// start from an empty checksum block, a new file system checks only what it writes;
+// the old table is zeroed at once, it does not cover the blocks about to be written
+static int csum_reset()
+{
+    struct instance* in = cur();
+    int r;
+    if (attach_disk() == -1)
+        return -1;
+    pthread_mutex_lock(&in->csum_lock);
+    memset(in->csum, 0, sizeof in->csum);
+    memset(in->csum_disk, 0, sizeof in->csum_disk);
+    in->csum_dirty = 0;
+    in->csum_zero = 0;
+    in->csum_loaded = 1;
+    r = csum_write(in, in->csum_disk);
+    pthread_mutex_unlock(&in->csum_lock);
+    return r;
+}
+
+// read a block from the disk and check it, a mismatch is read once more,
+// since a write racing with the read may have changed the block and its checksum
+static int rd_disk_block(unsigned int index, char* disk_buf)
+{
+    int r;
+    for (int retry=0; retry<2; ++retry)
+    {
+        // one aligned transfer of the whole block, which direct I/O requires
+        if (disk_read_blocks(index * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE), FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE, disk_buf) == -1)
             return -1;
+        if ((r = csum_verify(index, disk_buf)) <= 0)
+            return r;
+    }
+    __atomic_fetch_add(&cur()->csum_stat.errors, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+int fs_viewed(int index)
+{
+    return index >= 0 && index < INODE_NUM && __atomic_load_n(&cur()->viewed[index], __ATOMIC_RELAXED) > 0;
+}
+
+static int rd_block(unsigned int index, char* const fs_buf)
+{
+    _Alignas(DISK_DIRECT_ALIGN) char disk_buf[FS_BLOCK_SIZE];
+    unsigned int gen;
+    if (index >= FS_BLOCK_COUNT)
+        return -1;
+    if (cache_lookup(index, fs_buf, &gen) == 0)
+        return 0;
+    if (attach_disk() == -1)
+        return -1;
+    if (rd_disk_block(index, disk_buf) < 0)
+        return -1;
+    memcpy(fs_buf, disk_buf, FS_BLOCK_SIZE);
+    cache_insert(index, fs_buf, gen);
+    return 0;
+}
+
+// read the data blocks that are not cached with one transfer per physically
+// contiguous run, the stripe units of a run are read from all members at once
+static int readahead(const int* blocks, int count)
+{
+    _Alignas(DISK_DIRECT_ALIGN) char disk_buf[N_DIRECT_PTR][FS_BLOCK_SIZE];
+    unsigned int gens[N_DIRECT_PTR];
+    int i, run;
+    if (attach_disk() == -1)
+        return -1;
+    for (i=0; i<count; i+=run)
+    {
+        for (run=0; i+run<count && blocks[i+run] == blocks[i] + run
+             && cache_lookup(DATA_BEGIN + blocks[i+run], NULL, &gens[run]) < 0; ++run)
+            ;
+        if (run == 0)
+        {
+            run = 1;
+            continue;
         }
-        memcpy(p, disk_buf, DEVICE_BLOCK_SIZE);
-        p += DEVICE_BLOCK_SIZE;
+        if (disk_read_blocks((DATA_BEGIN + blocks[i]) * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE),
+                             run * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE), disk_buf[0]) == -1)
+            return -1;
+        // a block that does not match is left to rd_block, which reads it again
+        for (int k=0; k<run; ++k)
+            if (csum_verify(DATA_BEGIN + blocks[i] + k, disk_buf[k]) == 0)
+                cache_insert(DATA_BEGIN + blocks[i] + k, disk_buf[k], gens[k]);
     }
-    close_disk();
     return 0;
 }
 
-int fs_wr_block(unsigned int index, const char* const fs_buf)
+int fs_rd_block(unsigned int index, char* const fs_buf)
+{
+    TRACE_BEGIN(start);
+    int r = rd_block(index, fs_buf);
+    TRACE_END(TRACE_BLOCK_READ, start, index);
+    return r;
+}
+
+static int wr_block(unsigned int index, const char* const fs_buf)
 {
     if (index >= FS_BLOCK_COUNT)
         return -1;
-    char disk_buf[DEVICE_BLOCK_SIZE];
-    const char* p = fs_buf;
-    if (open_disk() == -1)
+    if (attach_disk() == -1)
+        return -1;
+    // write-back, the block reaches the disk when it is evicted or at the next sync point,
+    // its checksum is taken by csum_hook then
+    return cache_write(index, fs_buf);
+}
+
+int fs_wr_block(unsigned int index, const char* const fs_buf)
+{
+    TRACE_BEGIN(start);
+    int r = wr_block(index, fs_buf);
+    TRACE_END(TRACE_BLOCK_WRITE, start, index);
+    return r;
+}
+
+static int discard_block(unsigned int index, unsigned int count)
+{
+    int r;
+    if (index + count > FS_BLOCK_COUNT)
+        return -1;
+    if (attach_disk() == -1)
+        return -1;
+    // dirty blocks are dropped first, a write back must not fill the hole again
+    cache_invalidate(index, count);
+    if (csum_clear(index, count) < 0)
+        return -1;
+    r = disk_discard_block(index * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE), count * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE));
+    // and after the hole is punched, so that a concurrent miss cannot cache the old data
+    cache_invalidate(index, count);
+    return r;
+}
+
+int fs_discard_block(unsigned int index, unsigned int count)
+{
+    TRACE_BEGIN(start);
+    int r = discard_block(index, count);
+    TRACE_END(TRACE_BLOCK_DISCARD, start, index);
+    return r;
+}
+
+// write the dirty blocks back, and make everything written so far durable if asked
+static int writeback(int durable)
+{
+    struct instance* in = cur();
+    uint64_t start;
+    int n, r = 0;
+    pthread_mutex_lock(&in->sync_lock);
+    if ((n = cache_flush()) < 0)
+        r = -1;
+    else
+    {
+        in->sync_stat.blocks += n;
+        in->unsynced += n;
+    }
+    if (r == 0 && durable && in->unsynced > 0)
+    {
+        start = trace_now();
+        if (disk_sync() < 0)
+            r = -1;
+        else
+        {
+            in->sync_stat.syncs++;
+            in->unsynced = 0;
+        }
+        in->sync_stat.sync_ns += trace_now() - start;
+        TRACE_END(TRACE_SYNC, start, n);
+    }
+    pthread_mutex_unlock(&in->sync_lock);
+    return r;
+}
+
+// group commit, every interval the dirty blocks go out together with one fdatasync
+static void* flusher_main(void* arg)
+{
+    struct instance* in;
+    struct timespec due;
+    disk_select((intptr_t) arg);
+    in = cur();
+    pthread_mutex_lock(&in->flusher_lock);
+    while (in->flusher_running)
+    {
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_sec += in->interval / 1000;
+        due.tv_nsec += in->interval % 1000 * 1000000L;
+        if (due.tv_nsec >= 1000000000L)
+        {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        while (in->flusher_running && pthread_cond_timedwait(&in->flusher_cond, &in->flusher_lock, &due) != ETIMEDOUT)
+            ;
+        if (!in->flusher_running)
+            break;
+        pthread_mutex_unlock(&in->flusher_lock);
+        writeback(1);
+        pthread_mutex_lock(&in->flusher_lock);
+    }
+    pthread_mutex_unlock(&in->flusher_lock);
+    return NULL;
+}
+
+static void stop_flusher()
+{
+    struct instance* in = cur();
+    pthread_mutex_lock(&in->flusher_lock);
+    if (!in->flusher_running)
+    {
+        pthread_mutex_unlock(&in->flusher_lock);
+        return;
+    }
+    in->flusher_running = 0;
+    pthread_cond_signal(&in->flusher_cond);
+    pthread_mutex_unlock(&in->flusher_lock);
+    pthread_join(in->flusher, NULL);
+}
+
+static void sync_atexit()
+{
+    int prev = disk_selected();
+    for (int id=0; id<FS_MAX_INSTANCE; ++id)
+    {
+        if (!instances[id].attached)
+            continue;
+        disk_select(id);
+        stop_flusher();
+        writeback(instances[id].durability != SYNC_NONE);
+    }
+    disk_select(prev);
+}
+
+int fs_set_durability(int mode, int interval_ms)
+{
+    struct instance* in = cur();
+    int r;
+    if (mode < SYNC_NONE || mode > SYNC_GROUP || interval_ms <= 0)
         return -1;
-    for (int i=0; i<FS_BLOCK_SIZE/DEVICE_BLOCK_SIZE; ++i)
+    stop_flusher();
+    // what the old mode promised is kept before switching
+    r = writeback(in->durability != SYNC_NONE);
+    in->durability = mode;
+    in->interval = interval_ms;
+    if (mode == SYNC_GROUP)
     {
-        memcpy(disk_buf, p, DEVICE_BLOCK_SIZE);
-        if (disk_write_block(index * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE) + i, disk_buf) == -1)
+        in->flusher_running = 1;
+        if (pthread_create(&in->flusher, NULL, flusher_main, (void*) (intptr_t) disk_selected()) != 0)
+        {
+            in->flusher_running = 0;
+            in->durability = SYNC_NONE;
             return -1;
-        p += DEVICE_BLOCK_SIZE;
+        }
+    }
+    return r;
+}
+
+int fs_get_durability(int* interval_ms)
+{
+    if (interval_ms != NULL)
+        *interval_ms = cur()->interval;
+    return cur()->durability;
+}
+
+int fs_sync()
+{
+    if (attach_disk() == -1)
+        return -1;
+    return writeback(1);
+}
+
+int fs_op_begin()
+{
+    cur()->op_depth++;
+    return disk_selected();
+}
+
+int fs_op_end(int op)
+{
+    // a command may have switched to another instance in between
+    int prev = disk_select(op), r = 0;
+    struct instance* in = cur();
+    // the file operations of a command belong to the command
+    if (--in->op_depth == 0 && in->durability != SYNC_GROUP)
+        r = writeback(in->durability == SYNC_OP);
+    disk_select(prev);
+    return r;
+}
+
+void fs_get_sync_stat(struct sync_stat* stat)
+{
+    struct instance* in = cur();
+    pthread_mutex_lock(&in->sync_lock);
+    *stat = in->sync_stat;
+    pthread_mutex_unlock(&in->sync_lock);
+}
+
+void fs_set_options(int options)
+{
+    cur()->options = options;
+}
+
+int fs_get_options()
+{
+    return cur()->options;
+}
+
+void fs_get_compress_stat(struct compress_stat* stat)
+{
+    *stat = cur()->compress_stat;
+}
+
+void fs_get_dedup_stat(struct dedup_stat* stat)
+{
+    *stat = cur()->dedup_stat;
+}
+
+void fs_get_csum_stat(struct csum_stat* stat)
+{
+    struct instance* in = cur();
+    // counted by the readers of the instance without a lock
+    stat->verified = __atomic_load_n(&in->csum_stat.verified, __ATOMIC_RELAXED);
+    stat->errors = __atomic_load_n(&in->csum_stat.errors, __ATOMIC_RELAXED);
+}
+
+int fs_attach(const char* image)
+{
+    int id, prev, direct = disk_get_direct();
+    pthread_mutex_lock(&instance_lock);
+    for (id=1; id<FS_MAX_INSTANCE && instances[id].reserved; ++id)
+        ;
+    if (id < FS_MAX_INSTANCE)
+    {
+        instances[id].reserved = 1;
+        instances[id].closing = 0;
+    }
+    pthread_mutex_unlock(&instance_lock);
+    if (id == FS_MAX_INSTANCE)
+        return -1;
+    prev = disk_select(id);
+    // the new instance takes the disk I/O mode of the caller's
+    if (disk_set_path(image) < 0 || disk_set_direct(direct) < 0 || attach_disk() < 0)
+    {
+        disk_select(prev);
+        pthread_mutex_lock(&instance_lock);
+        instances[id].reserved = 0;
+        pthread_mutex_unlock(&instance_lock);
+        return -1;
     }
+    disk_select(prev);
+    return id;
+}
+
+int fs_detach(int id)
+{
+    struct instance* in = &instances[id];
+    int prev, r = 0;
+    if (id <= 0 || id >= FS_MAX_INSTANCE || !in->reserved || !in->attached)
+        return -1;
+    if (__atomic_load_n(&in->nviews, __ATOMIC_RELAXED) > 0)
+        return -1;
+    prev = disk_select(id);
+    stop_flusher();
+    if (fs_close_all() < 0 || fs_flush_all() < 0 || writeback(1) < 0)
+        r = -1;
+    pthread_mutex_lock(&instance_lock);
+    in->closing = 1;
+    pthread_mutex_unlock(&instance_lock);
+    // nothing of the image may stay behind for the next one in this slot
+    dalloc_forget();
+    dedup_forget();
+    cache_invalidate(0, FS_BLOCK_COUNT);
+    in->csum_loaded = 0;
     close_disk();
-    return 0;
+    disk_set_path("");
+    in->attached = 0;
+    in->durability = SYNC_NONE;
+    in->unsynced = 0;
+    in->options = 0;
+    memset(&in->compress_stat, 0, sizeof in->compress_stat);
+    memset(&in->dedup_stat, 0, sizeof in->dedup_stat);
+    memset(&in->csum_stat, 0, sizeof in->csum_stat);
+    disk_select(prev);
+    pthread_mutex_lock(&instance_lock);
+    in->reserved = 0;
+    pthread_mutex_unlock(&instance_lock);
+    return r;
+}
+
+int fs_use(int id)
+{
+    if (id < 0 || id >= FS_MAX_INSTANCE || !instances[id].reserved)
+        return -1;
+    return disk_select(id);
+}
+
+int fs_current()
+{
+    return disk_selected();
+}
+
+int fs_instance_path(int id, char* path, int size)
+{
+    int prev, r;
+    if (id < 0 || id >= FS_MAX_INSTANCE || !instances[id].reserved)
+        return -1;
+    prev = disk_select(id);
+    r = disk_get_path(path, size);
+    disk_select(prev);
+    return r;
 }
 
 void bmap_set(unsigned int bit, struct superblock* ptr_spblock)
@@ -94,7 +693,7 @@ int imap_test(unsigned int bit, struct superblock* ptr_spblock)
 
 int bmap_lookup(struct superblock* ptr_spblock)
 {
-    for (int i=0; i<FS_BLOCK_COUNT; ++i)
+    for (int i=0; i<DATA_BLOCK_COUNT; ++i)
         if (bmap_test(i, ptr_spblock) == 0)
             return i;
     return -1;
@@ -108,41 +707,117 @@ int imap_lookup(struct superblock* ptr_spblock)
     return -1;
 }
 
+int bmap_lookup_run(struct superblock* ptr_spblock, int count, int goal)
+{
+    int run = 0;
+    if (goal < 0 || goal >= DATA_BLOCK_COUNT)
+        goal = 0;
+    // scan from goal to the end, then wrap around to the beginning
+    for (int n=0; n<DATA_BLOCK_COUNT + count; ++n)
+    {
+        int i = (goal + n) % DATA_BLOCK_COUNT;
+        if (i == 0)
+            run = 0; // a run cannot wrap around
+        if (bmap_test(i, ptr_spblock) == 0)
+        {
+            if (++run == count)
+                return i - count + 1;
+        }
+        else
+            run = 0;
+    }
+    return -1;
+}
+
+int bmap_lookup_near(struct superblock* ptr_spblock, int goal)
+{
+    if (goal < 0 || goal >= DATA_BLOCK_COUNT)
+        return bmap_lookup(ptr_spblock);
+    // search both directions, forward first
+    for (int d=0; d<DATA_BLOCK_COUNT; ++d)
+    {
+        if (goal + d < DATA_BLOCK_COUNT && bmap_test(goal + d, ptr_spblock) == 0)
+            return goal + d;
+        if (goal - d >= 0 && bmap_test(goal - d, ptr_spblock) == 0)
+            return goal - d;
+    }
+    return -1;
+}
+
+int imap_lookup_near(struct superblock* ptr_spblock, int goal)
+{
+    if (goal < 0 || goal >= INODE_NUM)
+        return imap_lookup(ptr_spblock);
+    // same inode table block first
+    int first = goal / INODE_PER_BLOCK * INODE_PER_BLOCK;
+    for (int i=0; i<INODE_PER_BLOCK; ++i)
+    {
+        int bit = first + (goal - first + i) % INODE_PER_BLOCK;
+        if (imap_test(bit, ptr_spblock) == 0)
+            return bit;
+    }
+    for (int d=0; d<INODE_NUM; ++d)
+    {
+        if (goal + d < INODE_NUM && imap_test(goal + d, ptr_spblock) == 0)
+            return goal + d;
+        if (goal - d >= 0 && imap_test(goal - d, ptr_spblock) == 0)
+            return goal - d;
+    }
+    return -1;
+}
+
+int imap_lookup_dir(struct superblock* ptr_spblock)
+{
+    int best = -1, best_free = 0;
+    for (int g=0; g<INODE_GROUP_COUNT; ++g)
+    {
+        int nfree = 0;
+        for (int i=g*INODE_PER_BLOCK; i<(g+1)*INODE_PER_BLOCK; ++i)
+            nfree += !imap_test(i, ptr_spblock);
+        if (nfree > best_free)
+        {
+            best = g;
+            best_free = nfree;
+        }
+    }
+    if (best < 0)
+        return -1;
+    return imap_lookup_near(ptr_spblock, best * INODE_PER_BLOCK);
+}
+
 int exists()
 {
     struct superblock spblock;
-    fs_rd_block(0, fs_buf);
+    if (fs_rd_block(0, fs_buf) < 0)
+        return 0;
     memcpy(&spblock, fs_buf, sizeof (struct superblock));
     return spblock.magic == MAGIC;
 }
 
 int format()
 {
-    static struct superblock spblock = {
+    static _Thread_local struct superblock spblock = {
         .magic = MAGIC,
-        .free_block_count = FS_BLOCK_COUNT - DATA_BEGIN - 1,
+        .free_block_count = DATA_BLOCK_COUNT - 1,
         .free_inode_count = INODE_NUM - 1,
         .dir_inode_count = 1,
         .block_map = {0},
         .inode_map = {0}
     };
-    static struct inode inode_root_dir = {
-        .size = 2 * sizeof (struct dirent),
+    static _Thread_local struct inode inode_root_dir = {
+        .size = FS_BLOCK_SIZE,
         .type = TYPE_DIR,
         .link = 1,
         .ptr = {0}
     };
-    static struct dirblk blk_root_dir = {0};
+    static _Thread_local struct dirblk blk_root_dir;
+    if (csum_reset() == -1)
+        return -1;
+    memset(&blk_root_dir, 0, sizeof (struct dirblk));
     // "."
-    blk_root_dir.entries[0].index = 0;
-    blk_root_dir.entries[0].valid = 1;
-    blk_root_dir.entries[0].type = TYPE_DIR;
-    memcpy(blk_root_dir.entries[0].name, curdir, 2);
+    dirent_set(&blk_root_dir, free_dirent_lookup(&blk_root_dir, 1), 0, TYPE_DIR, curdir);
     // ".."
-    blk_root_dir.entries[1].index = 0;
-    blk_root_dir.entries[1].valid = 1;
-    blk_root_dir.entries[1].type = TYPE_DIR;
-    memcpy(blk_root_dir.entries[1].name, prtdir, 3);
+    dirent_set(&blk_root_dir, free_dirent_lookup(&blk_root_dir, 2), 0, TYPE_DIR, prtdir);
     // commit root directory
     memset(fs_buf, 0, FS_BLOCK_SIZE);
     memcpy(fs_buf, &blk_root_dir, sizeof (struct dirblk));
@@ -187,30 +862,107 @@ int wr_inode(int id, const struct inode* src)
     return 0;
 }
 
+static int cmp_int(const void* a, const void* b)
+{
+    return *(const int*) a - *(const int*) b;
+}
+
+int rd_inodes(const int* ids, int count, struct inode* dst)
+{
+    char buf[FS_BLOCK_SIZE];
+    int* order;
+    int i, id, pos, block = -1;
+    if (count <= 0)
+        return 0;
+    if (count > 0xffff || (order = malloc(count * sizeof (int))) == NULL)
+        return -1;
+    // sort by inode number, the position in ids rides along in the low bits
+    for (i=0; i<count; ++i)
+        order[i] = ids[i] << 16 | i;
+    qsort(order, count, sizeof (int), cmp_int);
+    for (i=0; i<count; ++i)
+    {
+        id = order[i] >> 16;
+        pos = order[i] & 0xffff;
+        if (id / (FS_BLOCK_SIZE / sizeof (struct inode)) + 1 != block)
+        {
+            block = id / (FS_BLOCK_SIZE / sizeof (struct inode)) + 1;
+            if (fs_rd_block(block, buf) == -1)
+            {
+                free(order);
+                return -1;
+            }
+        }
+        memcpy(&dst[pos], buf + id % (FS_BLOCK_SIZE / sizeof (struct inode)) * sizeof (struct inode), sizeof (struct inode));
+    }
+    free(order);
+    return 0;
+}
+
+int dirent_next(struct dirblk* e, int pos)
+{
+    if (pos < 0)
+        pos = 0;
+    else
+        pos += DIRENT_AT(e, pos)->rec_len;
+    if (pos + DIRENT_HDR_SIZE > FS_BLOCK_SIZE || DIRENT_AT(e, pos)->rec_len == 0)
+        return -1;
+    return pos;
+}
+
 int dirent_lookup(struct dirblk* e, const char* filename)
 {
-    int i;
-    for (i=0; i<FS_BLOCK_SIZE / sizeof (struct dirent); ++i)
-        if (e->entries[i].valid && strcmp(e->entries[i].name, filename) == 0)
-            return i;
+    int pos;
+    for (pos=dirent_next(e, -1); pos>=0; pos=dirent_next(e, pos))
+        if (DIRENT_AT(e, pos)->valid && strcmp(DIRENT_AT(e, pos)->name, filename) == 0)
+            return pos;
     return -1;
 }
 
-int free_dirent_lookup(struct dirblk* e)
+int free_dirent_lookup(struct dirblk* e, int name_len)
 {
-    int i;
-    for (i=0; i<FS_BLOCK_SIZE / sizeof (struct dirent); ++i)
-        if (!e->entries[i].valid)
-            return i;
-    return -1;
+    int pos, end = 0;
+    if (name_len > MAX_NAME_LEN)
+        return -1;
+    for (pos=dirent_next(e, -1); pos>=0; pos=dirent_next(e, pos))
+        end = pos + DIRENT_AT(e, pos)->rec_len;
+    if (end + DIRENT_REC_LEN(name_len) > FS_BLOCK_SIZE)
+        return -1;
+    return end;
 }
 
-int touch(int index_dir, const char* filename)
+void dirent_set(struct dirblk* e, int pos, int index, int type, const char* filename)
+{
+    struct dirent* d = DIRENT_AT(e, pos);
+    int name_len = strlen(filename);
+    d->index = index;
+    d->valid = 1;
+    d->type = type;
+    d->rec_len = DIRENT_REC_LEN(name_len);
+    d->name_len = name_len;
+    memcpy(d->name, filename, name_len + 1);
+}
+
+void dirent_remove(struct dirblk* e, int pos)
+{
+    int len = DIRENT_AT(e, pos)->rec_len;
+    int end = pos + len;
+    int p;
+    for (p=dirent_next(e, pos); p>=0; p=dirent_next(e, p))
+        end = p + DIRENT_AT(e, p)->rec_len;
+    // compact: move the following entries forward and clear the freed tail
+    memmove(e->data + pos, e->data + pos + len, end - pos - len);
+    memset(e->data + end - len, 0, len);
+}
+
+static int do_touch(int index_dir, const char* filename)
 {
     if (strcmp(filename, curdir) == 0 || strcmp(filename, prtdir) == 0) // filename cannot be "." or ".."
         return -1;
+    if (strlen(filename) > MAX_NAME_LEN)
+        return -1;
     struct inode inode_buf, file_inode;
-    static struct dirblk dir_buf;
+    static _Thread_local struct dirblk dir_buf;
     int32_t size;
     int index;
     struct superblock spblock;
@@ -237,28 +989,25 @@ int touch(int index_dir, const char* filename)
         if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[i], fs_buf) == -1)
             return -1;
         memcpy(&dir_buf, fs_buf, FS_BLOCK_SIZE);
-        if ((index = free_dirent_lookup(&dir_buf)) >= 0)
+        if ((index = free_dirent_lookup(&dir_buf, strlen(filename))) >= 0)
         {
             // read-modify-write superblock
             if (fs_rd_block(0, fs_buf) == -1)
                 return -1;
             memcpy(&spblock, fs_buf,  sizeof (struct superblock));
-            if ((bmap_index = bmap_lookup(&spblock)) == -1)
+            // place the file next to its directory
+            if ((bmap_index = bmap_lookup_near(&spblock, inode_buf.ptr[i])) == -1)
                 return -1;
-            if ((imap_index = imap_lookup(&spblock)) == -1)
+            if ((imap_index = imap_lookup_near(&spblock, index_dir)) == -1)
                 return -1;
             bmap_set(bmap_index, &spblock);
             imap_set(imap_index, &spblock);
             spblock.free_block_count -= 1;
             spblock.free_inode_count -= 1;
             // update directory entry
-            dir_buf.entries[index].index = imap_index;
-            dir_buf.entries[index].type = TYPE_FILE;
-            dir_buf.entries[index].valid = 1;
-            strcpy(dir_buf.entries[index].name, filename);
-            // update directory inode
-            inode_buf.size += sizeof (struct dirent);
+            dirent_set(&dir_buf, index, imap_index, TYPE_FILE, filename);
             // create file inode
+            memset(&file_inode, 0, sizeof (struct inode));
             file_inode.size = 0;
             file_inode.type = TYPE_FILE;
             file_inode.link = 1;
@@ -294,12 +1043,13 @@ int touch(int index_dir, const char* filename)
         if (fs_rd_block(0, fs_buf) == -1)
             return -1;
         memcpy(&spblock, fs_buf,  sizeof (struct superblock));
-        if ((dir_bmap_index = bmap_lookup(&spblock)) == -1)
+        // place the new directory block and the file next to the directory
+        if ((dir_bmap_index = bmap_lookup_near(&spblock, inode_buf.ptr[i - 1])) == -1)
             return -1;
         bmap_set(dir_bmap_index, &spblock);
-        if ((bmap_index = bmap_lookup(&spblock)) == -1)
+        if ((bmap_index = bmap_lookup_near(&spblock, dir_bmap_index)) == -1)
             return -1;
-        if ((imap_index = imap_lookup(&spblock)) == -1)
+        if ((imap_index = imap_lookup_near(&spblock, index_dir)) == -1)
             return -1;
         bmap_set(bmap_index, &spblock);
         imap_set(imap_index, &spblock);
@@ -307,14 +1057,12 @@ int touch(int index_dir, const char* filename)
         spblock.free_inode_count -= 1;
         // initialize new directory block
         memset(&dir_buf, 0, sizeof (struct dirblk));
-        dir_buf.entries[0].index = imap_index;
-        dir_buf.entries[0].type = TYPE_FILE;
-        dir_buf.entries[0].valid = 1;
-        strcpy(dir_buf.entries[0].name, filename);
+        dirent_set(&dir_buf, 0, imap_index, TYPE_FILE, filename);
         // update directory inode
-        inode_buf.size += sizeof (struct dirent);
+        inode_buf.size += FS_BLOCK_SIZE;
         inode_buf.ptr[i] = dir_bmap_index;
         // create file inode
+        memset(&file_inode, 0, sizeof (struct inode));
         file_inode.size = 0;
         file_inode.type = TYPE_FILE;
         file_inode.link = 1;
@@ -343,16 +1091,200 @@ int touch(int index_dir, const char* filename)
     return -1;
 }
 
+int touch(int index_dir, const char* filename)
+{
+    TRACE_BEGIN(start);
+    int r = do_touch(index_dir, filename);
+    TRACE_END(TRACE_TOUCH, start, r);
+    return r;
+}
+
+// add a name to an open addressing hash set, -1 if it is there already
+static int name_insert(const char** set, int mask, const char* name)
+{
+    uint32_t h = 2166136261u;
+    for (const char* p=name; *p; ++p)
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    for (int i=h&mask; ; i=(i+1)&mask)
+    {
+        if (set[i] == NULL)
+        {
+            set[i] = name;
+            return 0;
+        }
+        if (strcmp(set[i], name) == 0)
+            return -1;
+    }
+}
+
+// where each new entry goes and the data block of each new file
+static _Thread_local int bulk_blk[INODE_NUM];
+static _Thread_local int bulk_pos[INODE_NUM];
+static _Thread_local int bulk_blocks[INODE_NUM];
+
+static int bulk_create(const char** set, int mask, int index_dir, const char* const* names, int count, int* indexes)
+{
+    static _Thread_local struct dirblk dir_bufs[N_DIRECT_PTR];
+    struct inode inode_dir, file_inode;
+    struct superblock spblock;
+    int end[N_DIRECT_PTR], changed[N_DIRECT_PTR] = {0};
+    int nblk, old_nblk, b, k, pos, len, first, run, inode_block, bmap_index;
+    if (rd_inode(index_dir, &inode_dir) < 0 || inode_dir.type != TYPE_DIR)
+        return -1;
+    nblk = old_nblk = inode_dir.size / FS_BLOCK_SIZE;
+    // one scan of the directory collects the names it holds and where each block ends
+    for (b=0; b<nblk; ++b)
+    {
+        if (fs_rd_block(DATA_BEGIN + inode_dir.ptr[b], (char*) &dir_bufs[b]) < 0)
+            return -1;
+        end[b] = 0;
+        for (pos=dirent_next(&dir_bufs[b], -1); pos>=0; pos=dirent_next(&dir_bufs[b], pos))
+        {
+            if (DIRENT_AT(&dir_bufs[b], pos)->valid)
+                name_insert(set, mask, DIRENT_AT(&dir_bufs[b], pos)->name);
+            end[b] = pos + DIRENT_AT(&dir_bufs[b], pos)->rec_len;
+        }
+    }
+    // every name is new and given once, the entries are packed into the blocks from the first with room
+    for (k=0, b=0; k<count; ++k)
+    {
+        len = strlen(names[k]);
+        if (len == 0 || len > MAX_NAME_LEN || strcmp(names[k], curdir) == 0 || strcmp(names[k], prtdir) == 0)
+            return -1;
+        if (name_insert(set, mask, names[k]) < 0)
+            return -1;
+        while (b < nblk && end[b] + DIRENT_REC_LEN(len) > FS_BLOCK_SIZE)
+            ++b;
+        if (b == nblk)
+        {
+            if (nblk == N_DIRECT_PTR)
+                return -1;
+            memset(&dir_bufs[nblk], 0, sizeof (struct dirblk));
+            end[nblk++] = 0;
+        }
+        bulk_blk[k] = b;
+        bulk_pos[k] = end[b];
+        end[b] += DIRENT_REC_LEN(len);
+        changed[b] = 1;
+    }
+    // read-modify-write superblock, all inodes and blocks are allocated in one go
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    if (spblock.free_inode_count < count || spblock.free_block_count < count + nblk - old_nblk)
+        return -1;
+    for (b=old_nblk; b<nblk; ++b)
+    {
+        if ((bmap_index = bmap_lookup_near(&spblock, inode_dir.ptr[b - 1])) < 0)
+            return -1;
+        inode_dir.ptr[b] = bmap_index;
+        bmap_set(bmap_index, &spblock);
+    }
+    // the files get a contiguous run next to the directory if there is one
+    first = bmap_lookup_run(&spblock, count, inode_dir.ptr[nblk - 1] + 1);
+    for (k=0; k<count; ++k)
+    {
+        if (first >= 0)
+            bulk_blocks[k] = first + k;
+        else if ((bulk_blocks[k] = bmap_lookup_near(&spblock, k > 0 ? bulk_blocks[k - 1] : inode_dir.ptr[nblk - 1])) < 0)
+            return -1;
+        bmap_set(bulk_blocks[k], &spblock);
+        if ((indexes[k] = imap_lookup_near(&spblock, k > 0 ? indexes[k - 1] : index_dir)) < 0)
+            return -1;
+        imap_set(indexes[k], &spblock);
+        dirent_set(&dir_bufs[bulk_blk[k]], bulk_pos[k], indexes[k], TYPE_FILE, names[k]);
+    }
+    spblock.free_block_count -= count + nblk - old_nblk;
+    spblock.free_inode_count -= count;
+    // the data blocks read back as zeros once released to the host, one request per run
+    memcpy(bulk_pos, bulk_blocks, count * sizeof (int));
+    qsort(bulk_pos, count, sizeof (int), cmp_int);
+    for (k=0; k<count; k+=run)
+    {
+        for (run=1; k+run<count && bulk_pos[k+run] == bulk_pos[k] + run; ++run)
+            ;
+        if (fs_discard_block(DATA_BEGIN + bulk_pos[k], run) == 0)
+            continue;
+        memset(fs_buf, 0, FS_BLOCK_SIZE);
+        for (int i=0; i<run; ++i)
+            if (fs_wr_block(DATA_BEGIN + bulk_pos[k] + i, fs_buf) < 0)
+                return -1;
+    }
+    // commit superblock changes
+    memset(fs_buf, 0, FS_BLOCK_SIZE);
+    memcpy(fs_buf, &spblock, sizeof (struct superblock));
+    if (fs_wr_block(0, fs_buf) < 0)
+        return -1;
+    // commit file inodes, sorted by inode number with the position in the low bits, one write per table block
+    memset(&file_inode, 0, sizeof (struct inode));
+    file_inode.type = TYPE_FILE;
+    file_inode.link = 1;
+    for (k=0; k<count; ++k)
+        bulk_pos[k] = indexes[k] << 16 | k;
+    qsort(bulk_pos, count, sizeof (int), cmp_int);
+    for (k=0, inode_block=-1; k<count; ++k)
+    {
+        int id = bulk_pos[k] >> 16;
+        if (id / INODE_PER_BLOCK + 1 != inode_block)
+        {
+            if (inode_block >= 0 && fs_wr_block(inode_block, fs_buf) < 0)
+                return -1;
+            inode_block = id / INODE_PER_BLOCK + 1;
+            if (fs_rd_block(inode_block, fs_buf) < 0)
+                return -1;
+        }
+        file_inode.ptr[0] = bulk_blocks[bulk_pos[k] & 0xffff];
+        memcpy(fs_buf + id % INODE_PER_BLOCK * sizeof (struct inode), &file_inode, sizeof (struct inode));
+    }
+    if (fs_wr_block(inode_block, fs_buf) < 0)
+        return -1;
+    // commit directory entry changes
+    for (b=0; b<nblk; ++b)
+        if (changed[b] && fs_wr_block(DATA_BEGIN + inode_dir.ptr[b], (char*) &dir_bufs[b]) < 0)
+            return -1;
+    // commit directory inode changes
+    inode_dir.size = nblk * FS_BLOCK_SIZE;
+    if (nblk > old_nblk && wr_inode(index_dir, &inode_dir) < 0)
+        return -1;
+    return count;
+}
+
+static int do_touch_bulk(int index_dir, const char* const* names, int count, int* indexes)
+{
+    const char** set;
+    int size, r;
+    if (count <= 0 || count > INODE_NUM)
+        return count == 0 ? 0 : -1;
+    // a hash set of the names at most half full, those of a full directory and the new ones
+    for (size=1; size<2*(count+N_DIRECT_PTR*FS_BLOCK_SIZE/DIRENT_REC_LEN(1)); size<<=1)
+        ;
+    if ((set = calloc(size, sizeof (const char*))) == NULL)
+        return -1;
+    r = bulk_create(set, size - 1, index_dir, names, count, indexes);
+    free(set);
+    return r;
+}
+
+int touch_bulk(int index_dir, const char* const* names, int count, int* indexes)
+{
+    TRACE_BEGIN(start);
+    int r = do_touch_bulk(index_dir, names, count, indexes);
+    TRACE_END(TRACE_TOUCH, start, r);
+    return r;
+}
+
 // 创建目录
-int mkdir(int index_dir, const char* dirname)
+static int do_mkdir(int index_dir, const char* dirname)
 {
     struct inode inode_dir, inode_chddir;
-    static struct dirblk dir_buf, chddir_buf;
+    static _Thread_local struct dirblk dir_buf, chddir_buf;
     int32_t size;
     int index;
     struct superblock spblock;
     int bmap_index, imap_index;
     int prtdir_bmap_index;
+    if (strlen(dirname) > MAX_NAME_LEN)
+        return -1;
     if (rd_inode(index_dir, &inode_dir) == -1)
         return -1;
     size = inode_dir.size;
@@ -374,15 +1306,16 @@ int mkdir(int index_dir, const char* dirname)
         if (fs_rd_block(DATA_BEGIN + inode_dir.ptr[i], fs_buf) == -1)
             return -1;
         memcpy(&dir_buf, fs_buf, FS_BLOCK_SIZE);
-        if ((index = free_dirent_lookup(&dir_buf)) >= 0)
+        if ((index = free_dirent_lookup(&dir_buf, strlen(dirname))) >= 0)
         {
             // read-modify-write superblock
             if (fs_rd_block(0, fs_buf) == -1)
                 return -1;
             memcpy(&spblock, fs_buf,  sizeof (struct superblock));
-            if ((bmap_index = bmap_lookup(&spblock)) == -1)
+            // spread directories over the inode groups, data goes to the group's area
+            if ((imap_index = imap_lookup_dir(&spblock)) == -1)
                 return -1;
-            if ((imap_index = imap_lookup(&spblock)) == -1)
+            if ((bmap_index = bmap_lookup_near(&spblock, GROUP_DATA_BEGIN(imap_index))) == -1)
                 return -1;
             bmap_set(bmap_index, &spblock);
             imap_set(imap_index, &spblock);
@@ -390,29 +1323,19 @@ int mkdir(int index_dir, const char* dirname)
             spblock.free_inode_count -= 1;
             spblock.dir_inode_count += 1;
             // update directory entry
-            dir_buf.entries[index].index = imap_index;
-            dir_buf.entries[index].type = TYPE_DIR;
-            dir_buf.entries[index].valid = 1;
-            strcpy(dir_buf.entries[index].name, dirname);
-            // update directory inode
-            inode_dir.size += sizeof (struct dirent);
+            dirent_set(&dir_buf, index, imap_index, TYPE_DIR, dirname);
             // create child directory inode
-            inode_chddir.size = 2 * sizeof (struct dirent);
+            memset(&inode_chddir, 0, sizeof (struct inode));
+            inode_chddir.size = FS_BLOCK_SIZE;
             inode_chddir.type = TYPE_DIR;
             inode_chddir.link = 1;
             inode_chddir.ptr[0] = bmap_index;
             // initialize child directory block
             memset(&chddir_buf, 0, sizeof (struct dirblk));
             // "."
-            chddir_buf.entries[0].index = imap_index;
-            chddir_buf.entries[0].valid = 1;
-            chddir_buf.entries[0].type = TYPE_DIR;
-            memcpy(chddir_buf.entries[0].name, curdir, 2);
+            dirent_set(&chddir_buf, free_dirent_lookup(&chddir_buf, 1), imap_index, TYPE_DIR, curdir);
             // ".."
-            chddir_buf.entries[1].index = index_dir;
-            chddir_buf.entries[1].valid = 1;
-            chddir_buf.entries[1].type = TYPE_DIR;
-            memcpy(chddir_buf.entries[1].name, prtdir, 3);
+            dirent_set(&chddir_buf, free_dirent_lookup(&chddir_buf, 2), index_dir, TYPE_DIR, prtdir);
             memcpy(fs_buf, &chddir_buf, FS_BLOCK_SIZE);
             if (fs_wr_block(DATA_BEGIN + bmap_index, fs_buf) == -1)
                 return -1;
@@ -442,12 +1365,13 @@ int mkdir(int index_dir, const char* dirname)
         if (fs_rd_block(0, fs_buf) == -1)
             return -1;
         memcpy(&spblock, fs_buf,  sizeof (struct superblock));
-        if ((prtdir_bmap_index = bmap_lookup(&spblock)) == -1)
+        if ((prtdir_bmap_index = bmap_lookup_near(&spblock, inode_dir.ptr[i - 1])) == -1)
             return -1;
         bmap_set(prtdir_bmap_index, &spblock);
-        if ((bmap_index = bmap_lookup(&spblock)) == -1)
+        // spread directories over the inode groups, data goes to the group's area
+        if ((imap_index = imap_lookup_dir(&spblock)) == -1)
             return -1;
-        if ((imap_index = imap_lookup(&spblock)) == -1)
+        if ((bmap_index = bmap_lookup_near(&spblock, GROUP_DATA_BEGIN(imap_index))) == -1)
             return -1;
         bmap_set(bmap_index, &spblock);
         imap_set(imap_index, &spblock);
@@ -456,15 +1380,13 @@ int mkdir(int index_dir, const char* dirname)
         spblock.dir_inode_count += 1;
         // initialize new directory block
         memset(&dir_buf, 0, sizeof (struct dirblk));
-        dir_buf.entries[0].index = imap_index;
-        dir_buf.entries[0].type = TYPE_DIR;
-        dir_buf.entries[0].valid = 1;
-        strcpy(dir_buf.entries[0].name, dirname);
+        dirent_set(&dir_buf, 0, imap_index, TYPE_DIR, dirname);
         // update directory inode
-        inode_dir.size += sizeof (struct dirent);
+        inode_dir.size += FS_BLOCK_SIZE;
         inode_dir.ptr[i] = prtdir_bmap_index;
         // create child directory inode
-        inode_chddir.size = 2 * sizeof (struct dirent);
+        memset(&inode_chddir, 0, sizeof (struct inode));
+        inode_chddir.size = FS_BLOCK_SIZE;
         inode_chddir.type = TYPE_DIR;
         inode_chddir.link = 1;
         inode_chddir.ptr[0] = bmap_index;
@@ -472,15 +1394,9 @@ int mkdir(int index_dir, const char* dirname)
         // initialize child directory block
         memset(&chddir_buf, 0, sizeof (struct dirblk));
         // "."
-        chddir_buf.entries[0].index = imap_index;
-        chddir_buf.entries[0].valid = 1;
-        chddir_buf.entries[0].type = TYPE_DIR;
-        memcpy(chddir_buf.entries[0].name, curdir, 2);
+        dirent_set(&chddir_buf, free_dirent_lookup(&chddir_buf, 1), imap_index, TYPE_DIR, curdir);
         // ".."
-        chddir_buf.entries[1].index = index_dir;
-        chddir_buf.entries[1].valid = 1;
-        chddir_buf.entries[1].type = TYPE_DIR;
-        memcpy(chddir_buf.entries[1].name, prtdir, 3);
+        dirent_set(&chddir_buf, free_dirent_lookup(&chddir_buf, 2), index_dir, TYPE_DIR, prtdir);
         memcpy(fs_buf, &chddir_buf, FS_BLOCK_SIZE);
         if (fs_wr_block(DATA_BEGIN + bmap_index, fs_buf) == -1)
             return -1;
@@ -503,203 +1419,1378 @@ int mkdir(int index_dir, const char* dirname)
     return -1;
 }
 
-int readbyte(int index, int position)
+int mkdir(int index_dir, const char* dirname)
 {
-    struct inode inode_buf;
-    int blockno, offset;
-    if (rd_inode(index, &inode_buf) < 0)
-        return -1;
-    if (position >= inode_buf.size || inode_buf.type == TYPE_DIR)
-        return -1;
-    blockno = position / FS_BLOCK_SIZE;
-    offset = position % FS_BLOCK_SIZE;
-    if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[blockno], fs_buf) < 0)
-        return -1;
-    return fs_buf[offset];
+    TRACE_BEGIN(start);
+    int r = do_mkdir(index_dir, dirname);
+    TRACE_END(TRACE_MKDIR, start, r);
+    return r;
 }
 
-int appendbyte(int index, char byte)
+// whether dir is top or lies in the tree under it, found by following ".." up to the root
+static int in_tree(int top, int dir)
 {
+    static _Thread_local struct dirblk dir_buf;
     struct inode inode_buf;
-    int endblockno, endoffset; // position of the end of the file
-    if (rd_inode(index, &inode_buf) < 0)
+    int pos;
+    // a damaged tree with a loop counts as inside, nothing gets moved into it
+    for (int depth=0; depth<INODE_NUM; ++depth)
+    {
+        if (dir == top)
+            return 1;
+        if (dir == 0)
+            return 0;
+        if (rd_inode(dir, &inode_buf) < 0 || fs_rd_block(DATA_BEGIN + inode_buf.ptr[0], (char*) &dir_buf) < 0)
+            return -1;
+        if ((pos = dirent_lookup(&dir_buf, prtdir)) < 0)
+            return -1;
+        dir = DIRENT_AT(&dir_buf, pos)->index;
+    }
+    return 1;
+}
+
+static int do_rename(int src_dir, const char* src_name, int dst_dir, const char* dst_name)
+{
+    static _Thread_local struct dirblk src_buf, dst_buf;
+    struct inode src_inode, dst_inode, child_inode;
+    struct superblock spblock;
+    int i, j, pos, dst_pos = -1, index, type, grown = 0, bmap_index;
+    int len = strlen(dst_name);
+    if (strcmp(src_name, curdir) == 0 || strcmp(src_name, prtdir) == 0)
+        return -1;
+    if (len == 0 || len > MAX_NAME_LEN || strcmp(dst_name, curdir) == 0 || strcmp(dst_name, prtdir) == 0)
         return -1;
-    if (inode_buf.size == FS_BLOCK_SIZE * N_DIRECT_PTR || inode_buf.type == TYPE_DIR)
+    if (rd_inode(src_dir, &src_inode) < 0 || rd_inode(dst_dir, &dst_inode) < 0)
         return -1;
-    endblockno = (inode_buf.size - 1) / FS_BLOCK_SIZE;
-    endoffset = (inode_buf.size - 1) % FS_BLOCK_SIZE;
-    if (endoffset == FS_BLOCK_SIZE - 1)
+    if (src_inode.type != TYPE_DIR || dst_inode.type != TYPE_DIR)
+        return -1;
+    // the new name must not be taken
+    for (j=0; j<dst_inode.size/FS_BLOCK_SIZE; ++j)
     {
-        // superblock modification
-        struct superblock spblock;
-        int bmap_index;
-        if (fs_rd_block(0, fs_buf) < 0)
+        if (fs_rd_block(DATA_BEGIN + dst_inode.ptr[j], (char*) &dst_buf) < 0)
             return -1;
-        memcpy(&spblock, fs_buf,  sizeof (struct superblock));
-        if ((bmap_index = bmap_lookup(&spblock)) < 0)
+        if (dirent_lookup(&dst_buf, dst_name) >= 0)
             return -1;
-        spblock.free_block_count--;
-        bmap_set(bmap_index, &spblock);
-        // inode modification
-        inode_buf.size++;
-        inode_buf.ptr[endblockno + 1] = bmap_index;
-        // append byte
-        memset(fs_buf, 0, FS_BLOCK_SIZE);
-        fs_buf[0] = byte;
-        if (fs_wr_block(DATA_BEGIN + bmap_index, fs_buf) < 0)
+    }
+    for (i=0; i<src_inode.size/FS_BLOCK_SIZE; ++i)
+    {
+        if (fs_rd_block(DATA_BEGIN + src_inode.ptr[i], (char*) &src_buf) < 0)
+            return -1;
+        if ((pos = dirent_lookup(&src_buf, src_name)) >= 0)
+            break;
+    }
+    if (i == src_inode.size/FS_BLOCK_SIZE)
+        return -1;
+    index = DIRENT_AT(&src_buf, pos)->index;
+    type = DIRENT_AT(&src_buf, pos)->type;
+    // a directory cannot go into its own tree
+    if (type == TYPE_DIR && src_dir != dst_dir && in_tree(index, dst_dir) != 0)
+        return -1;
+    dirent_remove(&src_buf, pos);
+    // within one directory block the entry is taken out and put back under the new name
+    if (src_dir == dst_dir && (dst_pos = free_dirent_lookup(&src_buf, len)) >= 0)
+    {
+        dirent_set(&src_buf, dst_pos, index, type, dst_name);
+        return fs_wr_block(DATA_BEGIN + src_inode.ptr[i], (char*) &src_buf);
+    }
+    for (j=0; j<dst_inode.size/FS_BLOCK_SIZE; ++j)
+    {
+        if (src_dir == dst_dir && j == i)
+            continue;
+        if (fs_rd_block(DATA_BEGIN + dst_inode.ptr[j], (char*) &dst_buf) < 0)
+            return -1;
+        if ((dst_pos = free_dirent_lookup(&dst_buf, len)) >= 0)
+            break;
+    }
+    if (dst_pos < 0)
+    {
+        // the destination directory grows by a block
+        if (j == N_DIRECT_PTR || fs_rd_block(0, fs_buf) < 0)
+            return -1;
+        memcpy(&spblock, fs_buf, sizeof (struct superblock));
+        if (spblock.free_block_count < 1 || (bmap_index = bmap_lookup_near(&spblock, dst_inode.ptr[j - 1])) < 0)
             return -1;
+        dst_inode.ptr[j] = bmap_index;
+        bmap_set(bmap_index, &spblock);
+        spblock.free_block_count--;
+        dst_inode.size += FS_BLOCK_SIZE;
+        memset(&dst_buf, 0, sizeof (struct dirblk));
+        dst_pos = 0;
+        grown = 1;
         // commit superblock changes
         memset(fs_buf, 0, FS_BLOCK_SIZE);
         memcpy(fs_buf, &spblock, sizeof (struct superblock));
         if (fs_wr_block(0, fs_buf) < 0)
             return -1;
-        // commit inode changes
-        if (wr_inode(index, &inode_buf) < 0)
-            return -1;
     }
-    else
+    // the new entry is written before the old one goes, a crash leaves two names rather than none
+    dirent_set(&dst_buf, dst_pos, index, type, dst_name);
+    if (fs_wr_block(DATA_BEGIN + dst_inode.ptr[j], (char*) &dst_buf) < 0)
+        return -1;
+    if (grown && wr_inode(dst_dir, &dst_inode) < 0)
+        return -1;
+    // a moved directory points its ".." at the new parent
+    if (type == TYPE_DIR && src_dir != dst_dir)
     {
-        // inode modification
-        inode_buf.size++;
-        // read-modify-write
-        if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[endblockno], fs_buf) < 0)
+        if (rd_inode(index, &child_inode) < 0 || fs_rd_block(DATA_BEGIN + child_inode.ptr[0], (char*) &dst_buf) < 0)
             return -1;
-        fs_buf[endoffset + 1] = byte;
-        if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[endblockno], fs_buf) < 0)
+        if ((pos = dirent_lookup(&dst_buf, prtdir)) < 0)
             return -1;
-        // commit inode change
-        if (wr_inode(index, &inode_buf) < 0)
+        DIRENT_AT(&dst_buf, pos)->index = dst_dir;
+        if (fs_wr_block(DATA_BEGIN + child_inode.ptr[0], (char*) &dst_buf) < 0)
             return -1;
     }
-    return 0;
+    return fs_wr_block(DATA_BEGIN + src_inode.ptr[i], (char*) &src_buf);
 }
 
-int writebyte(int index, int position, char byte)
+int fs_rename(int src_dir, const char* src_name, int dst_dir, const char* dst_name)
 {
-    struct inode inode_buf;
-    int blockno, offset;
-    int endblockno, endoffset; // position of the end of the file
-    if (rd_inode(index, &inode_buf) < 0)
-        return -1;
-    if (position >= FS_BLOCK_SIZE * N_DIRECT_PTR || inode_buf.type == TYPE_DIR)
+    TRACE_BEGIN(start);
+    int r = do_rename(src_dir, src_name, dst_dir, dst_name);
+    TRACE_END(TRACE_RENAME, start, r);
+    return r;
+}
+
+// number of data blocks owned by a file, a file always owns at least one
+static int file_blockcnt(int size)
+{
+    return size == 0 ? 1 : (size - 1) / FS_BLOCK_SIZE + 1;
+}
+
+// allocate count data blocks for ptr[from...] of a file, a contiguous run is preferred
+static int alloc_blocks(struct superblock* ptr_spblock, struct inode* ptr_inode, int from, int count)
+{
+    int i, first, bmap_index;
+    if (ptr_spblock->free_block_count < count)
         return -1;
-    blockno = position / FS_BLOCK_SIZE;
-    offset = position % FS_BLOCK_SIZE;
-    if (position < inode_buf.size)
+    first = bmap_lookup_run(ptr_spblock, count, ptr_inode->ptr[from - 1] + 1);
+    for (i=0; i<count; ++i)
     {
-        // read-modify-write
-        if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[blockno], fs_buf) < 0)
-            return -1;
-        fs_buf[offset] = byte;
-        if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[blockno], fs_buf) < 0)
+        if (first >= 0)
+            bmap_index = first + i;
+        else if ((bmap_index = bmap_lookup_near(ptr_spblock, ptr_inode->ptr[from + i - 1])) < 0)
             return -1;
+        bmap_set(bmap_index, ptr_spblock);
+        ptr_inode->ptr[from + i] = bmap_index;
     }
-    else
+    ptr_spblock->free_block_count -= count;
+    return 0;
+}
+
+// release freed data blocks to the host in sorted runs, failure only costs host space
+static void discard_blocks(int* blocks, int count)
+{
+    int i, run;
+    qsort(blocks, count, sizeof (int), cmp_int);
+    for (i=0; i<count; i+=run)
     {
-        int i = inode_buf.size;
-        // not efficient yet simple to implement
-        // can be further optimized
-        while (i++ < position)
-            appendbyte(index, '\0');
-        appendbyte(index, byte);
+        for (run=1; i+run<count && blocks[i+run] == blocks[i] + run; ++run)
+            ;
+        fs_discard_block(DATA_BEGIN + blocks[i], run);
     }
 }
 
-int clone(int src_inodeno, int dst_inodeno)
+// content hash index of data blocks written in dedup mode, a direct-mapped cache, one per instance
+#define DEDUP_SLOTS (2048)
+static struct dedup_index {
+    struct {
+        uint64_t hash;
+        int block;
+    } tab[DEDUP_SLOTS];
+    uint64_t block_hash[FS_BLOCK_COUNT];
+    uint8_t block_hashed[FS_BLOCK_COUNT];
+} dedup_index[FS_MAX_INSTANCE];
+
+static void dedup_forget()
 {
-    struct inode src_inode, dst_inode;
-    struct superblock spblock;
-    int bmap_index;
-    if (rd_inode(src_inodeno, &src_inode) < 0)
+    memset(&dedup_index[disk_selected()], 0, sizeof (struct dedup_index));
+}
+
+static uint64_t block_hash(const char* buf)
+{
+    uint64_t h = 0xcbf29ce484222325ull, w;
+    for (int i=0; i<FS_BLOCK_SIZE; i+=sizeof w)
+    {
+        memcpy(&w, buf + i, sizeof w);
+        h = (h ^ w) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// find a block with the same content, the hash is only a hint, the content is compared
+static int dedup_lookup(struct superblock* ptr_spblock, uint64_t hash, const char* buf)
+{
+    static _Thread_local char blk[FS_BLOCK_SIZE];
+    struct dedup_index* x = &dedup_index[disk_selected()];
+    int b = x->tab[hash % DEDUP_SLOTS].block;
+    if (x->tab[hash % DEDUP_SLOTS].hash != hash || !x->block_hashed[b] || x->block_hash[b] != hash)
         return -1;
-    if (rd_inode(dst_inodeno, &dst_inode) < 0)
+    if (!bmap_test(b, ptr_spblock) || ptr_spblock->block_ref[b] == UINT8_MAX)
         return -1;
-    int src_blockcnt = (src_inode.size-1) / FS_BLOCK_SIZE + 1;
-    int dst_blockcnt = (dst_inode.size-1) / FS_BLOCK_SIZE + 1;
-    int i;
-    if (fs_rd_block(0, fs_buf) < 0)
+    if (fs_rd_block(DATA_BEGIN + b, blk) < 0 || memcmp(blk, buf, FS_BLOCK_SIZE) != 0)
         return -1;
-    memcpy(&spblock, fs_buf,  sizeof (struct superblock));
-    for (i=0; i<src_blockcnt; ++i)
+    return b;
+}
+
+static void dedup_insert(uint64_t hash, int b)
+{
+    struct dedup_index* x = &dedup_index[disk_selected()];
+    x->tab[hash % DEDUP_SLOTS].hash = hash;
+    x->tab[hash % DEDUP_SLOTS].block = b;
+    x->block_hash[b] = hash;
+    x->block_hashed[b] = 1;
+}
+
+// write a full block of file data to a new block near goal, in dedup mode an identical block is shared instead
+static int wr_new_block(struct superblock* ptr_spblock, int goal, const char* buf)
+{
+    uint64_t hash;
+    int b;
+    if (option(FS_DEDUP))
     {
-        if (i < dst_blockcnt)
-        {
-            if (fs_rd_block(DATA_BEGIN + src_inode.ptr[i], fs_buf) < 0)
-                return -1;
-            if (fs_wr_block(DATA_BEGIN + dst_inode.ptr[i], fs_buf) < 0)
-                return -1;
-        }
-        else // need to allocate new data blocks
+        hash = block_hash(buf);
+        cur()->dedup_stat.writes++;
+        if ((b = dedup_lookup(ptr_spblock, hash, buf)) >= 0)
         {
-            // superblock modification
-            if ((bmap_index = bmap_lookup(&spblock)) < 0)
-                return -1;
-            spblock.free_block_count--;
-            bmap_set(bmap_index, &spblock);
-            // copy data block
-            dst_inode.ptr[i] = bmap_index;
-            if (fs_rd_block(DATA_BEGIN + src_inode.ptr[i], fs_buf) < 0)
-                return -1;
-            if (fs_wr_block(DATA_BEGIN + dst_inode.ptr[i], fs_buf) < 0)
-                return -1;
+            ptr_spblock->block_ref[b]++;
+            cur()->dedup_stat.hits++;
+            return b;
         }
     }
-    // commit superblock changes
+    if (ptr_spblock->free_block_count < 1 || (b = bmap_lookup_near(ptr_spblock, goal)) < 0)
+        return -1;
+    bmap_set(b, ptr_spblock);
+    ptr_spblock->free_block_count--;
+    if (fs_wr_block(DATA_BEGIN + b, buf) < 0)
+        return -1;
+    if (option(FS_DEDUP))
+        dedup_insert(hash, b);
+    return b;
+}
+
+// drop one reference to a data block, returns 1 if the block became free
+static int block_release(struct superblock* ptr_spblock, int b)
+{
+    if (ptr_spblock->block_ref[b] > 0)
+    {
+        ptr_spblock->block_ref[b]--;
+        return 0;
+    }
+    bmap_reset(b, ptr_spblock);
+    ptr_spblock->free_block_count++;
+    dedup_index[disk_selected()].block_hashed[b] = 0;
+    return 1;
+}
+
+int unshare_block(int index, struct inode* ptr_inode, int blockno)
+{
+    struct superblock spblock;
+    int b = ptr_inode->ptr[blockno], copy;
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    if (spblock.block_ref[b] == 0)
+        return 0;
+    if (spblock.free_block_count < 1 || (copy = bmap_lookup_near(&spblock, b)) < 0)
+        return -1;
+    bmap_set(copy, &spblock);
+    spblock.free_block_count--;
+    spblock.block_ref[b]--;
+    if (fs_rd_block(DATA_BEGIN + b, fs_buf) < 0 || fs_wr_block(DATA_BEGIN + copy, fs_buf) < 0)
+        return -1;
+    // commit superblock and inode changes
     memset(fs_buf, 0, FS_BLOCK_SIZE);
     memcpy(fs_buf, &spblock, sizeof (struct superblock));
     if (fs_wr_block(0, fs_buf) < 0)
         return -1;
-    dst_inode.size = src_inode.size;
-    // commit inode changes
-    if (wr_inode(dst_inodeno, &dst_inode) < 0)
-        return -1;
-    return 0;
+    ptr_inode->ptr[blockno] = copy;
+    return wr_inode(index, ptr_inode);
 }
 
-int openpath(const char* path)
+int inode_blocks(const struct inode* ptr_inode, int* blocks)
 {
-    static char filename[256];
-    struct inode current_inode, next_inode;
-    struct dirblk dirents;
-    int i, j, size, index;
-    if (path[0] != '/')
+    int i, j, b, n = 0;
+    int blockcnt = ptr_inode->type == TYPE_DIR ? ptr_inode->size / FS_BLOCK_SIZE : file_blockcnt(ptr_inode->size);
+    for (i=0; i<blockcnt; ++i)
+    {
+        b = ptr_inode->compressed ? CPTR_BLOCK(ptr_inode->ptr[i]) : ptr_inode->ptr[i];
+        for (j=0; j<n && blocks[j] != b; ++j)
+            ;
+        if (j == n)
+            blocks[n++] = b;
+    }
+    return n;
+}
+
+// the data block of every slot of a file, in dedup mode several slots may hold the same block
+// and each slot holds a reference of its own; the packed blocks of a compressed file are listed once
+static int slot_blocks(const struct inode* ptr_inode, int* blocks)
+{
+    int i, blockcnt = ptr_inode->type == TYPE_DIR ? ptr_inode->size / FS_BLOCK_SIZE : file_blockcnt(ptr_inode->size);
+    if (ptr_inode->compressed)
+        return inode_blocks(ptr_inode, blocks);
+    for (i=0; i<blockcnt; ++i)
+        blocks[i] = ptr_inode->ptr[i];
+    return blockcnt;
+}
+
+int rd_file_block(const struct inode* ptr_inode, int blockno, char* buf)
+{
+    static _Thread_local char packed[FS_BLOCK_SIZE];
+    uint32_t p = ptr_inode->ptr[blockno];
+    clock_t start;
+    int n;
+    if (!ptr_inode->compressed)
+        return fs_rd_block(DATA_BEGIN + p, buf);
+    if (fs_rd_block(DATA_BEGIN + CPTR_BLOCK(p), packed) < 0)
         return -1;
-    const char* p = path;
-    rd_inode(0, &current_inode);
-    if (fs_rd_block(DATA_BEGIN, (char*) &dirents) < 0)
+    if (CPTR_LEN(p) == FS_BLOCK_SIZE) // stored raw
+    {
+        memcpy(buf, packed, FS_BLOCK_SIZE);
+        return 0;
+    }
+    start = clock();
+    n = lz_decompress(packed + CPTR_OFFSET(p), CPTR_LEN(p), buf, FS_BLOCK_SIZE);
+    cur()->compress_stat.decompress_clock += clock() - start;
+    if (n < 0)
         return -1;
-    index = 0;
-    while (*p != '\0')
+    memset(buf + n, 0, FS_BLOCK_SIZE - n);
+    return 0;
+}
+
+// appended bytes of one file which have no data blocks yet
+struct dalloc {
+    int index;      // inode number, -1 if the slot is free
+    int size;       // file size on disk, data[0] is the byte at this position
+    int pending;    // number of bytes cached in data
+    char data[FS_BLOCK_SIZE * N_DIRECT_PTR];
+};
+
+static struct dalloc dalloc_tab[FS_MAX_INSTANCE][N_DALLOC] = {
+    [0 ... FS_MAX_INSTANCE - 1] = { [0 ... N_DALLOC - 1] = { .index = -1 } }
+};
+static int dalloc_victim[FS_MAX_INSTANCE];
+
+static void dalloc_atexit()
+{
+    int prev = disk_selected();
+    for (int id=0; id<FS_MAX_INSTANCE; ++id)
     {
-        ++p;
-        if (current_inode.type == TYPE_FILE)
-            return -1;
-        if (*p == '\0')
-            return dirents.entries[index].index;
-        const char* q = p;
-        char* ptr_fn = filename;
-        while (*q != '/' && *q != '\0')
-            *ptr_fn++ = *q++;
-        *ptr_fn = '\0';
-        i = 0;
-        size = current_inode.size;
-        while (size > 0)
-        {
-            if (fs_rd_block(DATA_BEGIN + current_inode.ptr[i], (char*) &dirents) < 0)
-                return -1;
-            if ((index = dirent_lookup(&dirents, filename)) >= 0)
-            {
-                if (rd_inode(dirents.entries[index].index, &next_inode) < 0)
-                    return -1;
-                break;
-            }
-            size -= FS_BLOCK_SIZE;
-            ++i;
-        }
-        if (size < 0)
-            return -1;
-        memcpy(&current_inode, &next_inode, sizeof (struct inode));
-        p = q;
+        if (!instances[id].attached)
+            continue;
+        disk_select(id);
+        fs_flush_all();
     }
-    return dirents.entries[index].index;
+    disk_select(prev);
+}
+
+static void dalloc_forget()
+{
+    for (int i=0; i<N_DALLOC; ++i)
+        dalloc_tab[disk_selected()][i].index = -1;
+}
+
+static struct dalloc* dalloc_find(int index)
+{
+    struct dalloc* tab = dalloc_tab[disk_selected()];
+    for (int i=0; i<N_DALLOC; ++i)
+        if (tab[i].index == index)
+            return &tab[i];
+    return NULL;
+}
+
+// find the delayed allocation slot of a file, or start a new one
+static struct dalloc* dalloc_get(int index)
+{
+    struct dalloc* d;
+    struct inode inode_buf;
+    if ((d = dalloc_find(index)) != NULL)
+        return d;
+    if (rd_inode(index, &inode_buf) < 0 || inode_buf.type == TYPE_DIR)
+        return NULL;
+    if (inode_buf.compressed && (fs_decompress(index) < 0 || rd_inode(index, &inode_buf) < 0))
+        return NULL;
+    if ((d = dalloc_find(-1)) == NULL)
+    {
+        // evict a slot by committing its data
+        d = &dalloc_tab[disk_selected()][dalloc_victim[disk_selected()]++ % N_DALLOC];
+        if (fs_flush(d->index) < 0)
+            return NULL;
+    }
+    d->index = index;
+    d->size = inode_buf.size;
+    d->pending = 0;
+    return d;
+}
+
+int readbyte(int index, int position)
+{
+    struct inode inode_buf;
+    struct dalloc* d;
+    int blockno, offset;
+    if ((d = dalloc_find(index)) != NULL && position >= d->size)
+        return position < d->size + d->pending ? d->data[position - d->size] : -1;
+    if (rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (position >= inode_buf.size || inode_buf.type == TYPE_DIR)
+        return -1;
+    blockno = position / FS_BLOCK_SIZE;
+    offset = position % FS_BLOCK_SIZE;
+    if (rd_file_block(&inode_buf, blockno, fs_buf) < 0)
+        return -1;
+    return fs_buf[offset];
+}
+
+int appendbyte(int index, char byte)
+{
+    struct dalloc* d;
+    if (fs_viewed(index) || (d = dalloc_get(index)) == NULL)
+        return -1;
+    if (d->size + d->pending == FS_BLOCK_SIZE * N_DIRECT_PTR)
+        return -1;
+    d->data[d->pending++] = byte;
+    return 0;
+}
+
+int fs_append(int index, const char* buf, int count)
+{
+    struct dalloc* d;
+    // the views of a mapped file would no longer show it
+    if (fs_viewed(index) || (d = dalloc_get(index)) == NULL)
+        return -1;
+    if (count > FS_BLOCK_SIZE * N_DIRECT_PTR - d->size - d->pending)
+        count = FS_BLOCK_SIZE * N_DIRECT_PTR - d->size - d->pending;
+    if (buf != NULL)
+        memcpy(d->data + d->pending, buf, count);
+    else
+        memset(d->data + d->pending, 0, count);
+    d->pending += count;
+    return count;
+}
+
+int writebyte(int index, int position, char byte)
+{
+    struct inode inode_buf;
+    struct dalloc* d;
+    int blockno, offset;
+    if (position >= FS_BLOCK_SIZE * N_DIRECT_PTR || fs_viewed(index))
+        return -1;
+    if ((d = dalloc_find(index)) != NULL && position >= d->size)
+    {
+        // the gap, if any, is zero-filled in memory
+        if (position >= d->size + d->pending)
+        {
+            memset(d->data + d->pending, 0, position - d->size - d->pending);
+            d->pending = position - d->size + 1;
+        }
+        d->data[position - d->size] = byte;
+        return 0;
+    }
+    if (rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type == TYPE_DIR)
+        return -1;
+    if (inode_buf.compressed && (fs_decompress(index) < 0 || rd_inode(index, &inode_buf) < 0))
+        return -1;
+    if (position >= inode_buf.size)
+    {
+        if ((d = dalloc_get(index)) == NULL)
+            return -1;
+        return writebyte(index, position, byte);
+    }
+    blockno = position / FS_BLOCK_SIZE;
+    offset = position % FS_BLOCK_SIZE;
+    if (unshare_block(index, &inode_buf, blockno) < 0)
+        return -1;
+    // read-modify-write
+    if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[blockno], fs_buf) < 0)
+        return -1;
+    fs_buf[offset] = byte;
+    if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[blockno], fs_buf) < 0)
+        return -1;
+    return 0;
+}
+
+int fs_flush(int index)
+{
+    struct dalloc* d;
+    struct inode inode_buf;
+    struct superblock spblock;
+    int size, blockcnt, new_blockcnt;
+    int i, offset;
+    if (index < 0 || (d = dalloc_find(index)) == NULL)
+        return 0;
+    if (d->pending == 0)
+    {
+        d->index = -1;
+        return 0;
+    }
+    if (rd_inode(index, &inode_buf) < 0)
+        return -1;
+    size = d->size + d->pending;
+    blockcnt = file_blockcnt(d->size);
+    new_blockcnt = file_blockcnt(size) - blockcnt;
+    // fill up the last allocated block
+    offset = d->size % FS_BLOCK_SIZE;
+    if (d->size == 0 || offset != 0)
+    {
+        int n = FS_BLOCK_SIZE - offset < d->pending ? FS_BLOCK_SIZE - offset : d->pending;
+        if (unshare_block(index, &inode_buf, blockcnt - 1) < 0)
+            return -1;
+        // read-modify-write
+        if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[blockcnt - 1], fs_buf) < 0)
+            return -1;
+        memcpy(fs_buf + offset, d->data, n);
+        if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[blockcnt - 1], fs_buf) < 0)
+            return -1;
+        offset = n;
+    }
+    if (new_blockcnt > 0)
+    {
+        // superblock modification, a contiguous run is preferred
+        if (fs_rd_block(0, fs_buf) < 0)
+            return -1;
+        memcpy(&spblock, fs_buf, sizeof (struct superblock));
+        // in dedup mode every full block is placed on its own
+        if (!option(FS_DEDUP) && alloc_blocks(&spblock, &inode_buf, blockcnt, new_blockcnt) < 0)
+            return -1;
+        // write new data blocks
+        for (i=0; i<new_blockcnt; ++i)
+        {
+            int n = d->pending - offset < FS_BLOCK_SIZE ? d->pending - offset : FS_BLOCK_SIZE;
+            memset(fs_buf, 0, FS_BLOCK_SIZE);
+            memcpy(fs_buf, d->data + offset, n);
+            offset += n;
+            if (option(FS_DEDUP))
+            {
+                int b = wr_new_block(&spblock, inode_buf.ptr[blockcnt + i - 1] + 1, fs_buf);
+                if (b < 0)
+                    return -1;
+                inode_buf.ptr[blockcnt + i] = b;
+                continue;
+            }
+            if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[blockcnt + i], fs_buf) < 0)
+                return -1;
+        }
+        // commit superblock changes
+        memset(fs_buf, 0, FS_BLOCK_SIZE);
+        memcpy(fs_buf, &spblock, sizeof (struct superblock));
+        if (fs_wr_block(0, fs_buf) < 0)
+            return -1;
+    }
+    // commit inode changes
+    inode_buf.size = size;
+    if (wr_inode(index, &inode_buf) < 0)
+        return -1;
+    d->index = -1;
+    if (option(FS_COMPRESS))
+        return fs_compress(index);
+    return 0;
+}
+
+// forget the cached data of a removed file
+static void dalloc_drop(int index)
+{
+    struct dalloc* d;
+    if ((d = dalloc_find(index)) != NULL)
+        d->index = -1;
+}
+
+int fs_flush_all()
+{
+    int r = 0;
+    for (int i=0; i<N_DALLOC; ++i)
+        if (fs_flush(dalloc_tab[disk_selected()][i].index) < 0)
+            r = -1;
+    return r;
+}
+
+int fs_truncate(int index, int size)
+{
+    struct inode inode_buf;
+    struct superblock spblock;
+    static _Thread_local int freed[N_DIRECT_PTR];
+    int i, nfreed = 0, blockcnt, new_blockcnt, offset;
+    if (size < 0 || size > FS_BLOCK_SIZE * N_DIRECT_PTR || fs_viewed(index))
+        return -1;
+    if (fs_flush(index) < 0 || fs_decompress(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type == TYPE_DIR)
+        return -1;
+    if (size >= inode_buf.size)
+        return fs_fallocate(index, size);
+    blockcnt = file_blockcnt(inode_buf.size);
+    new_blockcnt = file_blockcnt(size);
+    // zero the tail of the last kept block, so that growing the file again reads zeros
+    offset = size % FS_BLOCK_SIZE;
+    if (size == 0 || offset != 0)
+    {
+        if (unshare_block(index, &inode_buf, new_blockcnt - 1) < 0)
+            return -1;
+        if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[new_blockcnt - 1], fs_buf) < 0)
+            return -1;
+        memset(fs_buf + offset, 0, FS_BLOCK_SIZE - offset);
+        if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[new_blockcnt - 1], fs_buf) < 0)
+            return -1;
+    }
+    if (new_blockcnt < blockcnt)
+    {
+        // release tail blocks in one superblock read-modify-write
+        if (fs_rd_block(0, fs_buf) < 0)
+            return -1;
+        memcpy(&spblock, fs_buf, sizeof (struct superblock));
+        for (i=new_blockcnt; i<blockcnt; ++i)
+        {
+            if (block_release(&spblock, inode_buf.ptr[i]))
+                freed[nfreed++] = inode_buf.ptr[i];
+            inode_buf.ptr[i] = 0;
+        }
+        memset(fs_buf, 0, FS_BLOCK_SIZE);
+        memcpy(fs_buf, &spblock, sizeof (struct superblock));
+        if (fs_wr_block(0, fs_buf) < 0)
+            return -1;
+    }
+    // commit inode changes
+    inode_buf.size = size;
+    if (wr_inode(index, &inode_buf) < 0)
+        return -1;
+    discard_blocks(freed, nfreed);
+    return 0;
+}
+
+int fs_fallocate(int index, int size)
+{
+    struct inode inode_buf;
+    struct superblock spblock;
+    int i, blockcnt, new_blockcnt;
+    if (size < 0 || size > FS_BLOCK_SIZE * N_DIRECT_PTR || fs_viewed(index))
+        return -1;
+    if (fs_flush(index) < 0 || fs_decompress(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type == TYPE_DIR)
+        return -1;
+    if (size <= inode_buf.size)
+        return 0;
+    // bytes past the end of the last block are already zero
+    blockcnt = file_blockcnt(inode_buf.size);
+    new_blockcnt = file_blockcnt(size) - blockcnt;
+    if (new_blockcnt > 0)
+    {
+        // reserve all blocks in one superblock read-modify-write
+        if (fs_rd_block(0, fs_buf) < 0)
+            return -1;
+        memcpy(&spblock, fs_buf, sizeof (struct superblock));
+        if (alloc_blocks(&spblock, &inode_buf, blockcnt, new_blockcnt) < 0)
+            return -1;
+        memset(fs_buf, 0, FS_BLOCK_SIZE);
+        for (i=0; i<new_blockcnt; ++i)
+            if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[blockcnt + i], fs_buf) < 0)
+                return -1;
+        // commit superblock changes
+        memcpy(fs_buf, &spblock, sizeof (struct superblock));
+        if (fs_wr_block(0, fs_buf) < 0)
+            return -1;
+    }
+    // commit inode changes
+    inode_buf.size = size;
+    if (wr_inode(index, &inode_buf) < 0)
+        return -1;
+    return 0;
+}
+
+int fs_reserve(int index, int size, int* blocks)
+{
+    struct inode inode_buf;
+    struct superblock spblock;
+    int blockcnt;
+    if (size < 0 || size > FS_BLOCK_SIZE * N_DIRECT_PTR)
+        return -1;
+    if (rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type == TYPE_DIR || inode_buf.size != 0 || inode_buf.compressed)
+        return -1;
+    // the first block is the one the empty file already owns
+    blockcnt = file_blockcnt(size);
+    if (blockcnt > 1)
+    {
+        if (fs_rd_block(0, fs_buf) < 0)
+            return -1;
+        memcpy(&spblock, fs_buf, sizeof (struct superblock));
+        if (alloc_blocks(&spblock, &inode_buf, 1, blockcnt - 1) < 0)
+            return -1;
+        memset(fs_buf, 0, FS_BLOCK_SIZE);
+        memcpy(fs_buf, &spblock, sizeof (struct superblock));
+        if (fs_wr_block(0, fs_buf) < 0)
+            return -1;
+    }
+    inode_buf.size = size;
+    if (wr_inode(index, &inode_buf) < 0)
+        return -1;
+    for (int i=0; i<blockcnt; ++i)
+        blocks[i] = inode_buf.ptr[i];
+    return blockcnt;
+}
+
+int fs_compress(int index)
+{
+    struct inode inode_buf;
+    struct superblock spblock;
+    static _Thread_local char raw[FS_BLOCK_SIZE], frag[FS_BLOCK_SIZE];
+    static _Thread_local char packed[N_DIRECT_PTR][FS_BLOCK_SIZE];
+    static _Thread_local int freed[N_DIRECT_PTR];
+    uint32_t ptr[N_DIRECT_PTR];
+    int i, n, len, blockcnt;
+    int npacked = 0, offset = FS_BLOCK_SIZE, packed_bytes = 0;
+    clock_t start;
+    if (fs_flush(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    // a mapped file stays as its views show it
+    if (inode_buf.type == TYPE_DIR || inode_buf.compressed || inode_buf.size == 0 || fs_viewed(index))
+        return 0;
+    blockcnt = file_blockcnt(inode_buf.size);
+    // files sharing blocks with others are left alone, the packed blocks are written in place
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    for (i=0; i<blockcnt; ++i)
+        if (spblock.block_ref[inode_buf.ptr[i]] > 0)
+            return 0;
+    for (i=0; i<blockcnt; ++i)
+    {
+        len = inode_buf.size - i * FS_BLOCK_SIZE < FS_BLOCK_SIZE ? inode_buf.size - i * FS_BLOCK_SIZE : FS_BLOCK_SIZE;
+        if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[i], raw) < 0)
+            return -1;
+        start = clock();
+        n = lz_compress(raw, len, frag, FS_BLOCK_SIZE - 1);
+        cur()->compress_stat.compress_clock += clock() - start;
+        if (n < 0) // incompressible, keep a raw copy in a block of its own
+        {
+            memcpy(packed[npacked], raw, FS_BLOCK_SIZE);
+            ptr[i] = CPTR(npacked++, 0, FS_BLOCK_SIZE);
+            offset = FS_BLOCK_SIZE;
+            packed_bytes += FS_BLOCK_SIZE;
+            continue;
+        }
+        // fragments are 16-byte aligned and never cross a block boundary
+        if (offset + n > FS_BLOCK_SIZE)
+        {
+            memset(packed[npacked++], 0, FS_BLOCK_SIZE);
+            offset = 0;
+        }
+        memcpy(packed[npacked - 1] + offset, frag, n);
+        ptr[i] = CPTR(npacked - 1, offset, n);
+        offset += (n + 15) & ~15;
+        packed_bytes += n;
+    }
+    if (npacked >= blockcnt) // nothing to gain
+        return 0;
+    cur()->compress_stat.raw_bytes += inode_buf.size;
+    cur()->compress_stat.packed_bytes += packed_bytes;
+    // the packed blocks reuse the first blocks of the file
+    for (i=0; i<npacked; ++i)
+        if (fs_wr_block(DATA_BEGIN + inode_buf.ptr[i], packed[i]) < 0)
+            return -1;
+    // release the rest in one superblock read-modify-write
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    for (i=npacked; i<blockcnt; ++i)
+    {
+        block_release(&spblock, inode_buf.ptr[i]);
+        freed[i - npacked] = inode_buf.ptr[i];
+    }
+    memset(fs_buf, 0, FS_BLOCK_SIZE);
+    memcpy(fs_buf, &spblock, sizeof (struct superblock));
+    if (fs_wr_block(0, fs_buf) < 0)
+        return -1;
+    // commit inode changes
+    for (i=0; i<blockcnt; ++i)
+        ptr[i] = CPTR(inode_buf.ptr[CPTR_BLOCK(ptr[i])], CPTR_OFFSET(ptr[i]), CPTR_LEN(ptr[i]));
+    memcpy(inode_buf.ptr, ptr, blockcnt * sizeof (uint32_t));
+    inode_buf.compressed = 1;
+    if (wr_inode(index, &inode_buf) < 0)
+        return -1;
+    discard_blocks(freed, blockcnt - npacked);
+    return 0;
+}
+
+int fs_decompress(int index)
+{
+    struct inode inode_buf, raw_inode;
+    struct superblock spblock;
+    static _Thread_local char raw[N_DIRECT_PTR][FS_BLOCK_SIZE];
+    int blocks[N_DIRECT_PTR];
+    int i, nblocks, blockcnt;
+    if (rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (!inode_buf.compressed)
+        return 0;
+    blockcnt = file_blockcnt(inode_buf.size);
+    for (i=0; i<blockcnt; ++i)
+        if (rd_file_block(&inode_buf, i, raw[i]) < 0)
+            return -1;
+    // reuse the packed blocks, allocate the rest in one go
+    nblocks = inode_blocks(&inode_buf, blocks);
+    raw_inode = inode_buf;
+    raw_inode.compressed = 0;
+    for (i=0; i<nblocks; ++i)
+        raw_inode.ptr[i] = blocks[i];
+    if (blockcnt > nblocks)
+    {
+        if (fs_rd_block(0, fs_buf) < 0)
+            return -1;
+        memcpy(&spblock, fs_buf, sizeof (struct superblock));
+        if (alloc_blocks(&spblock, &raw_inode, nblocks, blockcnt - nblocks) < 0)
+            return -1;
+        memset(fs_buf, 0, FS_BLOCK_SIZE);
+        memcpy(fs_buf, &spblock, sizeof (struct superblock));
+        if (fs_wr_block(0, fs_buf) < 0)
+            return -1;
+    }
+    for (i=0; i<blockcnt; ++i)
+        if (fs_wr_block(DATA_BEGIN + raw_inode.ptr[i], raw[i]) < 0)
+            return -1;
+    // commit inode changes
+    if (wr_inode(index, &raw_inode) < 0)
+        return -1;
+    return 0;
+}
+
+static int do_clone(int src_inodeno, int dst_inodeno)
+{
+    struct inode src_inode, dst_inode;
+    struct superblock spblock;
+    int src_blocks[N_DIRECT_PTR], freed[N_DIRECT_PTR];
+    uint32_t ptr[N_DIRECT_PTR];
+    int bmap_index;
+    if (fs_viewed(dst_inodeno))
+        return -1;
+    if (fs_flush(src_inodeno) < 0 || fs_flush(dst_inodeno) < 0)
+        return -1;
+    if (fs_decompress(dst_inodeno) < 0)
+        return -1;
+    if (rd_inode(src_inodeno, &src_inode) < 0)
+        return -1;
+    if (rd_inode(dst_inodeno, &dst_inode) < 0)
+        return -1;
+    // a compressed file is copied as it is stored, packed blocks and all
+    int src_blockcnt = slot_blocks(&src_inode, src_blocks);
+    int dst_blockcnt = file_blockcnt(dst_inode.size);
+    int goal = dst_inode.ptr[0];
+    int i, k, nfreed = 0, first = -1;
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf,  sizeof (struct superblock));
+    // release the old content of the destination
+    for (i=0; i<dst_blockcnt; ++i)
+        if (block_release(&spblock, dst_inode.ptr[i]))
+            freed[nfreed++] = dst_inode.ptr[i];
+    // keep the copy contiguous
+    if (!option(FS_DEDUP) || src_inode.compressed)
+    {
+        first = bmap_lookup_run(&spblock, src_blockcnt, goal);
+        // the source is read ahead in runs instead of block by block
+        if (readahead(src_blocks, src_blockcnt) < 0)
+            return -1;
+    }
+    for (i=0; i<src_blockcnt; ++i)
+    {
+        // in dedup mode the copy shares the blocks of the source
+        if (option(FS_DEDUP) && !src_inode.compressed && spblock.block_ref[src_blocks[i]] < UINT8_MAX)
+        {
+            spblock.block_ref[src_blocks[i]]++;
+            dst_inode.ptr[i] = src_blocks[i];
+            cur()->dedup_stat.writes++;
+            cur()->dedup_stat.hits++;
+            continue;
+        }
+        // superblock modification
+        if (first >= 0)
+            bmap_index = first + i;
+        else if ((bmap_index = bmap_lookup_near(&spblock, i > 0 ? dst_inode.ptr[i - 1] + 1 : goal)) < 0)
+            return -1;
+        spblock.free_block_count--;
+        bmap_set(bmap_index, &spblock);
+        // copy data block
+        dst_inode.ptr[i] = bmap_index;
+        if (fs_rd_block(DATA_BEGIN + src_blocks[i], fs_buf) < 0)
+            return -1;
+        if (fs_wr_block(DATA_BEGIN + dst_inode.ptr[i], fs_buf) < 0)
+            return -1;
+    }
+    // commit superblock changes
+    memset(fs_buf, 0, FS_BLOCK_SIZE);
+    memcpy(fs_buf, &spblock, sizeof (struct superblock));
+    if (fs_wr_block(0, fs_buf) < 0)
+        return -1;
+    dst_inode.size = src_inode.size;
+    if (src_inode.compressed)
+    {
+        // point the fragments to the copied blocks
+        for (i=0; i<file_blockcnt(src_inode.size); ++i)
+        {
+            for (k=0; src_blocks[k] != CPTR_BLOCK(src_inode.ptr[i]); ++k)
+                ;
+            ptr[i] = CPTR(dst_inode.ptr[k], CPTR_OFFSET(src_inode.ptr[i]), CPTR_LEN(src_inode.ptr[i]));
+        }
+        memcpy(dst_inode.ptr, ptr, file_blockcnt(src_inode.size) * sizeof (uint32_t));
+        dst_inode.compressed = 1;
+    }
+    // commit inode changes
+    if (wr_inode(dst_inodeno, &dst_inode) < 0)
+        return -1;
+    // blocks that were reused for the copy are not released to the host
+    for (i=0, k=0; i<nfreed; ++i)
+        if (!bmap_test(freed[i], &spblock))
+            freed[k++] = freed[i];
+    discard_blocks(freed, k);
+    return 0;
+}
+
+int clone(int src_inodeno, int dst_inodeno)
+{
+    TRACE_BEGIN(start);
+    int r = do_clone(src_inodeno, dst_inodeno);
+    TRACE_END(TRACE_CLONE, start, dst_inodeno);
+    return r;
+}
+
+// the number of physically contiguous runs in a list of blocks in file order
+static int count_extents(const int* blocks, int count)
+{
+    int extents = count > 0;
+    for (int i=1; i<count; ++i)
+        if (blocks[i] != blocks[i - 1] + 1)
+            ++extents;
+    return extents;
+}
+
+// the inode table keeps what removed files left behind, only inodes in use are looked at
+static int inode_in_use(int index)
+{
+    struct superblock spblock;
+    if (index < 0 || index >= INODE_NUM || fs_rd_block(0, fs_buf) < 0)
+        return 0;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    return imap_test(index, &spblock);
+}
+
+int fs_frag(int index, struct frag_stat* stat)
+{
+    struct inode inode_buf;
+    int blocks[N_DIRECT_PTR];
+    int n, extents;
+    if (!inode_in_use(index))
+        return 0;
+    // appended data gets its blocks first
+    if (fs_flush(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type != TYPE_FILE)
+        return 0;
+    n = inode_blocks(&inode_buf, blocks);
+    extents = count_extents(blocks, n);
+    stat->files++;
+    stat->blocks += n;
+    stat->extents += extents;
+    if (extents > 1)
+        stat->fragmented++;
+    return extents;
+}
+
+int fs_frag_image(struct frag_stat* stat)
+{
+    struct superblock spblock;
+    int i, run = 0;
+    if (fs_flush_all() < 0 || fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    for (i=0; i<INODE_NUM; ++i)
+        if (imap_test(i, &spblock) && fs_frag(i, stat) < 0)
+            return -1;
+    // free space in short pieces cannot take a whole file
+    for (i=0; i<=DATA_BLOCK_COUNT; ++i)
+    {
+        if (i < DATA_BLOCK_COUNT && !bmap_test(i, &spblock))
+        {
+            ++run;
+            continue;
+        }
+        if (run > 0)
+            stat->free_extents++;
+        if (run > stat->largest_free)
+            stat->largest_free = run;
+        run = 0;
+    }
+    return 0;
+}
+
+static int do_defrag(int index, struct frag_stat* stat)
+{
+    struct inode inode_buf;
+    struct superblock spblock;
+    struct dedup_index* x = &dedup_index[disk_selected()];
+    int old[N_DIRECT_PTR], new[N_DIRECT_PTR], freed[N_DIRECT_PTR];
+    uint32_t ptr[N_DIRECT_PTR];
+    int i, k, n, first, nfreed = 0;
+    // the views of a mapped file point at its blocks
+    if (!inode_in_use(index) || fs_viewed(index))
+        return 0;
+    if (fs_flush(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type != TYPE_FILE)
+        return 0;
+    // a compressed file is moved as it is stored, packed blocks and all
+    n = inode_blocks(&inode_buf, old);
+    if (count_extents(old, n) <= 1)
+        return 0;
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    // moving a shared block would undo the sharing
+    for (i=0; i<n; ++i)
+    {
+        if (spblock.block_ref[old[i]] > 0)
+        {
+            stat->shared++;
+            return 0;
+        }
+    }
+    // grow the file in place behind its first block if that space is free, otherwise move all of it
+    for (i=1; i<n && old[0] + i < DATA_BLOCK_COUNT
+         && (old[i] == old[0] + i || !bmap_test(old[0] + i, &spblock)); ++i)
+        ;
+    if ((first = i == n ? old[0] : bmap_lookup_run(&spblock, n, old[0])) < 0)
+    {
+        stat->no_space++;
+        return 0;
+    }
+    if (readahead(old, n) < 0)
+        return -1;
+    for (i=0, k=0; i<n; ++i)
+    {
+        new[i] = first + i;
+        if (new[i] == old[i])
+            continue;
+        if (fs_rd_block(DATA_BEGIN + old[i], fs_buf) < 0 || fs_wr_block(DATA_BEGIN + new[i], fs_buf) < 0)
+            return -1;
+        bmap_set(new[i], &spblock);
+        spblock.free_block_count--;
+        // the content hash moves along with the block
+        if (x->block_hashed[old[i]])
+            dedup_insert(x->block_hash[old[i]], new[i]);
+        block_release(&spblock, old[i]);
+        freed[nfreed++] = old[i];
+    }
+    // commit superblock changes
+    memset(fs_buf, 0, FS_BLOCK_SIZE);
+    memcpy(fs_buf, &spblock, sizeof (struct superblock));
+    if (fs_wr_block(0, fs_buf) < 0)
+        return -1;
+    // every pointer changes with the one inode write
+    for (i=0; i<file_blockcnt(inode_buf.size); ++i)
+    {
+        if (!inode_buf.compressed)
+        {
+            ptr[i] = new[i];
+            continue;
+        }
+        for (k=0; old[k] != CPTR_BLOCK(inode_buf.ptr[i]); ++k)
+            ;
+        ptr[i] = CPTR(new[k], CPTR_OFFSET(inode_buf.ptr[i]), CPTR_LEN(inode_buf.ptr[i]));
+    }
+    memcpy(inode_buf.ptr, ptr, file_blockcnt(inode_buf.size) * sizeof (uint32_t));
+    if (wr_inode(index, &inode_buf) < 0)
+        return -1;
+    discard_blocks(freed, nfreed);
+    stat->defragged++;
+    stat->moved += nfreed;
+    return nfreed;
+}
+
+int fs_defrag(int index, struct frag_stat* stat)
+{
+    TRACE_BEGIN(start);
+    int r = do_defrag(index, stat);
+    TRACE_END(TRACE_DEFRAG, start, index);
+    return r;
+}
+
+static int do_openpath(const char* path)
+{
+    static _Thread_local char filename[256];
+    struct inode current_inode, next_inode;
+    struct dirblk dirents;
+    int i, j, size, index;
+    if (path[0] != '/')
+        return -1;
+    const char* p = path;
+    rd_inode(0, &current_inode);
+    if (fs_rd_block(DATA_BEGIN, (char*) &dirents) < 0)
+        return -1;
+    index = 0;
+    while (*p != '\0')
+    {
+        ++p;
+        if (current_inode.type == TYPE_FILE)
+            return -1;
+        if (*p == '\0')
+            return DIRENT_AT(&dirents, index)->index;
+        const char* q = p;
+        char* ptr_fn = filename;
+        while (*q != '/' && *q != '\0')
+            *ptr_fn++ = *q++;
+        *ptr_fn = '\0';
+        i = 0;
+        size = current_inode.size;
+        while (size > 0)
+        {
+            if (fs_rd_block(DATA_BEGIN + current_inode.ptr[i], (char*) &dirents) < 0)
+                return -1;
+            if ((index = dirent_lookup(&dirents, filename)) >= 0)
+            {
+                if (rd_inode(DIRENT_AT(&dirents, index)->index, &next_inode) < 0)
+                    return -1;
+                break;
+            }
+            size -= FS_BLOCK_SIZE;
+            ++i;
+        }
+        if (size <= 0)
+            return -1;
+        memcpy(&current_inode, &next_inode, sizeof (struct inode));
+        p = q;
+    }
+    return DIRENT_AT(&dirents, index)->index;
+}
+
+int openpath(const char* path)
+{
+    TRACE_BEGIN(start);
+    int r = do_openpath(path);
+    TRACE_END(TRACE_OPENPATH, start, r);
+    return r;
+}
+
+
+static int sendfile_inode(int index, int out_fd)
+{
+    struct inode inode_buf;
+    int i, run, blockcnt, nbytes;
+    int r = 0;
+    if (fs_flush(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (inode_buf.type == TYPE_DIR)
+        return -1;
+    blockcnt = inode_buf.size == 0 ? 0 : file_blockcnt(inode_buf.size);
+    if (inode_buf.compressed || option(FS_CSUM_DATA))
+    {
+        // the data has to be decompressed or checked in memory
+        for (i=0; i<blockcnt; ++i)
+        {
+            nbytes = (i + 1) * FS_BLOCK_SIZE < inode_buf.size ? FS_BLOCK_SIZE : inode_buf.size - i * FS_BLOCK_SIZE;
+            if (rd_file_block(&inode_buf, i, fs_buf) < 0 || write(out_fd, fs_buf, nbytes) != nbytes)
+                return -1;
+        }
+        return 0;
+    }
+    if (attach_disk() == -1)
+        return -1;
+    // one transfer per physically contiguous run of blocks
+    for (i=0; i<blockcnt && r == 0; i+=run)
+    {
+        for (run=1; i+run<blockcnt && inode_buf.ptr[i+run] == inode_buf.ptr[i] + run; ++run)
+            ;
+        nbytes = (i + run) * FS_BLOCK_SIZE < inode_buf.size ? run * FS_BLOCK_SIZE : inode_buf.size - i * FS_BLOCK_SIZE;
+        // the image has to hold what the cache holds before it is copied from
+        if (cache_writeback(DATA_BEGIN + inode_buf.ptr[i], run) < 0)
+            return -1;
+        r = disk_send_block((DATA_BEGIN + inode_buf.ptr[i]) * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE), nbytes, out_fd);
+    }
+    return r;
+}
+
+int fs_sendfile(int index, int out_fd)
+{
+    TRACE_BEGIN(start);
+    int r = sendfile_inode(index, out_fd);
+    TRACE_END(TRACE_READ, start, index);
+    return r;
+}
+
+static void unmap_views(struct fs_view* views, int count)
+{
+    for (int i=0; i<count; ++i)
+        disk_unmap_block(views[i].data);
+}
+
+static int map_inode(int index, struct fs_view* views)
+{
+    struct instance* in = cur();
+    struct inode inode_buf;
+    int i, run, blockcnt, nbytes, off, n = 0;
+    unsigned int len;
+    if (index < 0 || index >= INODE_NUM)
+        return -1;
+    if (fs_flush(index) < 0 || rd_inode(index, &inode_buf) < 0)
+        return -1;
+    // the blocks of a compressed file do not hold its data as it is read
+    if (inode_buf.type == TYPE_DIR || inode_buf.compressed)
+        return -1;
+    if (attach_disk() == -1)
+        return -1;
+    blockcnt = inode_buf.size == 0 ? 0 : file_blockcnt(inode_buf.size);
+    // one view per physically contiguous run of blocks
+    for (i=0; i<blockcnt; i+=run)
+    {
+        for (run=1; i+run<blockcnt && inode_buf.ptr[i+run] == inode_buf.ptr[i] + run; ++run)
+            ;
+        nbytes = (i + run) * FS_BLOCK_SIZE < inode_buf.size ? run * FS_BLOCK_SIZE : inode_buf.size - i * FS_BLOCK_SIZE;
+        // the image has to hold what the cache holds before it is looked at
+        if (cache_writeback(DATA_BEGIN + inode_buf.ptr[i], run) < 0)
+        {
+            unmap_views(views, n);
+            return -1;
+        }
+        for (off=0; off<nbytes; off+=len)
+        {
+            views[n].data = disk_map_block((DATA_BEGIN + inode_buf.ptr[i]) * (FS_BLOCK_SIZE / DEVICE_BLOCK_SIZE)
+                + off / DEVICE_BLOCK_SIZE, nbytes - off, &len);
+            if (views[n].data == NULL)
+            {
+                unmap_views(views, n);
+                return -1;
+            }
+            views[n++].len = len;
+        }
+    }
+    __atomic_fetch_add(&in->viewed[index], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&in->nviews, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+int fs_map(int index, struct fs_view* views)
+{
+    TRACE_BEGIN(start);
+    int r = map_inode(index, views);
+    TRACE_END(TRACE_MAP, start, index);
+    return r;
+}
+
+int fs_unmap(int index, struct fs_view* views, int count)
+{
+    struct instance* in = cur();
+    if (index < 0 || index >= INODE_NUM || __atomic_load_n(&in->viewed[index], __ATOMIC_RELAXED) == 0)
+        return -1;
+    unmap_views(views, count);
+    __atomic_fetch_sub(&in->viewed[index], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&in->nviews, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// inodes and data blocks to be freed by rm
+static _Thread_local int rm_inodes[INODE_NUM];
+static _Thread_local int rm_blocks[INODE_NUM * N_DIRECT_PTR + 1];
+
+// collect the subtree rooted at index, rm_inodes doubles as the queue of the walk
+static int rm_collect(int index, int* ninodes, int* nblocks, int* ndirs)
+{
+    struct inode inode_buf;
+    static _Thread_local struct dirblk dir_buf;
+    int i, j, pos, blockcnt;
+    *ninodes = *nblocks = *ndirs = 0;
+    rm_inodes[(*ninodes)++] = index;
+    for (i=0; i<*ninodes; ++i)
+    {
+        if (rd_inode(rm_inodes[i], &inode_buf) < 0)
+            return -1;
+        blockcnt = slot_blocks(&inode_buf, rm_blocks + *nblocks);
+        *nblocks += blockcnt;
+        if (inode_buf.type != TYPE_DIR)
+            continue;
+        ++*ndirs;
+        for (j=0; j<blockcnt; ++j)
+        {
+            if (fs_rd_block(DATA_BEGIN + inode_buf.ptr[j], dir_buf.data) < 0)
+                return -1;
+            for (pos=dirent_next(&dir_buf, -1); pos>=0; pos=dirent_next(&dir_buf, pos))
+            {
+                struct dirent* e = DIRENT_AT(&dir_buf, pos);
+                if (!e->valid || strcmp(e->name, curdir) == 0 || strcmp(e->name, prtdir) == 0)
+                    continue;
+                rm_inodes[(*ninodes)++] = e->index;
+            }
+        }
+    }
+    return 0;
+}
+
+int rm(int index_dir, const char* filename, int mode)
+{
+    struct inode inode_dir, inode_buf;
+    static _Thread_local struct dirblk dir_buf;
+    struct superblock spblock;
+    int ninodes, nblocks, ndirs;
+    int i, pos, index, nfreed;
+    if (strcmp(filename, curdir) == 0 || strcmp(filename, prtdir) == 0)
+        return -1;
+    if (rd_inode(index_dir, &inode_dir) < 0 || inode_dir.type != TYPE_DIR)
+        return -1;
+    // find the directory entry
+    for (i=0; i<inode_dir.size / FS_BLOCK_SIZE; ++i)
+    {
+        if (fs_rd_block(DATA_BEGIN + inode_dir.ptr[i], dir_buf.data) < 0)
+            return -1;
+        if ((pos = dirent_lookup(&dir_buf, filename)) >= 0)
+            break;
+    }
+    if (i == inode_dir.size / FS_BLOCK_SIZE)
+        return -1;
+    index = DIRENT_AT(&dir_buf, pos)->index;
+    if (rd_inode(index, &inode_buf) < 0)
+        return -1;
+    if (mode == RM_FILE && inode_buf.type == TYPE_DIR)
+        return -1;
+    if (mode == RM_DIR && inode_buf.type != TYPE_DIR)
+        return -1;
+    if (rm_collect(index, &ninodes, &nblocks, &ndirs) < 0)
+        return -1;
+    if (mode == RM_DIR && ninodes > 1) // directory not empty
+        return -1;
+    // the blocks of a mapped file must not be handed to another one
+    for (int k=0; k<ninodes; ++k)
+        if (fs_viewed(rm_inodes[k]))
+            return -1;
+    // update directory entry, an emptied block other than the first one is freed as well
+    dirent_remove(&dir_buf, pos);
+    if (i > 0 && dirent_next(&dir_buf, -1) < 0)
+    {
+        rm_blocks[nblocks++] = inode_dir.ptr[i];
+        memmove(&inode_dir.ptr[i], &inode_dir.ptr[i + 1], (N_DIRECT_PTR - i - 1) * sizeof (uint32_t));
+        inode_dir.size -= FS_BLOCK_SIZE;
+        if (wr_inode(index_dir, &inode_dir) < 0)
+            return -1;
+    }
+    else if (fs_wr_block(DATA_BEGIN + inode_dir.ptr[i], dir_buf.data) < 0)
+        return -1;
+    // read-modify-write superblock once for the whole batch
+    if (fs_rd_block(0, fs_buf) < 0)
+        return -1;
+    memcpy(&spblock, fs_buf, sizeof (struct superblock));
+    for (i=0; i<ninodes; ++i)
+    {
+        imap_reset(rm_inodes[i], &spblock);
+        dalloc_drop(rm_inodes[i]);
+    }
+    for (i=0, nfreed=0; i<nblocks; ++i)
+        if (block_release(&spblock, rm_blocks[i]))
+            rm_blocks[nfreed++] = rm_blocks[i];
+    spblock.free_inode_count += ninodes;
+    spblock.dir_inode_count -= ndirs;
+    memset(fs_buf, 0, FS_BLOCK_SIZE);
+    memcpy(fs_buf, &spblock, sizeof (struct superblock));
+    if (fs_wr_block(0, fs_buf) < 0)
+        return -1;
+    discard_blocks(rm_blocks, nfreed);
+    return 0;
 }
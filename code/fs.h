@@ -1,11 +1,12 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include "disk.h"
 
-#define MAGIC (0x7fffffff)
+#define MAGIC (0x7ffffffd) // 最后一块留作校验和块后更换，旧镜像需重新格式化
 #define FS_BLOCK_COUNT (1024)
 #define FS_BLOCK_SIZE (4096)
 #define TYPE_FILE (1)
@@ -14,10 +15,34 @@
 #define INODE_NUM (1024)
 #define DATA_BEGIN (1 + INODE_NUM * (sizeof (struct inode)) / FS_BLOCK_SIZE)
 #define INODE_PER_BLOCK (FS_BLOCK_SIZE / sizeof (struct inode))
+#define MAX_NAME_LEN (255)
+#define DATA_BLOCK_COUNT (FS_BLOCK_COUNT - DATA_BEGIN - 1)
+#define CSUM_BLOCK (FS_BLOCK_COUNT - 1) // 校验和块，存放每块的CRC32C，0表示不校验，自己的一项校验块中其余的字节
+#define N_DALLOC (4) // 同时进行延迟分配的文件数
+#define RM_FILE (0)      // 只删除文件
+#define RM_DIR (1)       // 只删除空目录
+#define RM_RECURSIVE (2) // 删除文件或整个目录树
+#define INODE_GROUP_COUNT (INODE_NUM / INODE_PER_BLOCK) // 每个inode表块为一个局部性组
+#define FS_MAX_INSTANCE (DISK_MAX) // 一个进程同时打开的文件系统实例数，每个实例对应一个磁盘镜像
+#define SYNC_NONE (0)       // 不调用fdatasync，每个操作结束时脏块写回宿主机的页缓存
+#define SYNC_OP (1)         // 每个操作结束时写回脏块并fdatasync
+#define SYNC_GROUP (2)      // 后台线程每隔一段时间成批写回脏块，只fdatasync一次
+#define SYNC_INTERVAL (100) // SYNC_GROUP默认的写回间隔，毫秒
+#define GROUP_DATA_BEGIN(inode) ((inode) / INODE_PER_BLOCK * DATA_BLOCK_COUNT / INODE_GROUP_COUNT)
+
+// 压缩文件的ptr[i]：数据块号(10位) | 块内偏移/16(8位) | 压缩后长度-1(12位)，长度为FS_BLOCK_SIZE表示未压缩
+#define CPTR(block, offset, len) ((uint32_t) (block) | (uint32_t) (offset) >> 4 << 10 | (uint32_t) ((len) - 1) << 18)
+#define CPTR_BLOCK(p) ((p) & 0x3ff)
+#define CPTR_OFFSET(p) (((p) >> 10 & 0xff) << 4)
+#define CPTR_LEN(p) (((p) >> 18 & 0xfff) + 1)
 
 extern const char* curdir;
 extern const char* prtdir;
-static char fs_buf[FS_BLOCK_SIZE];
+
+#define FS_COMPRESS (1)  // 文件写回后自动压缩
+#define FS_DEDUP (2)     // 写入的完整数据块与已有的相同数据块共享
+#define FS_CSUM_DATA (4) // 数据块也计算校验和，超级块和inode表总是校验
+static _Thread_local char fs_buf[FS_BLOCK_SIZE]; // 每个线程一份，各线程可以同时操作不同的实例
 
 // 超级块
 struct superblock {
@@ -27,27 +52,78 @@ struct superblock {
     int32_t dir_inode_count;
     uint8_t block_map[FS_BLOCK_COUNT / 8];
     uint8_t inode_map[INODE_NUM / 8];
+    uint8_t block_ref[FS_BLOCK_COUNT]; // 数据块被额外引用的次数，去重后多个文件共享同一数据块
 };
 
 // 索引节点
 struct inode {
     uint32_t size : 22;
     uint32_t type : 2;
-    uint32_t link : 8;
+    uint32_t link : 7;
+    uint32_t compressed : 1; // 数据块经过压缩，ptr[]按CPTR格式解释
     uint32_t ptr[N_DIRECT_PTR];
 };
 
-// 目录项
+// 压缩统计
+struct compress_stat {
+    long raw_bytes;        // 被压缩的原始字节数
+    long packed_bytes;     // 压缩后的字节数
+    long compress_clock;   // 压缩耗费的CPU时间，单位为clock()的计时
+    long decompress_clock; // 解压耗费的CPU时间
+};
+
+// 去重统计
+struct dedup_stat {
+    long writes; // 经过去重检查的数据块写入次数
+    long hits;   // 其中与已有数据块相同、只更新了指针的次数
+};
+
+// 校验和统计，只有从磁盘读入的块才校验，缓存命中的不校验
+struct csum_stat {
+    long verified; // 校验通过的块数
+    long errors;   // 重读一次仍与校验和不符的块数，读取失败
+};
+
+// 持久化统计
+struct sync_stat {
+    long syncs;    // fdatasync次数
+    long blocks;   // 写回磁盘的块数
+    long sync_ns;  // fdatasync耗费的时间，纳秒
+};
+
+// 碎片统计，段（extent）是文件中物理上连续的一串数据块，没有碎片的文件只有一段
+struct frag_stat {
+    int files;          // 统计的文件数
+    int fragmented;     // 多于一段的文件数
+    int blocks;         // 文件占用的数据块数
+    int extents;        // 文件的段数之和
+    int free_extents;   // 空闲空间的段数
+    int largest_free;   // 最长的一段空闲空间的块数
+    int defragged;      // 整理成一段的文件数
+    int moved;          // 整理时移动的数据块数
+    int shared;         // 有与其他文件共享的数据块、不能移动的文件数
+    int no_space;       // 没有足够长的空闲空间、未能整理的文件数
+};
+
+extern const char* const durability_name[3]; // 按SYNC_NONE、SYNC_OP、SYNC_GROUP的顺序
+
+// 目录项，按文件名实际长度变长存放
 struct dirent {
     uint16_t index : 13;
     uint16_t valid : 1;
     uint16_t type : 2;
-    char name[126];
+    uint16_t rec_len;   // 整条记录的长度（4字节对齐），0表示块内目录项到此结束
+    uint8_t name_len;
+    char name[];        // 以'\0'结尾
 };
 
-// 单个目录数据块
+#define DIRENT_HDR_SIZE (offsetof(struct dirent, name))
+#define DIRENT_REC_LEN(name_len) ((DIRENT_HDR_SIZE + (name_len) + 1 + 3) & ~3)
+#define DIRENT_AT(blk, pos) ((struct dirent*) ((blk)->data + (pos)))
+
+// 单个目录数据块，目录项从块首开始紧凑排列，其后全部为空闲空间
 struct dirblk {
-    struct dirent entries[FS_BLOCK_SIZE / sizeof (struct dirent)];
+    _Alignas(4) char data[FS_BLOCK_SIZE];
 };
 
 // 读取文件系统块
@@ -56,6 +132,57 @@ int fs_rd_block(unsigned int index, char* const fs_buf);
 // 写入文件系统块
 int fs_wr_block(unsigned int index, const char* const fs_buf);
 
+// 释放宿主机上从index开始的count个文件系统块占用的空间
+int fs_discard_block(unsigned int index, unsigned int count);
+
+// 在镜像文件image上打开一个新的文件系统实例，返回实例序号，实例0是默认的"disk"，不需要打开
+int fs_attach(const char* image);
+
+// 写回并关闭实例，该实例的缓存和分配状态随之丢弃
+int fs_detach(int id);
+
+// 切换调用线程操作的实例，返回原来的实例序号；其他函数都作用于当前实例，每个线程开始时为实例0
+int fs_use(int id);
+
+// 调用线程当前操作的实例序号
+int fs_current();
+
+// 取得实例的镜像文件路径
+int fs_instance_path(int id, char* path, int size);
+
+// 选择持久化策略，SYNC_GROUP时interval_ms为后台写回的间隔
+int fs_set_durability(int mode, int interval_ms);
+
+// 返回当前的持久化策略，interval_ms不为NULL时取得写回间隔
+int fs_get_durability(int* interval_ms);
+
+// 写回所有脏块并fdatasync
+int fs_sync();
+
+// 一个操作开始，可以嵌套，返回值交给fs_op_end
+int fs_op_begin();
+
+// 一个操作结束，最外层的操作结束时按持久化策略写回开始时所在实例的脏块
+int fs_op_end(int op);
+
+// 取得持久化统计
+void fs_get_sync_stat(struct sync_stat* stat);
+
+// 设置当前实例的选项，options是FS_COMPRESS、FS_DEDUP和FS_CSUM_DATA的组合，每个镜像各自设置
+void fs_set_options(int options);
+
+// 返回当前实例的选项
+int fs_get_options();
+
+// 取得当前实例的压缩统计
+void fs_get_compress_stat(struct compress_stat* stat);
+
+// 取得当前实例的去重统计
+void fs_get_dedup_stat(struct dedup_stat* stat);
+
+// 取得当前实例的校验和统计
+void fs_get_csum_stat(struct csum_stat* stat);
+
 // block_map置位
 void bmap_set(unsigned int bit, struct superblock* ptr_spblock);
 
@@ -80,6 +207,18 @@ int bmap_lookup(struct superblock* ptr_spblock);
 // 寻找空余数据块
 int imap_lookup(struct superblock* ptr_spblock);
 
+// 从goal开始寻找连续count个空余数据块，返回第一个的序号
+int bmap_lookup_run(struct superblock* ptr_spblock, int count, int goal);
+
+// 寻找离goal最近的空余数据块
+int bmap_lookup_near(struct superblock* ptr_spblock, int goal);
+
+// 寻找空余inode，优先与goal位于同一inode表块，其次离goal最近
+int imap_lookup_near(struct superblock* ptr_spblock, int goal);
+
+// 为新目录寻找空余inode，选择空闲inode最多的inode表块，使其子项有聚集的空间
+int imap_lookup_dir(struct superblock* ptr_spblock);
+
 // 文件系统是否存在
 int exists();
 
@@ -92,11 +231,23 @@ int rd_inode(int id, struct inode* dst);
 // 写标号为id的inode
 int wr_inode(int id, const struct inode* src);
 
-// 在一个目录数据块中查找某文件名对应的目录索引，返回的是该索引在该块中的位置
+// 批量读取count个inode，按inode表块排序后每块只读一次，dst[i]对应ids[i]
+int rd_inodes(const int* ids, int count, struct inode* dst);
+
+// 返回块内pos之后的目录项位置，pos为-1时返回第一个，没有则返回-1
+int dirent_next(struct dirblk* e, int pos);
+
+// 在一个目录数据块中查找某文件名对应的目录项，返回的是该目录项在该块中的位置
 int dirent_lookup(struct dirblk* e, const char* filename);
 
-// 在一个目录数据块中查找空闲的目录项，返回的是该目录项在该块中的位置
-int free_dirent_lookup(struct dirblk* e);
+// 在一个目录数据块中查找能容纳该长度文件名的空闲空间，返回的是该空间在该块中的位置
+int free_dirent_lookup(struct dirblk* e, int name_len);
+
+// 在pos处写入目录项，pos应由free_dirent_lookup得到
+void dirent_set(struct dirblk* e, int pos, int index, int type, const char* filename);
+
+// 删除pos处的目录项，并把其后的目录项前移以保持块内紧凑
+void dirent_remove(struct dirblk* e, int pos);
 
 // 创建文件
 int touch(int index_dir, const char* filename);
@@ -107,16 +258,89 @@ int mkdir(int index_dir, const char* dirname);
 // 读取字节
 int readbyte(int index, int position);
 
-// 在末尾追加字节
+// 在末尾追加字节，数据先缓存在内存中，直到fs_flush时才分配数据块
 int appendbyte(int index, char byte);
 
+// 在末尾追加count字节，buf为NULL时追加0，返回实际追加的字节数
+int fs_append(int index, const char* buf, int count);
+
 // 写入字节
 int writebyte(int index, int position, char byte);
 
 // 获取文件inode序号
 int openpath(const char* path);
 
+// 在目录中一次创建count个空文件：目录只扫描一遍，inode和数据块一次分配，目录块就地填好后一起提交；
+// 文件的inode序号存入indexes，返回创建的文件数，有名字已存在、重复或放不下时一个也不创建，返回-1
+int touch_bulk(int index_dir, const char* const* names, int count, int* indexes);
+
 // 复制文件内容
 int clone(int src_inodeno, int dst_inodeno);
 
+// 把目录src_dir中的src_name移到目录dst_dir中并改名为dst_name，只改动涉及的目录块，数据不动；
+// 移动目录时一并修改其".."，目录不能移到自己的子树中，dst_name已存在时失败
+int fs_rename(int src_dir, const char* src_name, int dst_dir, const char* dst_name);
+
+// 列出inode占用的不同物理数据块，按首次使用的顺序，返回块数
+int inode_blocks(const struct inode* ptr_inode, int* blocks);
+
+// 读取文件的第blockno个数据块，压缩的数据块读出时解压
+int rd_file_block(const struct inode* ptr_inode, int blockno, char* buf);
+
+// 在原地修改文件的第blockno个数据块之前调用，若该块与其他文件共享则为文件复制一份
+int unshare_block(int index, struct inode* ptr_inode, int blockno);
+
+// 为文件缓存的追加数据分配数据块并写回
+int fs_flush(int index);
+
+// 写回所有文件缓存的追加数据
+int fs_flush_all();
+
+// 把文件截断或扩展到size字节，截去的数据块一次性在位图中释放
+int fs_truncate(int index, int size);
+
+// 为文件预留到size字节的空间，新数据块一次性分配并清零
+int fs_fallocate(int index, int size);
+
+// 为刚创建的空文件分配容纳size字节的数据块但不写入，块号存入blocks，返回块数，数据由调用者写入
+int fs_reserve(int index, int size, int* blocks);
+
+// 把文件内容直接从镜像复制到文件描述符out_fd，不经过用户态缓冲区；数据块校验打开时经缓冲区读出并校验
+int fs_sendfile(int index, int out_fd);
+
+// 文件内容的一段只读视图，直接指向映射的磁盘镜像
+struct fs_view {
+    const char* data;
+    int len;
+};
+
+// 不经复制读取文件：文件每段物理上连续的数据块给出一个视图（条带化的磁盘上在条带单元边界处断开），
+// views至少要有N_DIRECT_PTR项，返回视图个数；视图用fs_unmap释放，持有期间碎片整理和压缩不移动该文件，
+// 写入、截断、删除该文件都会失败；视图中的数据不校验；压缩的文件和目录没有视图，返回-1
+int fs_map(int index, struct fs_view* views);
+
+// 释放fs_map给出的count个视图
+int fs_unmap(int index, struct fs_view* views, int count);
+
+// 文件有未释放的视图时返回1，这时写入、截断、删除该文件都返回-1
+int fs_viewed(int index);
+
+// 压缩文件：逐块压缩后紧凑存放在共享的数据块中，不能节省数据块时保持原样
+int fs_compress(int index);
+
+// 解压文件，恢复为每个数据块一个ptr的格式
+int fs_decompress(int index);
+
+// 统计文件的碎片并累加到stat，返回文件的段数，目录不统计，返回0
+int fs_frag(int index, struct frag_stat* stat);
+
+// 统计整个镜像中所有文件的碎片和空闲空间的分布，结果累加到stat
+int fs_frag_image(struct frag_stat* stat);
+
+// 把文件的数据块搬到一段连续的空间，ptr[]随一次inode写入全部更新，返回移动的块数，结果累加到stat
+int fs_defrag(int index, struct frag_stat* stat);
+
+// 删除目录中的文件或目录，被删除的inode和数据块一次性在位图中释放
+int rm(int index_dir, const char* filename, int mode);
+
 #endif
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "proto.h"
+
+#define N 1024
+
+char buffer[N];
+char input[FSD_MAX_DATA];
+
+// the lines after tee up to an empty line, or the answer to the prompt of format,
+// are sent along as the stdin of the command
+static int read_input(const char* cmd)
+{
+    int len = 0;
+    if (strncmp(cmd, "format", 6) == 0 && (cmd[6] == ' ' || cmd[6] == '\0'))
+    {
+        if (fgets(input, sizeof input, stdin) == NULL)
+            return 0;
+        return strlen(input);
+    }
+    if (strncmp(cmd, "tee", 3) != 0 || cmd[3] != ' ')
+        return 0;
+    while (len < sizeof input - N && fgets(input + len, N, stdin) != NULL)
+    {
+        len += strlen(input + len);
+        if (strcmp(input + len - 1, "\n") == 0 && (len == 1 || input[len - 2] == '\n'))
+            break;
+    }
+    return len;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = argc > 1 ? argv[1] : FSD_SOCKET;
+    struct fsd_resp resp;
+    static char output[FSD_MAX_DATA];
+    uint32_t id = 0;
+    int fd, len;
+    if ((fd = fsd_connect(path)) < 0)
+    {
+        fprintf(stderr, "fsc: connect to %s failed\n", path);
+        return 1;
+    }
+    for (;;)
+    {
+        printf("$ ");
+        fflush(stdout);
+        if (fgets(buffer, N, stdin) == NULL)
+            break;
+        buffer[strcspn(buffer, "\n")] = '\0';
+        if (strcmp(buffer, "exit") == 0)
+            break;
+        len = read_input(buffer);
+        if (fsd_send(fd, FSD_OP_EXEC, ++id, 0, buffer, input, len) < 0
+            || fsd_recv(fd, &resp, output, sizeof output) < 0)
+        {
+            fprintf(stderr, "fsc: connection lost\n");
+            return 1;
+        }
+        fwrite(output, 1, resp.data_len < sizeof output ? resp.data_len : sizeof output, stdout);
+    }
+    close(fd);
+    return 0;
+}
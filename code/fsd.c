@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio_ext.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs.h"
+#include "file.h"
+#include "commands.h"
+#include "proto.h"
+
+// requests handled under one hold of the locks
+#define BATCH (64)
+#define REQ_MAX (sizeof (struct fsd_req) + FSD_MAX_PATH + FSD_MAX_DATA)
+
+// reads and writes run one at a time on an instance, those of different instances side by side;
+// a command may switch to or detach any instance and takes over stdin and stdout, it runs alone
+static pthread_mutex_t fs_locks[FS_MAX_INSTANCE] = {
+    [0 ... FS_MAX_INSTANCE - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_rwlock_t exec_lock = PTHREAD_RWLOCK_INITIALIZER;
+// taken on the way into exec_lock, a command waiting for it keeps new reads and writes out
+static pthread_mutex_t exec_turn = PTHREAD_MUTEX_INITIALIZER;
+// exec() talks to stdin and stdout, they are pointed at these while a command runs
+static FILE* exec_in;
+static FILE* exec_out;
+
+// a connection buffers what has been received and the answers to send back
+struct conn {
+    int fd;
+    char* in;
+    int in_len;
+    char* out;
+    int out_len;
+    int out_cap;
+};
+
+static int out_reserve(struct conn* c, int n)
+{
+    char* p;
+    if (c->out_len + n <= c->out_cap)
+        return 0;
+    while (c->out_len + n > c->out_cap)
+        c->out_cap *= 2;
+    if ((p = realloc(c->out, c->out_cap)) == NULL)
+        return -1;
+    c->out = p;
+    return 0;
+}
+
+// run a command line with input as its stdin, its output is appended to c->out
+static int run_exec(struct conn* c, const char* cmd, const char* input, int input_len)
+{
+    int in_fd = fileno(exec_in), out_fd = fileno(exec_out);
+    int saved_in, saved_out;
+    off_t len;
+    size_t n = strcspn(cmd, " ");
+    // the server must not be taken down by a client
+    if (n == 4 && strncmp(cmd, "exit", 4) == 0)
+    {
+        const char* msg = "fsd: exit is not served\n";
+        if (out_reserve(c, strlen(msg)) < 0)
+            return -1;
+        memcpy(c->out + c->out_len, msg, strlen(msg));
+        c->out_len += strlen(msg);
+        return -1;
+    }
+    if (ftruncate(in_fd, 0) < 0 || pwrite(in_fd, input, input_len, 0) != input_len || ftruncate(out_fd, 0) < 0)
+        return -1;
+    lseek(in_fd, 0, SEEK_SET);
+    lseek(out_fd, 0, SEEK_SET);
+    fflush(stdout);
+    saved_in = dup(STDIN_FILENO);
+    saved_out = dup(STDOUT_FILENO);
+    dup2(in_fd, STDIN_FILENO);
+    dup2(out_fd, STDOUT_FILENO);
+    __fpurge(stdin);
+    clearerr(stdin);
+    exec(cmd);
+    fflush(stdout);
+    dup2(saved_in, STDIN_FILENO);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_in);
+    close(saved_out);
+    __fpurge(stdin);
+    clearerr(stdin);
+    if ((len = lseek(out_fd, 0, SEEK_END)) < 0 || out_reserve(c, len) < 0)
+        return -1;
+    if (pread(out_fd, c->out + c->out_len, len, 0) != len)
+        return -1;
+    c->out_len += len;
+    return 0;
+}
+
+static int run_read(struct conn* c, const char* path, uint32_t offset, uint32_t count)
+{
+    int fd, r = -1;
+    if (out_reserve(c, count) < 0)
+        return -1;
+    if ((fd = fs_open(path, FS_O_RDONLY)) < 0)
+        return -1;
+    if (fs_lseek(fd, offset, FS_SEEK_SET) >= 0)
+        r = fs_read(fd, c->out + c->out_len, count);
+    fs_close(fd);
+    if (r > 0)
+        c->out_len += r;
+    return r;
+}
+
+static int run_write(const char* path, uint32_t offset, const char* data, uint32_t count)
+{
+    int fd, r = -1;
+    if ((fd = fs_open(path, FS_O_WRONLY | FS_O_CREAT)) < 0)
+        return -1;
+    if (fs_lseek(fd, offset, FS_SEEK_SET) >= 0)
+        r = fs_write(fd, data, count);
+    if (fs_close(fd) < 0)
+        r = -1;
+    return r;
+}
+
+// handle one request, its answer is appended to c->out
+static int handle(struct conn* c, const struct fsd_req* req, const char* path, const char* data)
+{
+    struct fsd_resp resp = {req->id, -1, 0};
+    int head = c->out_len;
+    if (out_reserve(c, sizeof resp) < 0)
+        return -1;
+    c->out_len += sizeof resp;
+    if (req->op == FSD_OP_EXEC)
+        resp.status = run_exec(c, path, data, req->data_len);
+    else if (req->op == FSD_OP_READ)
+        resp.status = run_read(c, path, req->offset, req->data_len);
+    else if (req->op == FSD_OP_WRITE)
+        resp.status = run_write(path, req->offset, data, req->data_len);
+    resp.data_len = c->out_len - head - sizeof resp;
+    memcpy(c->out + head, &resp, sizeof resp);
+    return 0;
+}
+
+// length of the complete request at the head of buf, 0 if more is needed, -1 if it is malformed
+static int req_len(const char* buf, int len)
+{
+    struct fsd_req req;
+    if (len < sizeof req)
+        return 0;
+    memcpy(&req, buf, sizeof req);
+    if (req.path_len > FSD_MAX_PATH || req.data_len > FSD_MAX_DATA)
+        return -1;
+    int n = sizeof req + req.path_len + (req.op == FSD_OP_READ ? 0 : req.data_len);
+    return len < n ? 0 : n;
+}
+
+static void* serve(void* arg)
+{
+    struct conn c = {.fd = (intptr_t) arg, .out_cap = 65536};
+    char path[FSD_MAX_PATH + 1];
+    struct fsd_req req;
+    ssize_t r;
+    int pos, n, batch, exclusive, instance = 0;
+    c.in = malloc(2 * REQ_MAX);
+    c.out = malloc(c.out_cap);
+    while (c.in != NULL && c.out != NULL && (r = read(c.fd, c.in + c.in_len, 2 * REQ_MAX - c.in_len)) > 0)
+    {
+        c.in_len += r;
+        // answer every complete request received so far in one go,
+        // a pipelining client gets them back with a single write
+        for (pos=0; (n = req_len(c.in + pos, c.in_len - pos)) > 0; )
+        {
+            memcpy(&req, c.in + pos, sizeof req);
+            // a batch is either commands or reads and writes on the instance the connection is on
+            exclusive = req.op == FSD_OP_EXEC;
+            pthread_mutex_lock(&exec_turn);
+            if (exclusive)
+                pthread_rwlock_wrlock(&exec_lock);
+            else
+                pthread_rwlock_rdlock(&exec_lock);
+            pthread_mutex_unlock(&exec_turn);
+            if (!exclusive)
+                pthread_mutex_lock(&fs_locks[instance = fs_current()]);
+            for (batch=0; batch<BATCH && (n = req_len(c.in + pos, c.in_len - pos)) > 0; ++batch, pos+=n)
+            {
+                memcpy(&req, c.in + pos, sizeof req);
+                if ((req.op == FSD_OP_EXEC) != exclusive)
+                    break;
+                memcpy(path, c.in + pos + sizeof req, req.path_len);
+                path[req.path_len] = '\0';
+                if (handle(&c, &req, path, c.in + pos + sizeof req + req.path_len) < 0)
+                    n = -1;
+                if (n < 0)
+                    break;
+            }
+            if (!exclusive)
+                pthread_mutex_unlock(&fs_locks[instance]);
+            pthread_rwlock_unlock(&exec_lock);
+            if (n < 0)
+                break;
+        }
+        if (n < 0 || write_full(c.fd, c.out, c.out_len) < 0)
+            break;
+        c.out_len = 0;
+        memmove(c.in, c.in + pos, c.in_len - pos);
+        c.in_len -= pos;
+    }
+    close(c.fd);
+    free(c.in);
+    free(c.out);
+    return NULL;
+}
+
+static void* accept_loop(void* arg)
+{
+    int sock = (intptr_t) arg;
+    int fd;
+    pthread_t tid;
+    for (;;)
+    {
+        if ((fd = accept(sock, NULL, NULL)) < 0)
+            continue;
+        if (pthread_create(&tid, NULL, serve, (void*) (intptr_t) fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = FSD_SOCKET;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char buf[FS_BLOCK_SIZE];
+    struct csum_stat csum_stat;
+    sigset_t set;
+    pthread_t tid;
+    int sock, sig, opt, members, unit;
+    // -d bypasses the host page cache, -S n[,unit] stripes the disk over n image files
+    while ((opt = getopt(argc, argv, "dS:")) != -1)
+    {
+        unit = DISK_STRIPE_UNIT;
+        if (opt == 'd')
+            disk_set_direct(1);
+        else if (opt != 'S' || sscanf(optarg, "%d,%d", &members, &unit) < 1 || disk_set_stripe(members, unit) < 0)
+        {
+            fprintf(stderr, "usage: fsd [-d] [-S members[,unit]] [socket]\n");
+            return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (fs_rd_block(0, buf) < 0)
+    {
+        fs_get_csum_stat(&csum_stat);
+        if (csum_stat.errors == 0)
+        {
+            fprintf(stderr, "fsd: open disk failed, is it used by another process?\n");
+            return 1;
+        }
+        fprintf(stderr, "fsd: the superblock does not match its checksum\n");
+    }
+    if (!exists())
+        fprintf(stderr, "fsd: no file system found on the disk, clients may format it\n");
+    if ((exec_in = tmpfile()) == NULL || (exec_out = tmpfile()) == NULL)
+    {
+        fprintf(stderr, "fsd: create temporary files failed\n");
+        return 1;
+    }
+    if (strlen(path) >= sizeof addr.sun_path)
+    {
+        fprintf(stderr, "fsd: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(sock, (struct sockaddr*) &addr, sizeof addr) < 0
+        || listen(sock, 64) < 0)
+    {
+        fprintf(stderr, "fsd: listen on %s failed\n", path);
+        return 1;
+    }
+    // the signals are taken by the main thread only, the others inherit the mask
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&tid, NULL, accept_loop, (void*) (intptr_t) sock) != 0)
+    {
+        fprintf(stderr, "fsd: create thread failed\n");
+        return 1;
+    }
+    fprintf(stderr, "fsd: serving on %s\n", path);
+    sigwait(&set, &sig);
+    // no request is running once the lock is held, the exit handlers flush the caches
+    pthread_mutex_lock(&exec_turn);
+    pthread_rwlock_wrlock(&exec_lock);
+    unlink(path);
+    fprintf(stderr, "fsd: shut down\n");
+    exit(0);
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "fs.h"
+#include "file.h"
+#include "capture.h"
+
+#define MAX_DIR (256)
+#define MAX_FILE (900)
+#define MAX_PATH_LEN (256)
+
+static FILE* out;
+static uint64_t now_ns, prev_ns;
+static double interarrival;
+
+static double uniform()
+{
+    return (rand() + 1.0) / (RAND_MAX + 2.0);
+}
+
+// requests arrive as a Poisson process
+static void emit(struct capture_rec* rec)
+{
+    now_ns += -log(uniform()) * interarrival;
+    rec->start = now_ns;
+    if (capture_write(out, rec, prev_ns) < 0)
+    {
+        fprintf(stderr, "fsgen: write failed\n");
+        exit(1);
+    }
+    prev_ns = now_ns;
+}
+
+static void emit_exec(const char* fmt, const char* arg)
+{
+    char cmd[MAX_PATH_LEN + 16];
+    snprintf(cmd, sizeof cmd, fmt, arg);
+    emit(&(struct capture_rec) {.kind = CAP_EXEC, .str = cmd, .str_len = strlen(cmd)});
+}
+
+// file sizes are log-normal around the median, as measured on most file systems
+static int file_size(double median)
+{
+    double z = sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+    double size = median * exp(1.2 * z);
+    return size > FS_BLOCK_SIZE * N_DIRECT_PTR ? FS_BLOCK_SIZE * N_DIRECT_PTR : (int) size;
+}
+
+// text made of a small vocabulary, so that compression and dedup see realistic data
+static void fill(char* buf, int len)
+{
+    static const char* const words[] = {"alpha ", "block ", "cache ", "disk ", "entry ", "file ", "inode ", "log\n"};
+    for (int i=0; i<len; )
+        for (const char* w = words[rand() % 8]; *w && i<len; )
+            buf[i++] = *w++;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: fsgen -o <trace> [-d dirs] [-f files] [-s median file size] [-r reads] "
+            "[-i mean interarrival us] [-S seed]\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    static char dirs[MAX_DIR][MAX_PATH_LEN];
+    static char files[MAX_FILE][MAX_PATH_LEN];
+    static int sizes[MAX_FILE];
+    static char data[FS_BLOCK_SIZE];
+    const char* arg;
+    const char* path = NULL;
+    int ndir = 20, nfile = 200, nread = 400, seed = 1, opt, i, size, n;
+    double median = 2048;
+    interarrival = 100e3;
+    while ((opt = getopt(argc, argv, "o:d:f:s:r:i:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o': path = optarg; break;
+        case 'd': ndir = atoi(optarg); break;
+        case 'f': nfile = atoi(optarg); break;
+        case 's': median = atof(optarg); break;
+        case 'r': nread = atoi(optarg); break;
+        case 'i': interarrival = atof(optarg) * 1000; break;
+        case 'S': seed = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (path == NULL || ndir < 0 || ndir >= MAX_DIR || nfile < 1 || nfile > MAX_FILE || median <= 0)
+        usage();
+    if ((out = fopen(path, "wb")) == NULL || capture_write_header(out) < 0)
+    {
+        fprintf(stderr, "fsgen: open %s failed\n", path);
+        return 1;
+    }
+    srand(seed);
+    // every new directory hangs below a random existing one, which gives the
+    // shallow and bushy trees of real systems
+    strcpy(dirs[0], "");
+    for (i=1; i<=ndir; ++i)
+    {
+        snprintf(dirs[i], MAX_PATH_LEN, "%.200s/d%d", dirs[rand() % i], i);
+        emit_exec("mkdir %s", dirs[i]);
+    }
+    // files are written in 4 KiB pieces through the fd API
+    for (i=0; i<nfile; ++i)
+    {
+        snprintf(files[i], MAX_PATH_LEN, "%.200s/f%d", dirs[rand() % (ndir + 1)], i);
+        emit(&(struct capture_rec) {.kind = CAP_OPEN, .arg = FS_O_WRONLY | FS_O_CREAT, .str = files[i],
+                                    .str_len = strlen(files[i])});
+        sizes[i] = file_size(median);
+        for (size=sizes[i]; size>0; size-=n)
+        {
+            n = size < FS_BLOCK_SIZE ? size : FS_BLOCK_SIZE;
+            fill(data, n);
+            emit(&(struct capture_rec) {.kind = CAP_WRITE, .data = data, .data_len = n, .result = n});
+        }
+        emit(&(struct capture_rec) {.kind = CAP_CLOSE});
+    }
+    // reads favour a few hot files
+    for (i=0; i<nread; ++i)
+    {
+        int f = (int) (nfile * pow(uniform(), 3));
+        if (rand() % 8 == 0)
+        {
+            arg = rand() % 2 ? files[f] : dirs[rand() % (ndir + 1)];
+            emit_exec(rand() % 2 ? "stat %s" : "ls -l %s", *arg ? arg : "/");
+            continue;
+        }
+        emit(&(struct capture_rec) {.kind = CAP_OPEN, .arg = FS_O_RDONLY, .str = files[f], .str_len = strlen(files[f])});
+        // read to the end, the last read returns 0
+        for (size=sizes[f]; ; size-=n)
+        {
+            n = size < FS_BLOCK_SIZE ? size : FS_BLOCK_SIZE;
+            emit(&(struct capture_rec) {.kind = CAP_READ, .arg = FS_BLOCK_SIZE, .result = n});
+            if (n == 0)
+                break;
+        }
+        emit(&(struct capture_rec) {.kind = CAP_CLOSE});
+    }
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "fsgen: write %s failed\n", path);
+        return 1;
+    }
+    return 0;
+}
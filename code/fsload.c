@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "proto.h"
+
+#define IO_SIZE (4096)
+#define FILE_SIZE (4 * IO_SIZE)
+#define MAX_CLIENT (64)
+#define MAX_DEPTH (256)
+
+static const char* sock_path;
+static int requests;
+static int depth;
+
+struct client {
+    int no;
+    int done;
+    double latency;   // sum of the request latencies in seconds
+    long bytes;
+    int failed;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keep up to depth requests in flight, a mix of 4 KiB reads and writes and a few commands
+static void* run_client(void* arg)
+{
+    struct client* c = arg;
+    char path[64], cmd[80];
+    char buf[IO_SIZE];
+    double sent[MAX_DEPTH];
+    struct fsd_resp resp;
+    unsigned int seed = c->no;
+    int fd, sent_cnt = 0, op;
+    sprintf(path, "/load%d", c->no);
+    sprintf(cmd, "stat %s", path);
+    memset(buf, 'a' + c->no % 26, sizeof buf);
+    if ((fd = fsd_connect(sock_path)) < 0)
+    {
+        c->failed = 1;
+        return NULL;
+    }
+    while (c->done < requests)
+    {
+        while (sent_cnt < requests && sent_cnt - c->done < depth)
+        {
+            op = rand_r(&seed) % 16;
+            sent[sent_cnt % depth] = now();
+            if (op == 0)
+                fsd_send(fd, FSD_OP_EXEC, sent_cnt, 0, cmd, NULL, 0);
+            else
+                fsd_send(fd, op % 2 ? FSD_OP_READ : FSD_OP_WRITE, sent_cnt,
+                         rand_r(&seed) % (FILE_SIZE / IO_SIZE) * IO_SIZE, path, buf, IO_SIZE);
+            ++sent_cnt;
+        }
+        if (fsd_recv(fd, &resp, buf, sizeof buf) < 0 || resp.id != c->done)
+        {
+            c->failed = 1;
+            break;
+        }
+        c->latency += now() - sent[resp.id % depth];
+        if (resp.status > 0)
+            c->bytes += resp.status;
+        ++c->done;
+    }
+    close(fd);
+    return NULL;
+}
+
+// create the file of every client and fill it up
+static int setup(int nclient)
+{
+    char path[64], cmd[80];
+    static char data[FILE_SIZE];
+    struct fsd_resp resp;
+    int fd;
+    if ((fd = fsd_connect(sock_path)) < 0)
+        return -1;
+    for (int i=0; i<nclient; ++i)
+    {
+        sprintf(path, "/load%d", i);
+        sprintf(cmd, "touch %s", path);
+        if (fsd_send(fd, FSD_OP_EXEC, 0, 0, cmd, NULL, 0) < 0 || fsd_recv(fd, &resp, NULL, 0) < 0
+            || fsd_send(fd, FSD_OP_WRITE, 0, 0, path, data, sizeof data) < 0
+            || fsd_recv(fd, &resp, NULL, 0) < 0 || resp.status != sizeof data)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static struct client clients[MAX_CLIENT];
+    pthread_t tids[MAX_CLIENT];
+    int max_client;
+    sock_path = argc > 1 ? argv[1] : FSD_SOCKET;
+    max_client = argc > 2 ? atoi(argv[2]) : 8;
+    requests = argc > 3 ? atoi(argv[3]) : 2000;
+    depth = argc > 4 ? atoi(argv[4]) : 16;
+    if (max_client < 1 || max_client > MAX_CLIENT || requests < 1 || depth < 1 || depth > MAX_DEPTH)
+    {
+        fprintf(stderr, "usage: fsload [socket] [clients 1-%d] [requests per client] [pipeline depth 1-%d]\n",
+                MAX_CLIENT, MAX_DEPTH);
+        return 1;
+    }
+    if (setup(max_client) < 0)
+    {
+        fprintf(stderr, "fsload: prepare files through %s failed\n", sock_path);
+        return 1;
+    }
+    printf("%8s %12s %10s %12s\n", "clients", "requests/s", "MiB/s", "latency(us)");
+    for (int n=1; ; n = n * 2 < max_client ? n * 2 : max_client)
+    {
+        double start, elapsed, latency = 0;
+        long bytes = 0, done = 0;
+        memset(clients, 0, sizeof clients);
+        start = now();
+        for (int i=0; i<n; ++i)
+        {
+            clients[i].no = i;
+            pthread_create(&tids[i], NULL, run_client, &clients[i]);
+        }
+        for (int i=0; i<n; ++i)
+        {
+            pthread_join(tids[i], NULL);
+            if (clients[i].failed)
+                fprintf(stderr, "fsload: client %d failed\n", i);
+            latency += clients[i].latency;
+            bytes += clients[i].bytes;
+            done += clients[i].done;
+        }
+        elapsed = now() - start;
+        printf("%8d %12.0f %10.2f %12.1f\n", n, done / elapsed, bytes / elapsed / (1 << 20),
+               done > 0 ? latency / done * 1e6 : 0);
+        if (n == max_client)
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio_ext.h>
+#include "fs.h"
+#include "file.h"
+#include "commands.h"
+#include "capture.h"
+#include "trace.h"
+
+#define REC_BUF (2 * FS_BLOCK_SIZE * N_DIRECT_PTR)
+#define N_KIND (CAP_CLOSE + 1)
+
+static const char* const kind_name[N_KIND] = {"", "exec", "open", "read", "write", "lseek", "close"};
+
+// latencies of one kind of record, in the trace and in the replay
+struct kind_stat {
+    int count;
+    int cap;
+    uint64_t* lat;
+    uint64_t orig_sum;
+    int mismatch;
+};
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void add_lat(struct kind_stat* k, uint64_t lat, uint64_t orig)
+{
+    if (k->count == k->cap)
+    {
+        k->cap = k->cap ? k->cap * 2 : 1024;
+        k->lat = realloc(k->lat, k->cap * sizeof (uint64_t));
+    }
+    k->lat[k->count++] = lat;
+    k->orig_sum += orig;
+}
+
+// run a command with its recorded input as stdin and its output thrown away
+static void replay_exec(const char* cmd, const char* input, int len, FILE* in, int null_fd)
+{
+    int saved_in = dup(STDIN_FILENO), saved_out = dup(STDOUT_FILENO);
+    ftruncate(fileno(in), 0);
+    pwrite(fileno(in), input, len, 0);
+    lseek(fileno(in), 0, SEEK_SET);
+    fflush(stdout);
+    dup2(fileno(in), STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    __fpurge(stdin);
+    clearerr(stdin);
+    exec(cmd);
+    fflush(stdout);
+    dup2(saved_in, STDIN_FILENO);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_in);
+    close(saved_out);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: fsreplay [-p] [-k] [-d] [-S members[,unit]] [-s none|op|group] <trace>\n"
+            "  -p  keep the pacing of the trace instead of replaying as fast as possible\n"
+            "  -k  replay on the existing image instead of formatting a fresh one\n"
+            "  -d  open the image with direct I/O\n"
+            "  -S  stripe the image over several files, the unit defaults to %d bytes\n"
+            "  -s  durability mode, group syncs every %d ms\n", DISK_STRIPE_UNIT, SYNC_INTERVAL);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    static char buf[REC_BUF];
+    static char data[FS_BLOCK_SIZE * N_DIRECT_PTR];
+    static struct kind_stat stats[N_KIND];
+    int fds[N_OPEN_FILE];
+    struct capture_rec rec;
+    uint64_t prev = 0, t0, first = 0, begin, lat;
+    int paced = 0, keep = 0, mode = SYNC_NONE, opt, r, total = 0, null_fd, fd, members, unit;
+    struct sync_stat sync_stat;
+    struct csum_stat csum_stat;
+    FILE* fp;
+    FILE* in;
+    while ((opt = getopt(argc, argv, "pkdS:s:")) != -1)
+    {
+        if (opt == 'p')
+            paced = 1;
+        else if (opt == 'k')
+            keep = 1;
+        else if (opt == 'd')
+            disk_set_direct(1);
+        else if (opt == 'S')
+        {
+            unit = DISK_STRIPE_UNIT;
+            if (sscanf(optarg, "%d,%d", &members, &unit) < 1 || disk_set_stripe(members, unit) < 0)
+                usage();
+        }
+        else if (opt == 's')
+        {
+            for (mode=SYNC_NONE; mode<=SYNC_GROUP && strcmp(optarg, durability_name[mode]) != 0; ++mode)
+                ;
+            if (mode > SYNC_GROUP)
+                usage();
+        }
+        else
+            usage();
+    }
+    if (optind != argc - 1)
+        usage();
+    if ((fp = fopen(argv[optind], "rb")) == NULL || capture_read_header(fp) < 0)
+    {
+        fprintf(stderr, "fsreplay: %s is not a capture\n", argv[optind]);
+        return 1;
+    }
+    r = fs_rd_block(0, buf);
+    fs_get_csum_stat(&csum_stat);
+    if (r < 0 && (keep || csum_stat.errors == 0))
+    {
+        if (csum_stat.errors > 0)
+            fprintf(stderr, "fsreplay: the superblock does not match its checksum\n");
+        else
+            fprintf(stderr, "fsreplay: open disk failed, is it used by another process?\n");
+        return 1;
+    }
+    if (!keep && format() < 0)
+    {
+        fprintf(stderr, "fsreplay: format failed\n");
+        return 1;
+    }
+    if (fs_set_durability(mode, SYNC_INTERVAL) < 0)
+    {
+        fprintf(stderr, "fsreplay: set durability mode failed\n");
+        return 1;
+    }
+    if ((in = tmpfile()) == NULL || (null_fd = open("/dev/null", O_WRONLY)) < 0)
+        return 1;
+    for (int i=0; i<N_OPEN_FILE; ++i)
+        fds[i] = -1;
+    t0 = trace_now();
+    while ((r = capture_read(fp, &rec, prev, buf, sizeof buf)) > 0)
+    {
+        if (total == 0)
+            first = rec.start;
+        prev = rec.start;
+        // wait until the record is due
+        if (paced)
+        {
+            uint64_t due = t0 + (rec.start - first), now = trace_now();
+            if (due > now)
+                nanosleep(&(struct timespec) {(due - now) / 1000000000, (due - now) % 1000000000}, NULL);
+        }
+        fd = rec.fd >= 0 && rec.fd < N_OPEN_FILE ? fds[rec.fd] : -1;
+        begin = trace_now();
+        switch (rec.kind)
+        {
+        case CAP_EXEC:
+            replay_exec(rec.str, rec.data, rec.data_len, in, null_fd);
+            r = rec.result;
+            break;
+        case CAP_OPEN:
+            r = fs_open(rec.str, rec.arg);
+            if (rec.result >= 0 && rec.result < N_OPEN_FILE)
+                fds[rec.result] = r;
+            r = r >= 0 ? rec.result : r;
+            break;
+        case CAP_READ:
+            r = fs_read(fd, data, rec.arg < sizeof data ? rec.arg : sizeof data);
+            break;
+        case CAP_WRITE:
+            r = fs_write(fd, rec.data, rec.data_len);
+            break;
+        case CAP_LSEEK:
+            r = fs_lseek(fd, rec.offset, rec.arg);
+            break;
+        case CAP_CLOSE:
+            r = fs_close(fd);
+            if (rec.fd >= 0 && rec.fd < N_OPEN_FILE)
+                fds[rec.fd] = -1;
+            break;
+        }
+        lat = trace_now() - begin;
+        add_lat(&stats[rec.kind], lat, rec.dur);
+        // a different result means the replay went another way than the original
+        if (r != rec.result)
+            stats[rec.kind].mismatch++;
+        ++total;
+    }
+    if (r < 0)
+        fprintf(stderr, "fsreplay: trace is damaged after %d records\n", total);
+    double elapsed = (trace_now() - t0) / 1e9;
+    fs_flush_all();
+    printf("%d records in %.3f s, %.0f records/s%s\n", total, elapsed, elapsed > 0 ? total / elapsed : 0.0,
+           paced ? " (paced)" : "");
+    fs_get_sync_stat(&sync_stat);
+    printf("durability %s: %ld fdatasyncs, %ld blocks written back, %.3f ms in fdatasync\n", durability_name[mode],
+           sync_stat.syncs, sync_stat.blocks, sync_stat.sync_ns / 1e6);
+    printf("%-6s %8s %10s %10s %10s %10s %12s %9s\n", "kind", "count", "mean(us)", "p50", "p99", "max",
+           "traced mean", "mismatch");
+    for (int k=1; k<N_KIND; ++k)
+    {
+        struct kind_stat* s = &stats[k];
+        uint64_t sum = 0;
+        if (s->count == 0)
+            continue;
+        qsort(s->lat, s->count, sizeof (uint64_t), cmp_u64);
+        for (int i=0; i<s->count; ++i)
+            sum += s->lat[i];
+        printf("%-6s %8d %10.1f %10.1f %10.1f %10.1f %12.1f %9d\n", kind_name[k], s->count,
+               sum / 1000.0 / s->count, s->lat[s->count / 2] / 1000.0, s->lat[s->count * 99 / 100] / 1000.0,
+               s->lat[s->count - 1] / 1000.0, s->orig_sum / 1000.0 / s->count, s->mismatch);
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// A sequence is a token byte, the literals and a match:
+// token high 4 bits = literal count, low 4 bits = match length - LZ_MIN_MATCH,
+// a nibble of 15 is continued by bytes that are added up until one is not 255,
+// the match is a 2-byte little endian offset followed by the match length bytes.
+// The last sequence carries literals only and ends the input.
+
+static uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static int put_length(unsigned char* dst, int cap, int* op, int n)
+{
+    for (; n >= 255; n -= 255)
+    {
+        if (*op >= cap)
+            return -1;
+        dst[(*op)++] = 255;
+    }
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = n;
+    return 0;
+}
+
+// emit one sequence, offset 0 means literals only
+static int put_sequence(unsigned char* dst, int cap, int* op,
+                        const unsigned char* lit, int nlit, int offset, int mlen)
+{
+    int m = offset ? mlen - LZ_MIN_MATCH : 0;
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15 && put_length(dst, cap, op, nlit - 15) < 0)
+        return -1;
+    if (*op + nlit > cap)
+        return -1;
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+    if (offset == 0)
+        return 0;
+    if (*op + 2 > cap)
+        return -1;
+    dst[(*op)++] = offset & 0xff;
+    dst[(*op)++] = offset >> 8;
+    if (m >= 15 && put_length(dst, cap, op, m - 15) < 0)
+        return -1;
+    return 0;
+}
+
+int lz_compress(const char* src, int len, char* dst, int cap)
+{
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+    memset(table, 0xff, sizeof table);
+    while (ip + LZ_MIN_MATCH <= len)
+    {
+        uint32_t seq = read32(in + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > 0xffff || read32(in + ref) != seq)
+        {
+            ++ip;
+            continue;
+        }
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len && in[ref + mlen] == in[ip + mlen])
+            ++mlen;
+        if (put_sequence(out, cap, &op, in + anchor, ip - anchor, ip - ref, mlen) < 0)
+            return -1;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (put_sequence(out, cap, &op, in + anchor, len - anchor, 0, 0) < 0)
+        return -1;
+    return op;
+}
+
+static int get_length(const unsigned char* src, int len, int* ip, int* n)
+{
+    unsigned char b;
+    do
+    {
+        if (*ip >= len)
+            return -1;
+        b = src[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const char* src, int len, char* dst, int cap)
+{
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    int ip = 0, op = 0;
+    while (ip < len)
+    {
+        int token = in[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15 && get_length(in, len, &ip, &nlit) < 0)
+            return -1;
+        if (ip + nlit > len || op + nlit > cap)
+            return -1;
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == len)
+            break;
+        if (ip + 2 > len)
+            return -1;
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && get_length(in, len, &ip, &mlen) < 0)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + mlen > cap)
+            return -1;
+        // byte by byte, the match may overlap the output
+        for (int i=0; i<mlen; ++i, ++op)
+            out[op] = out[op - offset];
+    }
+    return op;
+}
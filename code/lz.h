@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+#define LZ_HASH_BITS (12)
+#define LZ_MIN_MATCH (4)
+
+// 压缩src中的len字节到dst，返回压缩后的长度，dst空间不足cap时返回-1
+int lz_compress(const char* src, int len, char* dst, int cap);
+
+// 解压src中的len字节到dst，返回解压后的长度，数据损坏或dst空间不足cap时返回-1
+int lz_decompress(const char* src, int len, char* dst, int cap);
+
+#endif
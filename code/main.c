@@ -1,17 +1,48 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "fs.h"
+#include "disk.h"
 #include "commands.h"
 
 #define N 1024
 
 char buffer[N];
 
-int main()
+int main(int argc, char* argv[])
 {
     char ch;
     char filename[3] = "00";
     char* ret;
+    static char block[FS_BLOCK_SIZE];
+    struct csum_stat csum_stat;
+    int members, unit;
+    // -d bypasses the host page cache, -S n[,unit] stripes the disk over n image files
+    for (int i=1; i<argc; ++i)
+    {
+        unit = DISK_STRIPE_UNIT;
+        if (strcmp(argv[i], "-d") == 0)
+            disk_set_direct(1);
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc && sscanf(argv[++i], "%d,%d", &members, &unit) >= 1
+                 && disk_set_stripe(members, unit) == 0)
+            ;
+        else
+        {
+            printf("usage: %s [-d] [-S members[,unit]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (fs_rd_block(0, block) < 0)
+    {
+        // a superblock that does not match its checksum can still be formatted over
+        fs_get_csum_stat(&csum_stat);
+        if (csum_stat.errors == 0)
+        {
+            puts("Cannot open the disk, it may be used by another process.");
+            return 1;
+        }
+        puts("The superblock of your disk is corrupted, it does not match its checksum.");
+    }
     if (!exists())
     {
         printf("No file system found on your disk. Do you want to create one? (1 for yes)");
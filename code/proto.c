@@ -0,0 +1,78 @@
+#include "proto.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int read_full(int fd, void* buf, int n)
+{
+    char* p = buf;
+    ssize_t r;
+    while (n > 0)
+    {
+        if ((r = read(fd, p, n)) <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void* buf, int n)
+{
+    const char* p = buf;
+    ssize_t r;
+    while (n > 0)
+    {
+        if ((r = write(fd, p, n)) <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int fsd_connect(const char* path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+    if (strlen(path) >= sizeof addr.sun_path)
+        return -1;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof addr) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int fsd_send(int fd, uint32_t op, uint32_t id, uint32_t offset,
+             const char* path, const char* data, uint32_t data_len)
+{
+    struct fsd_req req = {op, id, offset, strlen(path), data_len};
+    if (write_full(fd, &req, sizeof req) < 0 || write_full(fd, path, req.path_len) < 0)
+        return -1;
+    // a read request only carries the length it asks for
+    if (op != FSD_OP_READ && write_full(fd, data, data_len) < 0)
+        return -1;
+    return 0;
+}
+
+int fsd_recv(int fd, struct fsd_resp* resp, char* buf, uint32_t cap)
+{
+    char discard[4096];
+    uint32_t n;
+    if (read_full(fd, resp, sizeof *resp) < 0)
+        return -1;
+    n = resp->data_len < cap ? resp->data_len : cap;
+    if (read_full(fd, buf, n) < 0)
+        return -1;
+    for (n=resp->data_len-n; n>0; n-=n<sizeof discard?n:sizeof discard)
+        if (read_full(fd, discard, n < sizeof discard ? n : sizeof discard) < 0)
+            return -1;
+    return 0;
+}
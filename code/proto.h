@@ -0,0 +1,47 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+#define FSD_SOCKET "fsd.sock" // 默认的套接字路径，位于当前目录
+
+#define FSD_OP_EXEC (1)  // 执行一条命令，path为命令行，data作为命令的标准输入，返回命令的输出
+#define FSD_OP_READ (2)  // 从path的offset处读取至多data_len字节
+#define FSD_OP_WRITE (3) // 把data写到path的offset处
+
+#define FSD_MAX_PATH (1024)
+#define FSD_MAX_DATA (1 << 20)
+
+// 请求头，后面跟着path_len字节的路径和data_len字节的数据（读请求没有数据）
+struct fsd_req {
+    uint32_t op;
+    uint32_t id;       // 由客户端指定，原样放在应答中，客户端可以连续发送多个请求而不等待应答
+    uint32_t offset;
+    uint32_t path_len;
+    uint32_t data_len;
+};
+
+// 应答头，后面跟着data_len字节的数据，同一连接上的应答按请求的顺序返回
+struct fsd_resp {
+    uint32_t id;
+    int32_t status;    // 读写的字节数，失败为-1
+    uint32_t data_len;
+};
+
+// 读满n字节，返回0，连接关闭或出错返回-1
+int read_full(int fd, void* buf, int n);
+
+// 写满n字节，返回0，出错返回-1
+int write_full(int fd, const void* buf, int n);
+
+// 连接到path处的服务器，返回套接字，失败返回-1
+int fsd_connect(const char* path);
+
+// 发送一个请求
+int fsd_send(int fd, uint32_t op, uint32_t id, uint32_t offset,
+             const char* path, const char* data, uint32_t data_len);
+
+// 接收一个应答，数据存入buf（至多cap字节，多余的丢弃），返回0，出错返回-1
+int fsd_recv(int fd, struct fsd_resp* resp, char* buf, uint32_t cap);
+
+#endif
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define IMAGE "rmtest.img"
+
+static int failed = 0;
+
+static void check(int ok, const char* what)
+{
+    if (!ok)
+    {
+        printf("rmtest: %s\n", what);
+        failed = 1;
+    }
+}
+
+// removing a file in a subdirectory must only change that directory
+int main()
+{
+    int id, d, f, g;
+    unlink(IMAGE);
+    if ((id = fs_attach(IMAGE)) < 0)
+    {
+        puts("rmtest: attach failed");
+        return 1;
+    }
+    fs_use(id);
+    format();
+    d = mkdir(0, "d");
+    f = touch(d, "f");
+    g = touch(0, "g");
+    check(d >= 0 && f >= 0 && g >= 0, "create failed");
+    check(rm(d, "f", RM_FILE) == 0, "rm /d/f failed");
+    check(openpath("/d/f") < 0, "/d/f still there");
+    check(openpath("/d") == d, "/d lost");
+    check(openpath("/g") == g, "/g lost");
+    check(openpath("/d/..") == 0, "/d/.. wrong");
+    check(rm(0, "d", RM_DIR) == 0 && rm(0, "g", RM_FILE) == 0, "rm of the rest failed");
+    fs_use(0);
+    fs_detach(id);
+    unlink(IMAGE);
+    if (!failed)
+        puts("rmtest: ok");
+    return failed;
+}
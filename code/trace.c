@@ -0,0 +1,165 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int trace_enabled = 0;
+const char* const trace_op_name[TRACE_OP_COUNT] = {
+    "touch", "mkdir", "openpath", "clone", "rename", "read", "write", "block_read", "block_write", "block_discard", "sync", "defrag", "map"
+};
+
+// the tree walk records from several threads, the counters are updated atomically
+static struct trace_hist hists[TRACE_OP_COUNT];
+static struct trace_event events[TRACE_EVENTS];
+static uint64_t event_count;
+static uint16_t thread_count;
+static _Thread_local uint16_t tid;
+
+uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// small values get a bucket each, larger ones are split by their top bit
+// and the TRACE_SUB_BITS bits below it
+static int bucket_of(uint64_t v)
+{
+    int e;
+    if (v < (1 << TRACE_SUB_BITS))
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return (e - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS | (v >> (e - TRACE_SUB_BITS) & ((1 << TRACE_SUB_BITS) - 1));
+}
+
+// the highest value that falls into bucket b
+static uint64_t bucket_high(int b)
+{
+    int e, sub;
+    if (b < (1 << TRACE_SUB_BITS))
+        return b;
+    e = (b >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+    sub = b & ((1 << TRACE_SUB_BITS) - 1);
+    return ((uint64_t) 1 << e | (uint64_t) sub << (e - TRACE_SUB_BITS)) + ((uint64_t) 1 << (e - TRACE_SUB_BITS)) - 1;
+}
+
+void trace_record(int op, uint64_t start, int arg)
+{
+    struct trace_hist* h = &hists[op];
+    uint64_t d = trace_now() - start;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t slot;
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, d, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket_of(d)], 1, __ATOMIC_RELAXED);
+    while (d > max && !__atomic_compare_exchange_n(&h->max, &max, d, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if (tid == 0)
+        tid = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    slot = __atomic_fetch_add(&event_count, 1, __ATOMIC_RELAXED) % TRACE_EVENTS;
+    events[slot] = (struct trace_event) {start, d > UINT32_MAX ? UINT32_MAX : d, op, tid, arg};
+}
+
+uint64_t trace_percentile(const struct trace_hist* h, double p)
+{
+    uint64_t rank = h->count * p / 100, seen = 0;
+    if (h->count == 0)
+        return 0;
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (int b=0; b<TRACE_BUCKETS; ++b)
+    {
+        seen += h->buckets[b];
+        if (seen > rank)
+            return bucket_high(b) < h->max ? bucket_high(b) : h->max;
+    }
+    return h->max;
+}
+
+const struct trace_hist* trace_hist(int op)
+{
+    return &hists[op];
+}
+
+void trace_reset()
+{
+    memset(hists, 0, sizeof hists);
+    event_count = 0;
+}
+
+// the events still in the ring, oldest first
+static void ring_range(uint64_t* first, uint64_t* last)
+{
+    *last = event_count;
+    *first = *last > TRACE_EVENTS ? *last - TRACE_EVENTS : 0;
+}
+
+int trace_dump_json(const char* host_path)
+{
+    static const double pct[] = {50, 90, 99, 99.9};
+    static const char* const pct_name[] = {"p50", "p90", "p99", "p999"};
+    const struct trace_hist* h;
+    const struct trace_event* e;
+    uint64_t first, last, i;
+    FILE* fp;
+    if ((fp = fopen(host_path, "w")) == NULL)
+        return -1;
+    fputs("{\"histograms\": {", fp);
+    for (int op=0; op<TRACE_OP_COUNT; ++op)
+    {
+        h = &hists[op];
+        fprintf(fp, "%s\n  \"%s\": {\"count\": %llu, \"mean_ns\": %llu, \"max_ns\": %llu", op ? "," : "",
+                trace_op_name[op], (unsigned long long) h->count,
+                (unsigned long long) (h->count ? h->sum / h->count : 0), (unsigned long long) h->max);
+        for (int k=0; k<4; ++k)
+            fprintf(fp, ", \"%s_ns\": %llu", pct_name[k], (unsigned long long) trace_percentile(h, pct[k]));
+        // only the buckets in use, as [highest value, count]
+        fputs(", \"buckets\": [", fp);
+        for (int b=0, n=0; b<TRACE_BUCKETS; ++b)
+            if (h->buckets[b])
+                fprintf(fp, "%s[%llu, %llu]", n++ ? ", " : "", (unsigned long long) bucket_high(b),
+                        (unsigned long long) h->buckets[b]);
+        fputs("]}", fp);
+    }
+    fputs("\n},\n\"events\": [", fp);
+    ring_range(&first, &last);
+    for (i=first; i<last; ++i)
+    {
+        e = &events[i % TRACE_EVENTS];
+        fprintf(fp, "%s\n  {\"op\": \"%s\", \"start_ns\": %llu, \"dur_ns\": %u, \"tid\": %u, \"arg\": %d}",
+                i > first ? "," : "", trace_op_name[e->op], (unsigned long long) e->start, e->dur, e->tid, e->arg);
+    }
+    fputs("\n]}\n", fp);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+int trace_dump_chrome(const char* host_path)
+{
+    const struct trace_event* e;
+    uint64_t first, last, i, base;
+    FILE* fp;
+    if ((fp = fopen(host_path, "w")) == NULL)
+        return -1;
+    ring_range(&first, &last);
+    base = first < last ? events[first % TRACE_EVENTS].start : 0;
+    // complete events, time stamps in microseconds from the first event
+    fputs("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [", fp);
+    for (i=first; i<last; ++i)
+    {
+        e = &events[i % TRACE_EVENTS];
+        if (e->start < base)
+            base = e->start;
+    }
+    for (i=first; i<last; ++i)
+    {
+        e = &events[i % TRACE_EVENTS];
+        fprintf(fp, "%s\n  {\"name\": \"%s\", \"cat\": \"fs\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": 1, \"tid\": %u, \"args\": {\"arg\": %d}}",
+                i > first ? "," : "", trace_op_name[e->op], (e->start - base) / 1000.0, e->dur / 1000.0,
+                e->tid, e->arg);
+    }
+    fputs("\n]}\n", fp);
+    return fclose(fp) == 0 ? 0 : -1;
+}
@@ -0,0 +1,78 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// 被跟踪的操作
+enum trace_op {
+    TRACE_TOUCH,
+    TRACE_MKDIR,
+    TRACE_OPENPATH,
+    TRACE_CLONE,
+    TRACE_RENAME,
+    TRACE_READ,        // fs_read和fs_sendfile
+    TRACE_WRITE,       // fs_write
+    TRACE_BLOCK_READ,
+    TRACE_BLOCK_WRITE,
+    TRACE_BLOCK_DISCARD,
+    TRACE_SYNC,        // fdatasync
+    TRACE_DEFRAG,      // fs_defrag，每个文件一次
+    TRACE_MAP,         // fs_map
+    TRACE_OP_COUNT
+};
+
+#define TRACE_SUB_BITS (4)                 // 直方图每个2的幂区间再细分为16个桶，相对误差不超过1/16
+#define TRACE_BUCKETS (64 << TRACE_SUB_BITS)
+#define TRACE_EVENTS (1 << 16)             // 环形缓冲区中保留的最近事件数
+
+// 一条跟踪事件
+struct trace_event {
+    uint64_t start;   // 开始时间，纳秒
+    uint32_t dur;     // 耗时，纳秒
+    uint16_t op;
+    uint16_t tid;     // 线程编号
+    int32_t arg;      // 操作的参数或返回值，如块号、inode序号
+};
+
+// 一种操作的延迟直方图
+struct trace_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[TRACE_BUCKETS];
+};
+
+extern int trace_enabled;                  // 运行时开关
+extern const char* const trace_op_name[TRACE_OP_COUNT];
+
+// 单调时钟，纳秒
+uint64_t trace_now();
+
+// 记录一次从start开始到现在的操作
+void trace_record(int op, uint64_t start, int arg);
+
+// 直方图中第p百分位（0-100）的延迟，纳秒
+uint64_t trace_percentile(const struct trace_hist* h, double p);
+
+// 取得op的直方图
+const struct trace_hist* trace_hist(int op);
+
+// 清空直方图和环形缓冲区
+void trace_reset();
+
+// 把直方图和环形缓冲区中的事件以JSON格式写入文件
+int trace_dump_json(const char* host_path);
+
+// 把环形缓冲区中的事件以Chrome trace格式写入文件，可用chrome://tracing或Perfetto打开
+int trace_dump_chrome(const char* host_path);
+
+// 编译时定义FS_TRACE才会插入跟踪代码，否则以下宏展开为空，没有任何开销
+#ifdef FS_TRACE
+#define TRACE_BEGIN(var) uint64_t var = trace_enabled ? trace_now() : 0
+#define TRACE_END(op, var, arg) do { if (trace_enabled && (var) != 0) trace_record((op), (var), (arg)); } while (0)
+#else
+#define TRACE_BEGIN(var)
+#define TRACE_END(op, var, arg) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,490 @@
+#include "tree.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// a directory to be read, the blocks of its subtree are summed up in it
+struct task {
+    struct task* parent;
+    char* path;
+    int index;
+    int dst;             // the directory a copy goes to
+    atomic_long blocks;
+    atomic_int pending;  // the task itself and its unfinished subdirectories
+};
+
+// the owner takes tasks from the bottom, the other workers steal from the top
+struct deque {
+    pthread_mutex_t lock;
+    struct task** items;
+    int top, bottom, cap;
+};
+
+struct worker {
+    struct pool* pool;
+    int no;
+    struct deque deque;
+    // private buffers, so that reads need not take the lock
+    int itab_no;
+    char itab[FS_BLOCK_SIZE];
+    struct dirblk dir;
+    char data[FS_BLOCK_SIZE];
+    // entries found by this worker
+    struct tree_entry* entries;
+    int count, cap;
+};
+
+struct pool {
+    int nworker;
+    int instance;           // the workers run on the caller's file system instance
+    atomic_int outstanding; // tasks pushed and not done yet
+    atomic_int failed;
+    void (*run)(struct worker*, struct task*);
+    struct worker workers[TREE_MAX_WORKER];
+};
+
+// an entry of a directory and its inode
+struct child {
+    int index;
+    struct inode inode;
+    char name[MAX_NAME_LEN + 1];
+};
+
+// fs.c keeps shared state, everything that modifies the file system holds this lock
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int push(struct worker* w, struct task* t)
+{
+    struct deque* d = &w->deque;
+    struct task** items;
+    int n;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->cap)
+    {
+        n = d->cap ? d->cap * 2 : 64;
+        if ((items = malloc(n * sizeof *items)) == NULL)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        }
+        for (int i=0; i<d->bottom-d->top; ++i)
+            items[i] = d->items[(d->top + i) % d->cap];
+        free(d->items);
+        d->items = items;
+        d->bottom -= d->top;
+        d->top = 0;
+        d->cap = n;
+    }
+    atomic_fetch_add(&w->pool->outstanding, 1);
+    d->items[d->bottom++ % d->cap] = t;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+static struct task* take(struct deque* d, int steal)
+{
+    struct task* t = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+        t = steal ? d->items[d->top++ % d->cap] : d->items[--d->bottom % d->cap];
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+static void* work(void* arg)
+{
+    struct worker* w = arg;
+    struct pool* p = w->pool;
+    struct task* t;
+    int i;
+    fs_use(p->instance);
+    for (;;)
+    {
+        // own work first, depth first, then steal the oldest and biggest task of another worker
+        t = take(&w->deque, 0);
+        for (i=1; t==NULL && i<p->nworker; ++i)
+            t = take(&p->workers[(w->no + i) % p->nworker].deque, 1);
+        if (t != NULL)
+        {
+            p->run(w, t);
+            atomic_fetch_sub(&p->outstanding, 1);
+        }
+        else if (atomic_load(&p->outstanding) == 0)
+            break;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+// run the pool from the root task until no task is left, the workers are kept for their results
+static int run_pool(struct pool* p, void (*run)(struct worker*, struct task*), struct task* root)
+{
+    pthread_t tids[TREE_MAX_WORKER];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, n;
+    p->nworker = ncpu < 1 ? 1 : ncpu > TREE_MAX_WORKER ? TREE_MAX_WORKER : ncpu;
+    p->run = run;
+    p->instance = fs_current();
+    for (i=0; i<p->nworker; ++i)
+    {
+        p->workers[i].pool = p;
+        p->workers[i].no = i;
+        pthread_mutex_init(&p->workers[i].deque.lock, NULL);
+    }
+    // a root that cannot be queued is dropped, there is nothing to run
+    n = 0;
+    if (push(&p->workers[0], root) < 0)
+    {
+        atomic_store(&p->failed, 1);
+        free(root->path);
+        free(root);
+    }
+    else
+    {
+        for (n=0; n<p->nworker; ++n)
+            if (pthread_create(&tids[n], NULL, work, &p->workers[n]) != 0)
+                break;
+        // fewer threads still drain all deques
+        if (n == 0)
+            work(&p->workers[0]);
+    }
+    for (i=0; i<n; ++i)
+        pthread_join(tids[i], NULL);
+    for (i=0; i<p->nworker; ++i)
+    {
+        pthread_mutex_destroy(&p->workers[i].deque.lock);
+        free(p->workers[i].deque.items);
+    }
+    return atomic_load(&p->failed) ? -1 : 0;
+}
+
+static struct task* new_task(struct task* parent, char* path, int index, int dst)
+{
+    struct task* t = malloc(sizeof (struct task));
+    if (t == NULL)
+        return NULL;
+    t->parent = parent;
+    t->path = path;
+    t->index = index;
+    t->dst = dst;
+    atomic_init(&t->blocks, 0);
+    atomic_init(&t->pending, 1);
+    return t;
+}
+
+// read an inode through the worker's copy of its inode table block
+static int rd_inode_w(struct worker* w, int id, struct inode* dst)
+{
+    int no = id / INODE_PER_BLOCK + 1;
+    if (w->itab_no != no)
+    {
+        w->itab_no = -1;
+        if (fs_rd_block(no, w->itab) < 0)
+            return -1;
+        w->itab_no = no;
+    }
+    memcpy(dst, w->itab + id % INODE_PER_BLOCK * sizeof (struct inode), sizeof (struct inode));
+    return 0;
+}
+
+static int cmp_child(const void* a, const void* b)
+{
+    return ((const struct child*) a)->index - ((const struct child*) b)->index;
+}
+
+// read the entries of a directory and their inodes, the children are sorted by inode
+// so that every inode table block is read once
+static int read_dir(struct worker* w, int index, struct inode* dir, struct child** children)
+{
+    struct child* c = NULL;
+    struct child* p;
+    struct dirent* e;
+    int i, pos, n = 0, cap = 0;
+    w->itab_no = -1;
+    if (rd_inode_w(w, index, dir) < 0 || dir->type != TYPE_DIR)
+        return -1;
+    for (i=0; i<dir->size/FS_BLOCK_SIZE; ++i)
+    {
+        if (fs_rd_block(DATA_BEGIN + dir->ptr[i], (char*) &w->dir) < 0)
+            goto fail;
+        for (pos=dirent_next(&w->dir, -1); pos>=0; pos=dirent_next(&w->dir, pos))
+        {
+            e = DIRENT_AT(&w->dir, pos);
+            if (!e->valid || strcmp(e->name, curdir) == 0 || strcmp(e->name, prtdir) == 0)
+                continue;
+            if (n == cap)
+            {
+                cap = cap ? cap * 2 : 16;
+                if ((p = realloc(c, cap * sizeof (struct child))) == NULL)
+                    goto fail;
+                c = p;
+            }
+            c[n].index = e->index;
+            memcpy(c[n].name, e->name, e->name_len + 1);
+            ++n;
+        }
+    }
+    qsort(c, n, sizeof (struct child), cmp_child);
+    for (i=0; i<n; ++i)
+        if (rd_inode_w(w, c[i].index, &c[i].inode) < 0)
+            goto fail;
+    *children = c;
+    return n;
+fail:
+    free(c);
+    return -1;
+}
+
+static char* join(const char* dir, const char* name)
+{
+    int len = strlen(dir);
+    char* path = malloc(len + strlen(name) + 2);
+    if (path == NULL)
+        return NULL;
+    strcpy(path, dir);
+    if (len == 0 || dir[len - 1] != '/')
+        path[len++] = '/';
+    strcpy(path + len, name);
+    return path;
+}
+
+static int add_entry(struct worker* w, char* path, int index, int type, long blocks)
+{
+    struct tree_entry* p;
+    if (w->count == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        if ((p = realloc(w->entries, w->cap * sizeof (struct tree_entry))) == NULL)
+            return -1;
+        w->entries = p;
+    }
+    w->entries[w->count++] = (struct tree_entry) {path, index, type, blocks};
+    return 0;
+}
+
+// a directory is done when its subdirectories are, its total then goes to its parent
+static void finish(struct worker* w, struct task* t)
+{
+    struct task* parent;
+    while (t != NULL && atomic_fetch_sub(&t->pending, 1) == 1)
+    {
+        if (add_entry(w, t->path, t->index, TYPE_DIR, atomic_load(&t->blocks)) < 0)
+        {
+            atomic_store(&w->pool->failed, 1);
+            free(t->path);
+        }
+        parent = t->parent;
+        if (parent != NULL)
+            atomic_fetch_add(&parent->blocks, atomic_load(&t->blocks));
+        free(t);
+        t = parent;
+    }
+}
+
+static void walk_dir(struct worker* w, struct task* t)
+{
+    struct inode dir;
+    struct child* c = NULL;
+    struct task* sub;
+    int blocks[N_DIRECT_PTR];
+    int i, n, nblock;
+    char* path;
+    if ((n = read_dir(w, t->index, &dir, &c)) < 0)
+    {
+        atomic_store(&w->pool->failed, 1);
+        finish(w, t);
+        return;
+    }
+    atomic_fetch_add(&t->blocks, dir.size / FS_BLOCK_SIZE);
+    for (i=0; i<n; ++i)
+    {
+        if ((path = join(t->path, c[i].name)) == NULL)
+        {
+            atomic_store(&w->pool->failed, 1);
+            continue;
+        }
+        if (c[i].inode.type == TYPE_DIR)
+        {
+            atomic_fetch_add(&t->pending, 1);
+            if ((sub = new_task(t, path, c[i].index, -1)) == NULL || push(w, sub) < 0)
+            {
+                atomic_store(&w->pool->failed, 1);
+                free(path);
+                free(sub);
+                atomic_fetch_sub(&t->pending, 1);
+            }
+            continue;
+        }
+        nblock = inode_blocks(&c[i].inode, blocks);
+        atomic_fetch_add(&t->blocks, nblock);
+        if (add_entry(w, path, c[i].index, TYPE_FILE, nblock) < 0)
+        {
+            atomic_store(&w->pool->failed, 1);
+            free(path);
+        }
+    }
+    free(c);
+    finish(w, t);
+}
+
+static int cmp_entry(const void* a, const void* b)
+{
+    return strcmp(((const struct tree_entry*) a)->path, ((const struct tree_entry*) b)->path);
+}
+
+int tree_walk(const char* path, struct tree_entry** entries)
+{
+    struct pool* p;
+    struct task* root;
+    struct tree_entry* all = NULL;
+    char* root_path;
+    int i, k, r, index, count = 0;
+    if ((index = openpath(path)) < 0)
+        return -1;
+    // the walk reads the disk directly, nothing may be pending in memory
+    if (fs_flush_all() < 0)
+        return -1;
+    if ((p = calloc(1, sizeof (struct pool))) == NULL)
+        return -1;
+    if ((root_path = strdup(path)) == NULL || (root = new_task(NULL, root_path, index, -1)) == NULL)
+    {
+        free(root_path);
+        free(p);
+        return -1;
+    }
+    r = run_pool(p, walk_dir, root);
+    for (i=0; i<p->nworker; ++i)
+        count += p->workers[i].count;
+    if (r == 0 && (all = malloc(count * sizeof (struct tree_entry))) == NULL)
+        r = -1;
+    // gather the entries of all workers
+    for (i=0, k=0; i<p->nworker; ++i)
+    {
+        if (r == 0)
+            memcpy(all + k, p->workers[i].entries, p->workers[i].count * sizeof (struct tree_entry));
+        else
+            for (int j=0; j<p->workers[i].count; ++j)
+                free(p->workers[i].entries[j].path);
+        k += p->workers[i].count;
+        free(p->workers[i].entries);
+    }
+    free(p);
+    if (r < 0)
+        return -1;
+    qsort(all, count, sizeof (struct tree_entry), cmp_entry);
+    *entries = all;
+    return count;
+}
+
+void tree_free(struct tree_entry* entries, int count)
+{
+    for (int i=0; i<count; ++i)
+        free(entries[i].path);
+    free(entries);
+}
+
+// a file whose data is copied outside of the lock
+struct copy_job {
+    struct inode src;
+    int nblock;
+    int blocks[N_DIRECT_PTR];
+};
+
+static void copy_dir(struct worker* w, struct task* t)
+{
+    struct inode dir;
+    struct child* c = NULL;
+    struct copy_job* jobs = NULL;
+    struct task* sub;
+    int i, k, n, index, njob = 0;
+    if ((n = read_dir(w, t->index, &dir, &c)) < 0 || (n > 0 && (jobs = malloc(n * sizeof (struct copy_job))) == NULL))
+    {
+        atomic_store(&w->pool->failed, 1);
+        free(c);
+        free(t);
+        return;
+    }
+    // all entries of the directory are created under one hold of the lock
+    pthread_mutex_lock(&fs_lock);
+    for (i=0; i<n; ++i)
+    {
+        if (c[i].inode.type == TYPE_DIR)
+        {
+            if ((index = mkdir(t->dst, c[i].name)) < 0)
+                atomic_store(&w->pool->failed, 1);
+            else if ((sub = new_task(NULL, NULL, c[i].index, index)) == NULL || push(w, sub) < 0)
+            {
+                atomic_store(&w->pool->failed, 1);
+                free(sub);
+            }
+            continue;
+        }
+        if ((index = touch(t->dst, c[i].name)) < 0)
+        {
+            atomic_store(&w->pool->failed, 1);
+            continue;
+        }
+        // shared or packed blocks are left to clone, the rest only gets its blocks reserved here
+        if (fs_get_options() & FS_DEDUP || c[i].inode.compressed)
+        {
+            if (clone(c[i].index, index) < 0)
+                atomic_store(&w->pool->failed, 1);
+            continue;
+        }
+        if (c[i].inode.size == 0)
+            continue;
+        jobs[njob].src = c[i].inode;
+        if ((jobs[njob].nblock = fs_reserve(index, c[i].inode.size, jobs[njob].blocks)) < 0)
+            atomic_store(&w->pool->failed, 1);
+        else
+            ++njob;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    // the data is copied in parallel with the other workers
+    for (i=0; i<njob; ++i)
+        for (k=0; k<jobs[i].nblock; ++k)
+            if (fs_rd_block(DATA_BEGIN + jobs[i].src.ptr[k], w->data) < 0
+                || fs_wr_block(DATA_BEGIN + jobs[i].blocks[k], w->data) < 0)
+                atomic_store(&w->pool->failed, 1);
+    free(jobs);
+    free(c);
+    free(t);
+}
+
+int tree_copy(const char* src, const char* dst)
+{
+    struct pool* p;
+    struct task* root;
+    struct inode inode_buf;
+    char prtdir[256];
+    const char* name = strrchr(dst, '/');
+    int src_index, dir, index, r, len = strlen(src);
+    if (name == NULL || name[1] == '\0' || name - dst + 1 >= sizeof prtdir)
+        return -1;
+    // a directory cannot be copied into itself
+    if (strncmp(dst, src, len) == 0 && (dst[len] == '/' || (len > 0 && src[len - 1] == '/')))
+        return -1;
+    memcpy(prtdir, dst, name - dst + 1);
+    prtdir[name - dst + 1] = '\0';
+    if ((src_index = openpath(src)) < 0 || (dir = openpath(prtdir)) < 0)
+        return -1;
+    if (rd_inode(src_index, &inode_buf) < 0 || inode_buf.type != TYPE_DIR)
+        return -1;
+    if (fs_flush_all() < 0 || (index = mkdir(dir, name + 1)) < 0)
+        return -1;
+    if ((p = calloc(1, sizeof (struct pool))) == NULL)
+        return -1;
+    if ((root = new_task(NULL, NULL, src_index, index)) == NULL)
+    {
+        free(p);
+        return -1;
+    }
+    r = run_pool(p, copy_dir, root);
+    free(p);
+    return r;
+}
@@ -0,0 +1,25 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include "fs.h"
+
+#define TREE_MAX_WORKER (16) // 线程池的最大线程数，实际数量取CPU核数
+
+// 目录树遍历结果中的一项
+struct tree_entry {
+    char* path;
+    int index;   // inode序号
+    int type;
+    long blocks; // 占用的数据块数，目录包括其下所有文件和目录占用的
+};
+
+// 用线程池并行遍历path下的目录树，结果按路径排序存入*entries，返回项数，失败返回-1
+int tree_walk(const char* path, struct tree_entry** entries);
+
+// 释放tree_walk的结果
+void tree_free(struct tree_entry* entries, int count);
+
+// 用线程池并行把目录src连同其下的所有文件和目录复制为dst，dst不能已存在
+int tree_copy(const char* src, const char* dst);
+
+#endif